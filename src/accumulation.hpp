@@ -0,0 +1,206 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class convergence_summary
+{
+    // How far a progressive render got, written into the output's metadata.
+public:
+    int min_samples = 0;
+    double mean_samples = 0;
+    int max_samples = 0;
+    double relative_error = 0; // mean over the pixels, see accumulation_buffer::relative_error
+};
+
+class accumulation_buffer
+{
+    // Linear radiance summed over every sample taken so far, with per-pixel sample counts
+    // and sums of squared luminance for a noise estimate. Progressive renders add one pass
+    // at a time into it, and it is what a checkpoint holds.
+    // The random streams need no saving: each tile and pass reseeds from the render seed and
+    // the pass's first sample index, so the counts are all a resumed render needs to pick up
+    // the exact same sequence.
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<color> sums;
+    std::vector<double> luminance_squares;
+    std::vector<uint32_t> sample_counts;
+
+    void resize(int w, int h)
+    {
+        width = w;
+        height = h;
+        sums.assign(size_t(w) * h, color(0,0,0));
+        luminance_squares.assign(size_t(w) * h, 0);
+        sample_counts.assign(size_t(w) * h, 0);
+    }
+
+    void add(int x, int y, const color& sum, double luminance_square_sum, int samples)
+    {
+        auto index = size_t(y) * width + x;
+        sums[index] += sum;
+        luminance_squares[index] += luminance_square_sum;
+        sample_counts[index] += uint32_t(samples);
+    }
+
+    int samples(int x, int y) const { return int(sample_counts[size_t(y) * width + x]); }
+
+    color average(int x, int y) const
+    {
+        auto index = size_t(y) * width + x;
+        return sample_counts[index] ? sums[index] / sample_counts[index] : color(0,0,0);
+    }
+
+    int completed_samples() const
+    {
+        // Samples every pixel has, where the next pass starts.
+        return sample_counts.empty() ? 0 : int(*std::min_element(sample_counts.begin(), sample_counts.end()));
+    }
+
+    double relative_error(int x, int y) const
+    {
+        // Standard error of the pixel's mean luminance relative to that mean. Pixels darker
+        // than 1% are measured against 1%, so near-black noise doesn't dominate.
+        auto index = size_t(y) * width + x;
+        double n = sample_counts[index];
+        if (n < 2)
+        {
+            return 1;
+        }
+        double mean = luminance(sums[index]) / n;
+        double variance = std::max(0.0, luminance_squares[index] / n - mean * mean) * n / (n - 1);
+        return std::sqrt(variance / n) / std::max(mean, 0.01);
+    }
+
+    double mean_relative_error(int x0, int y0, int x1, int y1) const
+    {
+        double total = 0;
+        for (int j = y0; j < y1; j++)
+        {
+            for (int i = x0; i < x1; i++)
+            {
+                total += relative_error(i, j);
+            }
+        }
+        return total / std::max(1, (x1 - x0) * (y1 - y0));
+    }
+
+    convergence_summary summary() const
+    {
+        convergence_summary result;
+        if (sample_counts.empty())
+        {
+            return result;
+        }
+        auto range = std::minmax_element(sample_counts.begin(), sample_counts.end());
+        result.min_samples = int(*range.first);
+        result.max_samples = int(*range.second);
+        double total = 0;
+        for (auto count : sample_counts)
+        {
+            total += count;
+        }
+        result.mean_samples = total / sample_counts.size();
+        result.relative_error = mean_relative_error(0, 0, width, height);
+        return result;
+    }
+
+    bool save(const std::string& path, const std::string& key) const
+    {
+        // Written next to path and renamed over it, so a kill mid-write keeps the last checkpoint.
+        auto temporary = path + ".tmp";
+        FILE* file = std::fopen(temporary.c_str(), "wb");
+        if (!file)
+        {
+            std::cerr << "Cannot write checkpoint " << temporary << '\n';
+            return false;
+        }
+        uint32_t header[3] = {uint32_t(width), uint32_t(height), uint32_t(key.size())};
+        std::fwrite(magic, 1, sizeof(magic), file);
+        std::fwrite(header, sizeof(uint32_t), 3, file);
+        std::fwrite(key.data(), 1, key.size(), file);
+        std::fwrite(sums.data(), sizeof(color), sums.size(), file);
+        std::fwrite(luminance_squares.data(), sizeof(double), luminance_squares.size(), file);
+        std::fwrite(sample_counts.data(), sizeof(uint32_t), sample_counts.size(), file);
+        bool ok = !std::ferror(file);
+        ok = (std::fclose(file) == 0) && ok;
+        if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::cerr << "Cannot write checkpoint " << path << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    bool read(const std::string& path, std::string& key)
+    {
+        // Reads any checkpoint, taking its size and returning the settings key it was made with.
+        FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file)
+        {
+            std::cerr << "Cannot read checkpoint " << path << '\n';
+            return false;
+        }
+        char file_magic[sizeof(magic)];
+        uint32_t header[3];
+        bool ok = std::fread(file_magic, 1, sizeof(magic), file) == sizeof(magic)
+               && std::memcmp(file_magic, magic, sizeof(magic)) == 0
+               && std::fread(header, sizeof(uint32_t), 3, file) == 3
+               && header[0] > 0 && header[1] > 0 && header[2] < (1u << 20);
+        if (ok)
+        {
+            resize(int(header[0]), int(header[1]));
+            key.assign(header[2], '\0');
+        }
+        ok = ok && std::fread(&key[0], 1, key.size(), file) == key.size()
+                && std::fread(sums.data(), sizeof(color), sums.size(), file) == sums.size()
+                && std::fread(luminance_squares.data(), sizeof(double), luminance_squares.size(), file) == luminance_squares.size()
+                && std::fread(sample_counts.data(), sizeof(uint32_t), sample_counts.size(), file) == sample_counts.size();
+        std::fclose(file);
+        if (!ok)
+        {
+            std::cerr << "Checkpoint " << path << " is not valid\n";
+        }
+        return ok;
+    }
+
+    bool load(const std::string& path, const std::string& key)
+    {
+        // key describes the render settings; a checkpoint made with other settings is refused.
+        accumulation_buffer loaded;
+        std::string loaded_key;
+        if (!loaded.read(path, loaded_key))
+        {
+            return false;
+        }
+        if (loaded.width != width || loaded.height != height || loaded_key != key)
+        {
+            std::cerr << "Checkpoint " << path << " was made with different render settings\n";
+            return false;
+        }
+        *this = std::move(loaded);
+        return true;
+    }
+
+    void merge(const accumulation_buffer& other)
+    {
+        // Adds another buffer of the same size. Averages then weight each by its sample counts.
+        for (size_t k = 0; k < sums.size(); k++)
+        {
+            sums[k] += other.sums[k];
+            luminance_squares[k] += other.luminance_squares[k];
+            sample_counts[k] += other.sample_counts[k];
+        }
+    }
+
+private:
+    static constexpr char magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '2', '\n'};
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <array>
+#include <sstream>
+#include <string>
+
+// Arbitrary output variables: what each pixel's camera rays hit first, written next to
+// the beauty image so compositing and denoising need no re-render. Albedo, normal and
+// emission are averaged over the samples. Depth and material id come from the first
+// sample, since an average across an edge would name neither side. One-channel values
+// are stored in all three channels.
+
+enum aov_kind { aov_albedo, aov_normal, aov_depth, aov_material_id, aov_emission, aov_kinds };
+
+const char* const aov_names[] = {"albedo", "normal", "depth", "material_id", "emission"};
+
+class aov_sample
+{
+public:
+    color albedo{0,0,0};
+    color normal{0,0,0};   // facing the camera ray, zero where nothing was hit
+    color emission{0,0,0}; // emitted light at the hit, or the environment on a miss
+    double depth = infinity; // distance from the camera along the ray
+    int material_id = -1;
+
+    void add(const aov_sample& sample)
+    {
+        albedo += sample.albedo;
+        normal += sample.normal;
+        emission += sample.emission;
+    }
+
+    color value(aov_kind kind, const aov_sample& first, double sample_scale) const
+    {
+        // Resolves a pixel from the summed samples and the first one.
+        switch (kind)
+        {
+            case aov_albedo:      return albedo * sample_scale;
+            case aov_normal:      return normal * sample_scale;
+            case aov_emission:    return emission * sample_scale;
+            case aov_depth:       return color(first.depth, first.depth, first.depth);
+            case aov_material_id: return color(first.material_id, first.material_id, first.material_id);
+            default:              return color(0,0,0);
+        }
+    }
+};
+
+bool parse_aov_list(const std::string& text, std::array<bool, aov_kinds>& enabled)
+{
+    // Comma separated AOV names, or "all".
+    std::istringstream in(text);
+    std::string name;
+    while (std::getline(in, name, ','))
+    {
+        bool known = false;
+        for (int k = 0; k < aov_kinds; k++)
+        {
+            if (name == aov_names[k] || name == "all")
+            {
+                enabled[k] = true;
+                known = true;
+            }
+        }
+        if (!known)
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,539 @@
+// Rays-per-second benchmark suite.
+//
+//   g++ -std=c++17 -O3 -pthread src/benchmark.cpp -o benchmark
+//   ./benchmark [--filter TEXT] [--width N] [--spp N] [--threads N] [--json PATH] [--perf-counters 1]
+//
+// Micro benchmarks time single routines on pre-generated inputs, macro benchmarks render
+// the built-in scenes at a fixed seed. Results are printed as a table on stderr and as
+// JSON on stdout (or to --json PATH). With --perf-counters 1 each result also carries the
+// hardware counters (Linux perf_event_open) of its measured run, or null when unavailable.
+// A benchmark whose output fails its sanity check makes the run exit with status 1.
+
+#include "common.hpp"
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "constant_medium.hpp"
+#include "grid_medium.hpp"
+#include "material.hpp"
+#include "noise.hpp"
+#include "quad.hpp"
+#include "scene.hpp"
+#include "sparse_volume.hpp"
+#include "sphere.hpp"
+#include "triangle.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class benchmark_result
+{
+public:
+    std::string name;
+    std::string kind; // "micro" or "macro"
+    double wall_seconds = 0;
+    long long operations = 0;
+    double ns_per_op = 0;
+    // macro only
+    int image_width = 0;
+    int image_height = 0;
+    int samples_per_pixel = 0;
+    long long rays = 0;
+    double build_seconds = 0;
+    double mrays_per_second = 0;
+    double samples_per_second = 0;
+    perf_counter_values events;
+    bool failed = false; // the routine's output failed its sanity check
+};
+
+class benchmark_settings
+{
+public:
+    std::string filter;
+    std::string json_path;
+    int image_width = 160;
+    int samples_per_pixel = 16;
+    int thread_count = 0;
+    double min_seconds = 0.25; // each micro benchmark runs at least this long
+    bool count_hardware_events = false;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The sink keeps the optimizer from discarding the work being measured.
+volatile double benchmark_sink = 0;
+
+benchmark_result run_micro(const std::string& name, const benchmark_settings& settings,
+                           const std::function<double(long long)>& batch)
+{
+    // batch(n) performs n operations and returns a value that depends on all of them.
+    thread_rng().reseed(mix_seed(0, std::hash<std::string>()(name)));
+    long long iterations = 1024;
+    double elapsed = 0;
+    double sink = 0;
+    perf_counter_group counters;
+    if (settings.count_hardware_events)
+    {
+        counters.open();
+    }
+    perf_counter_values events;
+    while (true)
+    {
+        counters.start();
+        auto start = std::chrono::steady_clock::now();
+        sink += batch(iterations);
+        elapsed = seconds_since(start);
+        events = counters.read();
+        if (elapsed >= settings.min_seconds)
+        {
+            break;
+        }
+        iterations *= (elapsed < settings.min_seconds / 8) ? 8 : 2;
+    }
+    benchmark_sink = benchmark_sink + sink;
+
+    benchmark_result result;
+    result.name = name;
+    result.kind = "micro";
+    result.wall_seconds = elapsed;
+    result.operations = iterations;
+    result.ns_per_op = elapsed * 1e9 / iterations;
+    result.events = events;
+    return result;
+}
+
+std::vector<ray> rays_toward(const point3& target, double spread, int count)
+{
+    // Rays from a ring of origins aimed at target, jittered by spread so some of them miss.
+    std::vector<ray> rays;
+    for (int k = 0; k < count; k++)
+    {
+        auto origin = target + 10.0 * random_unit_vector();
+        auto aim = target + spread * vec3::random(-1, 1);
+        rays.emplace_back(origin, aim - origin);
+    }
+    return rays;
+}
+
+double hit_batch(const hittable& object, const std::vector<ray>& rays, long long n)
+{
+    hit_record rec;
+    double sum = 0;
+    for (long long k = 0; k < n; k++)
+    {
+        if (object.hit(rays[k & (rays.size() - 1)], interval(0.001, infinity), rec))
+        {
+            sum += rec.t;
+        }
+    }
+    return sum;
+}
+
+double scatter_batch(const material& mat, const std::vector<hit_record>& hits, const std::vector<ray>& rays, long long n)
+{
+    color attenuation;
+    ray scattered;
+    double sum = 0;
+    for (long long k = 0; k < n; k++)
+    {
+        auto index = k & (hits.size() - 1);
+        if (mat.scatter(rays[index], hits[index], attenuation, scattered))
+        {
+            sum += attenuation.x() + scattered.direction().y();
+        }
+    }
+    return sum;
+}
+
+void micro_benchmarks(const benchmark_settings& settings, std::vector<benchmark_result>& results)
+{
+    const int ray_count = 1024; // power of two, indexed with a mask
+    auto wanted = [&](const std::string& name) { return name.find(settings.filter) != std::string::npos; };
+    scene_arena arena;
+    auto mat = arena.make<lambertian>(color(0.5, 0.5, 0.5));
+
+    thread_rng().reseed(42);
+    auto unit_sphere = sphere(point3(0, 0, 0), 1.0, mat);
+    auto sphere_rays = rays_toward(point3(0, 0, 0), 1.5, ray_count);
+    if (wanted("sphere::hit"))
+    {
+        results.push_back(run_micro("sphere::hit", settings, [&](long long n) { return hit_batch(unit_sphere, sphere_rays, n); }));
+    }
+
+    auto unit_quad = quad(point3(-1, -1, 0), vec3(2, 0, 0), vec3(0, 2, 0), mat);
+    if (wanted("quad::hit"))
+    {
+        results.push_back(run_micro("quad::hit", settings, [&](long long n) { return hit_batch(unit_quad, sphere_rays, n); }));
+    }
+
+    auto unit_triangle = triangle(point3(-1, -1, 0), vec3(2, 0, 0), vec3(0, 2, 0), mat);
+    if (wanted("triangle::hit"))
+    {
+        results.push_back(run_micro("triangle::hit", settings, [&](long long n) { return hit_batch(unit_triangle, sphere_rays, n); }));
+    }
+
+    auto box = aabb(point3(-1, -1, -1), point3(1, 1, 1));
+    if (wanted("aabb::hit"))
+    {
+        results.push_back(run_micro("aabb::hit", settings, [&](long long n)
+        {
+            double sum = 0;
+            for (long long k = 0; k < n; k++)
+            {
+                sum += box.hit(sphere_rays[k & (ray_count - 1)], interval(0.001, infinity));
+            }
+            return sum;
+        }));
+    }
+
+    auto boundary = arena.make<sphere>(point3(0, 0, 0), 1.0, mat);
+    auto fog = constant_medium(boundary, 0.5, color(0.5, 0.5, 0.5));
+    if (wanted("constant_medium::hit"))
+    {
+        results.push_back(run_micro("constant_medium::hit", settings, [&](long long n) { return hit_batch(fog, sphere_rays, n); }));
+    }
+    if (wanted("constant_medium::hit(torus boundary)"))
+    {
+        // A concave boundary, whose inside spans come from walking its surface hits.
+        hittable_list torus;
+        tessellated_torus(point3(0, 0, 0), 1.0, 0.4, 64, 32, mat, torus, arena);
+        auto torus_fog = constant_medium(arena.make<bvh_node>(torus, arena), 0.5, color(0.5, 0.5, 0.5));
+        results.push_back(run_micro("constant_medium::hit(torus boundary)", settings, [&](long long n) { return hit_batch(torus_fog, sphere_rays, n); }));
+    }
+
+    if (wanted("grid_medium"))
+    {
+        // Same rays, through a 128^3 cloud of about the same mean density as fog.
+        auto dense = cloud_density(arena, point3(0, 0, 0), 1.0, 128);
+        auto cloud = grid_medium(dense, 1.5, color(0.5, 0.5, 0.5));
+        auto sparse_cloud = grid_medium(sparse_density_grid::from_dense(arena, *dense), 1.5, color(0.5, 0.5, 0.5));
+        results.push_back(run_micro("grid_medium::hit(128^3 cloud)", settings, [&](long long n) { return hit_batch(cloud, sphere_rays, n); }));
+        results.push_back(run_micro("grid_medium::hit(128^3 sparse cloud)", settings, [&](long long n) { return hit_batch(sparse_cloud, sphere_rays, n); }));
+        results.push_back(run_micro("grid_medium::transmittance(128^3 cloud)", settings, [&](long long n)
+        {
+            double sum = 0;
+            for (long long k = 0; k < n; k++)
+            {
+                sum += cloud.transmittance(sphere_rays[k & (ray_count - 1)], interval(0.001, infinity));
+            }
+            return sum;
+        }));
+    }
+
+    if (wanted("bvh_node::hit"))
+    {
+        hittable_list torus;
+        tessellated_torus(point3(0, 0, 0), 2.0, 0.8, 250, 200, mat, torus, arena);
+        auto tree = bvh_node(torus, arena);
+        auto torus_rays = rays_toward(point3(0, 0, 0), 3.0, ray_count);
+        results.push_back(run_micro("bvh_node::hit(100k triangles)", settings, [&](long long n) { return hit_batch(tree, torus_rays, n); }));
+    }
+
+    if (wanted("random_unit_vector"))
+    {
+        results.push_back(run_micro("random_unit_vector", settings, [](long long n)
+        {
+            double sum = 0;
+            for (long long k = 0; k < n; k++)
+            {
+                sum += random_unit_vector().x();
+            }
+            return sum;
+        }));
+    }
+
+    // Hit records on the unit sphere, seen from both sides, for the scatter benchmarks.
+    std::vector<hit_record> hits;
+    std::vector<ray> incoming;
+    for (int k = 0; k < ray_count; k++)
+    {
+        hit_record rec;
+        auto origin = (k % 4 == 0) ? point3(0, 0, 0) : 10.0 * random_unit_vector();
+        ray r(origin, vec3::random(-0.5, 0.5) - origin);
+        if (!unit_sphere.hit(r, interval(0.001, infinity), rec))
+        {
+            k--;
+            continue;
+        }
+        hits.push_back(rec);
+        incoming.push_back(r);
+    }
+
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    std::vector<std::pair<std::string, const material*>> materials = {
+        {"lambertian::scatter", white},
+        {"lambertian(checker)::scatter", arena.make<lambertian>(arena.make<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9), arena))},
+        {"metal::scatter", arena.make<metal>(color(0.5, 0.5, 0.5))},
+        {"metal(fuzz)::scatter", arena.make<metal>(color(0.5, 0.5, 0.5), 0.3)},
+        {"dielectric::scatter", arena.make<dielectric>(1.5)},
+        {"diffuse_light::scatter", arena.make<diffuse_light>(color(15, 15, 15))},
+        {"one_sided_material::scatter", arena.make<one_sided_material>(white)},
+        {"isotropic::scatter", arena.make<isotropic>(color(0.15, 0.65, 0.9))},
+    };
+    for (const auto& [name, material] : materials)
+    {
+        if (wanted(name))
+        {
+            results.push_back(run_micro(name, settings, [&](long long n) { return scatter_batch(*material, hits, incoming, n); }));
+        }
+    }
+
+    // Noise textures at the same hit points, one lookup per call and through value_batch.
+    std::vector<double> hit_u, hit_v;
+    std::vector<point3> hit_points;
+    for (const auto& rec : hits)
+    {
+        hit_u.push_back(rec.u);
+        hit_v.push_back(rec.v);
+        hit_points.push_back(4.0 * rec.p);
+    }
+    std::vector<color> texture_values(ray_count);
+    for (auto basis : {perlin_basis, simplex_basis})
+    {
+        auto name = std::string(basis == perlin_basis ? "noise_texture(perlin marble)" : "noise_texture(simplex marble)");
+        auto marble = noise_texture(basis, noise_marble, 1.0, 7, color(.9, .9, .9), color(.2, .2, .3));
+        if (wanted(name + "::value"))
+        {
+            results.push_back(run_micro(name + "::value", settings, [&](long long n)
+            {
+                double sum = 0;
+                for (long long k = 0; k < n; k++)
+                {
+                    auto index = k & (ray_count - 1);
+                    sum += marble.value(hit_u[index], hit_v[index], hit_points[index]).x();
+                }
+                return sum;
+            }));
+        }
+        if (wanted(name + "::value_batch"))
+        {
+            results.push_back(run_micro(name + "::value_batch", settings, [&](long long n)
+            {
+                double sum = 0;
+                for (long long k = 0; k < n; k += ray_count)
+                {
+                    int count = int(std::min<long long>(ray_count, n - k));
+                    marble.value_batch(count, hit_u.data(), hit_v.data(), hit_points.data(), texture_values.data());
+                    sum += texture_values[count - 1].x();
+                }
+                return sum;
+            }));
+        }
+    }
+
+    if (wanted("write_color"))
+    {
+        std::vector<color> colors;
+        for (int k = 0; k < ray_count; k++)
+        {
+            colors.push_back(vec3::random(0, 1.2));
+        }
+        std::vector<unsigned char> pixels(3 * ray_count);
+        results.push_back(run_micro("write_color", settings, [&](long long n)
+        {
+            for (long long k = 0; k < n; k++)
+            {
+                auto index = k & (ray_count - 1);
+                write_color(&pixels[3 * index], colors[index]);
+            }
+            return double(pixels[0] + pixels[3 * ray_count - 1]);
+        }));
+    }
+
+    if (wanted("atrous_denoiser::apply"))
+    {
+        // One 32x32 image per operation: a lit disk against the sky, whose misses sit at
+        // the 1e20 depth set_guides gives them, next to hits a few units away.
+        const int size = 32;
+        denoise_buffers input;
+        input.resize(size, size);
+        for (int y = 0; y < size; y++)
+        {
+            for (int x = 0; x < size; x++)
+            {
+                auto offset = vec3(x - size / 2 + 0.5, y - size / 2 + 0.5, 0);
+                bool hit = offset.length() < size / 3;
+                input.set_color(x, y, hit ? vec3::random(0, 1) : color(0.5, 0.7, 1.0));
+                input.set_guides(x, y, hit ? color(.5, .5, .5) : color(0, 0, 0), hit ? vec3(0, 0, 1) : vec3(0, 0, 0),
+                                 hit ? 2 + offset.length_squared() / 64 : infinity);
+            }
+        }
+        denoise_buffers image;
+        auto result = run_micro("atrous_denoiser::apply", settings, [&](long long n)
+        {
+            double sum = 0;
+            for (long long k = 0; k < n; k++)
+            {
+                image = input;
+                atrous_denoiser().apply(image, 1);
+                sum += image.get(size / 2, size / 2).x();
+            }
+            return sum;
+        });
+        for (int y = 0; y < size; y++)
+        {
+            for (int x = 0; x < size; x++)
+            {
+                auto pixel = image.get(x, y);
+                if (!std::isfinite(pixel.x()) || !std::isfinite(pixel.y()) || !std::isfinite(pixel.z()))
+                {
+                    result.failed = true;
+                }
+            }
+        }
+        if (result.failed)
+        {
+            std::cerr << "atrous_denoiser::apply: non-finite pixels next to the sky\n";
+        }
+        results.push_back(result);
+    }
+}
+
+void macro_benchmarks(const benchmark_settings& settings, std::vector<benchmark_result>& results)
+{
+    for (const std::string scene_name : {"cornell", "spheres", "mesh"})
+    {
+        std::string name = "render/" + scene_name;
+        if (name.find(settings.filter) == std::string::npos)
+        {
+            continue;
+        }
+
+        auto build_start = std::chrono::steady_clock::now();
+        scene s;
+        build_scene(scene_name, s);
+        s.build_bvh();
+        double build_seconds = seconds_since(build_start);
+
+        auto& cam = s.cam;
+        cam.image_width = settings.image_width;
+        cam.samples_per_pixel = settings.samples_per_pixel;
+        cam.thread_count = settings.thread_count;
+        cam.seed = 1;
+        cam.output_path = "";
+        cam.count_hardware_events = settings.count_hardware_events;
+
+        auto start = std::chrono::steady_clock::now();
+        cam.render(s.world);
+        double elapsed = seconds_since(start);
+
+        benchmark_result result;
+        result.name = name;
+        result.kind = "macro";
+        result.wall_seconds = elapsed;
+        result.image_width = cam.image_width;
+        result.image_height = std::max(1, int(cam.image_width / cam.aspect_ratio));
+        result.samples_per_pixel = cam.samples_per_pixel;
+        result.operations = (long long)result.image_width * result.image_height * result.samples_per_pixel;
+        result.ns_per_op = elapsed * 1e9 / result.operations;
+        result.rays = cam.rays_traced;
+        result.build_seconds = build_seconds;
+        result.mrays_per_second = cam.rays_traced / elapsed * 1e-6;
+        result.samples_per_second = result.operations / elapsed;
+        result.events = cam.stats.perf_by_phase[stat_phase_render];
+        results.push_back(result);
+    }
+}
+
+std::string results_to_json(const benchmark_settings& settings, const std::vector<benchmark_result>& results)
+{
+    std::ostringstream out;
+    out.precision(6);
+    out << "{\n  \"settings\": {\"image_width\": " << settings.image_width
+        << ", \"samples_per_pixel\": " << settings.samples_per_pixel
+        << ", \"threads\": " << settings.thread_count << ", \"seed\": 1},\n";
+    out << "  \"benchmarks\": [\n";
+    for (size_t k = 0; k < results.size(); k++)
+    {
+        const auto& r = results[k];
+        out << "    {\"name\": \"" << r.name << "\", \"kind\": \"" << r.kind << "\""
+            << ", \"wall_seconds\": " << r.wall_seconds
+            << ", \"operations\": " << r.operations
+            << ", \"ns_per_op\": " << r.ns_per_op;
+        if (r.kind == "macro")
+        {
+            out << ", \"image_width\": " << r.image_width
+                << ", \"image_height\": " << r.image_height
+                << ", \"samples_per_pixel\": " << r.samples_per_pixel
+                << ", \"rays\": " << r.rays
+                << ", \"build_seconds\": " << r.build_seconds
+                << ", \"mrays_per_second\": " << r.mrays_per_second
+                << ", \"samples_per_second\": " << r.samples_per_second;
+        }
+        if (settings.count_hardware_events)
+        {
+            out << ", \"perf_counters\": " << r.events.to_json();
+        }
+        out << "}" << (k + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+int main(int argc, char** argv)
+{
+    benchmark_settings settings;
+    if (argc % 2 == 0)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--filter TEXT] [--width N] [--spp N] [--threads N] [--min-time SEC] [--json PATH] [--perf-counters 0|1]\n";
+        return 2;
+    }
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        std::string value = argv[i + 1];
+        if (arg == "--filter")       settings.filter = value;
+        else if (arg == "--json")    settings.json_path = value;
+        else if (arg == "--width")   settings.image_width = std::stoi(value);
+        else if (arg == "--spp")     settings.samples_per_pixel = std::stoi(value);
+        else if (arg == "--threads") settings.thread_count = std::stoi(value);
+        else if (arg == "--min-time") settings.min_seconds = std::stod(value);
+        else if (arg == "--perf-counters") settings.count_hardware_events = (value != "0");
+        else
+        {
+            std::cerr << "Unknown option " << arg << '\n';
+            return 2;
+        }
+    }
+
+    std::vector<benchmark_result> results;
+    micro_benchmarks(settings, results);
+    macro_benchmarks(settings, results);
+
+    std::clog << '\n';
+    for (const auto& r : results)
+    {
+        std::clog << r.name << std::string(r.name.size() < 32 ? 32 - r.name.size() : 1, ' ');
+        if (r.kind == "micro")
+        {
+            std::clog << r.ns_per_op << " ns/op\n";
+        }
+        else
+        {
+            std::clog << r.wall_seconds << " s, " << r.mrays_per_second << " Mrays/s, "
+                      << r.samples_per_second << " samples/s\n";
+        }
+    }
+
+    bool failed = std::any_of(results.begin(), results.end(), [](const benchmark_result& r) { return r.failed; });
+    auto json = results_to_json(settings, results);
+    if (settings.json_path.empty())
+    {
+        std::cout << json;
+        return failed ? 1 : 0;
+    }
+    if (!ensure_parent_directory(settings.json_path))
+    {
+        return 1;
+    }
+    std::ofstream(settings.json_path) << json;
+    return failed ? 1 : 0;
+}
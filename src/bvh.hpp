@@ -0,0 +1,79 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "scene_arena.hpp"
+
+#include <algorithm>
+
+class bvh_node : public hittable
+{
+public:
+    bvh_node(hittable_list list, scene_arena& arena) : bvh_node(list.objects, 0, list.objects.size(), arena) {}
+
+    bvh_node(hittable_list list, scene_arena& arena, bool convex_surface) : bvh_node(list, arena)
+    {
+        // The objects form one closed convex surface (load_obj can tell), for media bounded by it.
+        is_convex = convex_surface;
+    }
+
+    bvh_node(std::vector<const hittable*>& objects, size_t start, size_t end, scene_arena& arena)
+    {
+        // Split along the longest axis of the span's bounds, at the median centroid. Nodes are
+        // placed in the arena as they are built, which lays the tree out depth first.
+        bbox = aabb::empty;
+        for (size_t object_index = start; object_index < end; object_index++)
+        {
+            bbox = aabb(bbox, objects[object_index]->bounding_box());
+        }
+
+        int axis = bbox.longest_axis();
+        size_t object_span = end - start;
+
+        if (object_span == 1)
+        {
+            left = right = objects[start];
+        }
+        else if (object_span == 2)
+        {
+            left = objects[start];
+            right = objects[start+1];
+        }
+        else
+        {
+            auto mid = start + object_span/2;
+            std::nth_element(objects.begin() + start, objects.begin() + mid, objects.begin() + end,
+                [axis](const hittable* a, const hittable* b)
+                {
+                    return a->bounding_box().centroid()[axis] < b->bounding_box().centroid()[axis];
+                });
+            left = arena.make<bvh_node>(objects, start, mid, arena);
+            right = arena.make<bvh_node>(objects, mid, end, arena);
+        }
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+    {
+        STAT_INC(bvh_nodes_visited);
+        if (!bbox.hit(r, ray_t))
+        {
+            return false;
+        }
+
+        bool hit_left = left->hit(r, ray_t, rec);
+        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+
+        return hit_left || hit_right;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool convex() const override { return is_convex; }
+
+private:
+    const hittable* left;
+    const hittable* right;
+    aabb bbox;
+    bool is_convex = false;
+};
@@ -1,10 +1,79 @@
 #pragma once
 
+#include "accumulation.hpp"
+#include "aov.hpp"
+#include "denoiser.hpp"
+#include "distributed.hpp"
+#include "heatmap.hpp"
 #include "hittable.hpp"
+#include "image_io.hpp"
+#include "image_stream.hpp"
 #include "material.hpp"
+#include "primary_cache.hpp"
+#include "trace.hpp"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+
+class tile_buffer
+{
+    // One tile's traced samples: radiance and squared luminance summed per pixel, and the
+    // AOVs when they were recorded.
+public:
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    std::vector<color> sums;
+    std::vector<double> luminance_squares;
+    std::array<std::vector<color>, aov_kinds> aovs;
+    bool has_aovs = false;
+
+    size_t index(int i, int j) const { return size_t(j - y0) * (x1 - x0) + (i - x0); }
+
+    void pack(std::vector<double>& out) const
+    {
+        // Sums then squares, as sent from worker to coordinator.
+        out.clear();
+        for (const auto& sum : sums)
+        {
+            out.insert(out.end(), {sum.x(), sum.y(), sum.z()});
+        }
+        out.insert(out.end(), luminance_squares.begin(), luminance_squares.end());
+    }
+
+    bool unpack(const std::vector<char>& data)
+    {
+        // Reads what pack wrote into a tile whose bounds are already set.
+        size_t pixel_count = size_t(x1 - x0) * (y1 - y0);
+        if (data.size() != pixel_count * 4 * sizeof(double))
+        {
+            return false;
+        }
+        std::vector<double> values(pixel_count * 4);
+        std::memcpy(values.data(), data.data(), data.size());
+        sums.resize(pixel_count);
+        luminance_squares.assign(values.begin() + 3 * pixel_count, values.end());
+        for (size_t k = 0; k < pixel_count; k++)
+        {
+            sums[k] = color(values[3*k], values[3*k + 1], values[3*k + 2]);
+        }
+        has_aovs = false;
+        return true;
+    }
+};
 
 class camera
 {
@@ -16,13 +85,67 @@ private:
     point3 pixel00_loc; // location of pixel 0,0
     unsigned char* image;
     vec3 u, v, w; // camera basis vector
+    vec3 defocus_disk_u, defocus_disk_v; // lens radius along u and v
+    int tiles_x, tiles_y;
+    pixel_cost_map heatmaps;
+    // Shared only so that an idle camera, whose streams are all null, can be copied.
+    std::shared_ptr<tile_stream> stream;
+    std::array<std::shared_ptr<tile_stream>, aov_kinds> aov_streams;
+    std::array<bool, aov_kinds> recorded_aovs{};
+    denoise_buffers denoise_input;
+    accumulation_buffer accumulation;
+    bool aov_pass = false; // whether the current pass records AOVs and denoising guides
+    bool guides_only = false; // whether the current pass leaves the image alone and only records those
+    primary_hit_cache* primary = nullptr; // primary_hits if this render can use it
+    std::vector<double> tile_sample_seconds; // thread time per sample of each tile's last pass
+    std::chrono::steady_clock::time_point deadline_end;
+    convergence_summary convergence; // of the held image, for the output metadata
+
+    // The raster that is rendered and written: the crop window, or the whole frame with only
+    // the window traced. Tiles, buffers and outputs all use raster coordinates.
+    int raster_width, raster_height;
+    int raster_x0, raster_y0; // frame pixel of raster pixel 0,0
+    int window_x0, window_y0, window_x1, window_y1; // traced part of the raster
 
     void initialize()
     {
         image_height = int( image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height; //ensure it's atleast 1
 
-        image = (unsigned char*) malloc(image_width * image_height * 3);
+        // The crop window, in frame pixels. The projection below always spans the full frame.
+        int crop_left = 0, crop_top = 0, crop_right = image_width, crop_bottom = image_height;
+        if (crop_x1 > crop_x0 && crop_y1 > crop_y0)
+        {
+            double scale_x = crop_normalized ? image_width : 1;
+            double scale_y = crop_normalized ? image_height : 1;
+            crop_left = std::clamp(int(std::floor(crop_x0 * scale_x)), 0, image_width - 1);
+            crop_top = std::clamp(int(std::floor(crop_y0 * scale_y)), 0, image_height - 1);
+            crop_right = std::clamp(int(std::ceil(crop_x1 * scale_x)), crop_left + 1, image_width);
+            crop_bottom = std::clamp(int(std::ceil(crop_y1 * scale_y)), crop_top + 1, image_height);
+        }
+        if (crop_keep_frame)
+        {
+            raster_width = image_width;
+            raster_height = image_height;
+            raster_x0 = raster_y0 = 0;
+            window_x0 = crop_left;
+            window_y0 = crop_top;
+            window_x1 = crop_right;
+            window_y1 = crop_bottom;
+        }
+        else
+        {
+            raster_width = crop_right - crop_left;
+            raster_height = crop_bottom - crop_top;
+            raster_x0 = crop_left;
+            raster_y0 = crop_top;
+            window_x0 = window_y0 = 0;
+            window_x1 = raster_width;
+            window_y1 = raster_height;
+        }
+
+        // Out-of-core renders stream every tile, so the full image is never allocated.
+        image = out_of_core ? nullptr : (unsigned char*) malloc(size_t(raster_width) * raster_height * 3);
 
         camera_center = lookfrom;
 
@@ -45,6 +168,855 @@ private:
 
         auto viewport_upper_left = camera_center - (focal_length * w) - viewport_u/2 - viewport_v/2;
         pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
+
+        // The lens is a disk around lookfrom, focused on the plane through lookat.
+        auto defocus_radius = focal_length * std::tan(degrees_to_radians(defocus_angle / 2));
+        defocus_disk_u = u * defocus_radius;
+        defocus_disk_v = v * defocus_radius;
+
+        tile_size = (tile_size < 1) ? 1 : tile_size;
+        tiles_x = (raster_width + tile_size - 1) / tile_size;
+        tiles_y = (raster_height + tile_size - 1) / tile_size;
+
+        if (write_heatmaps)
+        {
+            heatmaps.resize(raster_width, raster_height);
+        }
+        if (denoise)
+        {
+            denoise_input.resize(raster_width, raster_height);
+        }
+        if (holds_image())
+        {
+            accumulation.resize(raster_width, raster_height);
+        }
+        tile_sample_seconds.assign(deadline > 0 ? tiles_x * tiles_y : 0, 0.0);
+    }
+
+    int worker_count() const
+    {
+        if (thread_count > 0)
+        {
+            return thread_count;
+        }
+        int hardware = int(std::thread::hardware_concurrency());
+        return (hardware < 1) ? 1 : hardware;
+    }
+
+    bool progressive() const { return !checkpoint_path.empty() || deadline > 0 || write_previews; }
+
+    bool sharded() const { return shard_count > 0 || !coordinator_address.empty(); }
+
+    bool holds_image() const
+    {
+        // Progressive, denoised and sharded renders keep linear sums for the whole image and
+        // only write it once the last pass is done.
+        return progressive() || denoise || sharded();
+    }
+
+    void tile_bounds(int tile_index, int& x0, int& y0, int& x1, int& y1) const
+    {
+        x0 = (tile_index % tiles_x) * tile_size;
+        y0 = (tile_index / tiles_x) * tile_size;
+        x1 = std::min(x0 + tile_size, raster_width);
+        y1 = std::min(y0 + tile_size, raster_height);
+    }
+
+    void trace_tile(const hittable& world, const work_unit& unit, bool record_aovs, tile_buffer& tile)
+    {
+        // Traces the unit's samples for every pixel of its tile into tile.
+        tile_bounds(unit.tile, tile.x0, tile.y0, tile.x1, tile.y1);
+
+        // Every tile and sample range draws from its own stream, so the image only depends on
+        // the seed and how the samples were split, not on threads, processes or interruptions.
+        auto tile_seed = mix_seed(seed, unit.tile);
+        thread_rng().reseed(unit.first_sample == 0 ? tile_seed : mix_seed(tile_seed, unit.first_sample));
+
+        size_t pixel_count = size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+        tile.sums.assign(pixel_count, color(0,0,0));
+        tile.luminance_squares.assign(pixel_count, 0.0);
+        tile.has_aovs = record_aovs;
+        for (int k = 0; k < aov_kinds; k++)
+        {
+            if (recorded_aovs[k] && record_aovs)
+            {
+                tile.aovs[k].resize(pixel_count);
+            }
+        }
+        auto sample_scale = 1.0 / unit.sample_count;
+
+        for (int j = tile.y0; j < tile.y1 && !cancelled(); j++)
+        {
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                if (i < window_x0 || i >= window_x1 || j < window_y0 || j >= window_y1)
+                {
+                    continue; // outside the crop window, left black
+                }
+                std::chrono::steady_clock::time_point pixel_start;
+                long long rays_before = 0, steps_before = 0;
+                if (write_heatmaps)
+                {
+                    const auto& counters = thread_stats();
+                    rays_before = counters.total_rays();
+                    steps_before = counters.traversal_steps();
+                    pixel_start = std::chrono::steady_clock::now();
+                }
+
+                color pixel_color(0,0,0);
+                double square_sum = 0;
+                aov_sample first_hit, hit_sum, hit;
+                for (int sample = 0; sample < unit.sample_count; sample++)
+                {
+                    auto sample_color = trace_sample(world, i, j, unit.first_sample + sample, record_aovs ? &hit : nullptr);
+                    pixel_color += sample_color;
+                    square_sum += luminance(sample_color) * luminance(sample_color);
+                    if (record_aovs)
+                    {
+                        if (sample == 0) first_hit = hit;
+                        hit_sum.add(hit);
+                    }
+                }
+                size_t index = tile.index(i, j);
+                tile.sums[index] = pixel_color;
+                tile.luminance_squares[index] = square_sum;
+                for (int k = 0; k < aov_kinds && record_aovs; k++)
+                {
+                    if (recorded_aovs[k])
+                    {
+                        tile.aovs[k][index] = hit_sum.value(aov_kind(k), first_hit, sample_scale);
+                    }
+                }
+
+                if (write_heatmaps)
+                {
+                    const auto& counters = thread_stats();
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - pixel_start;
+                    heatmaps.record(i, j, elapsed.count(), counters.total_rays() - rays_before, counters.traversal_steps() - steps_before);
+                }
+            }
+        }
+    }
+
+    void add_tile(const tile_buffer& tile, int sample_count)
+    {
+        // Adds traced sums to the held image, and the denoising guides if the tile has them.
+        for (int j = tile.y0; j < tile.y1; j++)
+        {
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                size_t index = tile.index(i, j);
+                if (!guides_only)
+                {
+                    accumulation.add(i, j, tile.sums[index], tile.luminance_squares[index], sample_count);
+                }
+                if (denoise && tile.has_aovs)
+                {
+                    denoise_input.set_guides(i, j, tile.aovs[aov_albedo][index], tile.aovs[aov_normal][index],
+                                             tile.aovs[aov_depth][index].x());
+                }
+            }
+        }
+    }
+
+    void render_tile(const hittable& world, const work_unit& unit)
+    {
+        TRACE_SCOPE("tile", unit.tile);
+        auto tile_start = std::chrono::steady_clock::now();
+
+        // Radiance is gathered into a tile-local buffer first, then resolved into the image.
+        thread_local tile_buffer tile;
+        bool record_aovs = aov_pass && std::find(recorded_aovs.begin(), recorded_aovs.end(), true) != recorded_aovs.end();
+        trace_tile(world, unit, record_aovs, tile);
+        if (cancelled())
+        {
+            return; // the tile may be half traced, and the render is thrown away anyway
+        }
+
+        if (!tile_sample_seconds.empty())
+        {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - tile_start;
+            tile_sample_seconds[unit.tile] = elapsed.count() / unit.sample_count;
+        }
+
+        TRACE_SCOPE("resolve", unit.tile);
+        if (holds_image())
+        {
+            add_tile(tile, unit.sample_count);
+        }
+        else
+        {
+            for (auto& pixel : tile.sums)
+            {
+                pixel /= unit.sample_count;
+            }
+            output_tile(tile.x0, tile.y0, tile.x1, tile.y1, tile.sums);
+        }
+        for (int k = 0; k < aov_kinds && record_aovs; k++)
+        {
+            if (aov_streams[k])
+            {
+                aov_streams[k]->write_tile(tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0, tile.aovs[k].data());
+            }
+        }
+    }
+
+    std::vector<work_unit> continue_tiles(const std::vector<int>& tiles, int sample_count) const
+    {
+        // Units adding sample_count samples to each tile, after the samples it already holds.
+        std::vector<work_unit> units;
+        for (int tile : tiles)
+        {
+            int x0, y0, x1, y1;
+            tile_bounds(tile, x0, y0, x1, y1);
+            units.push_back({tile, holds_image() ? accumulation.samples(x0, y0) : 0, sample_count});
+        }
+        return units;
+    }
+
+    std::vector<int> all_tiles() const
+    {
+        std::vector<int> tiles(tiles_x * tiles_y);
+        std::iota(tiles.begin(), tiles.end(), 0);
+        return tiles;
+    }
+
+    std::vector<work_unit> frame_units() const
+    {
+        // The frame as distributed work: every tile in sample ranges of shard_samples, or whole
+        // when that is 0. Tile by tile, so every shard_count-th unit splits the frame by tiles
+        // when a range covers all samples, and by samples when there are shard_count ranges.
+        int range = (shard_samples > 0) ? std::min(shard_samples, samples_per_pixel) : samples_per_pixel;
+        std::vector<work_unit> units;
+        for (int tile = 0; tile < tiles_x * tiles_y; tile++)
+        {
+            for (int first = 0; first < samples_per_pixel; first += range)
+            {
+                units.push_back({tile, first, std::min(range, samples_per_pixel - first)});
+            }
+        }
+        return units;
+    }
+
+    bool render_shard(const hittable& world)
+    {
+        // Renders this process's share of the frame units and saves it for the merge tool.
+        std::vector<work_unit> units;
+        auto frame = frame_units();
+        for (size_t k = shard_index; k < frame.size(); k += shard_count)
+        {
+            units.push_back(frame[k]);
+        }
+        std::clog << "Shard " << shard_index << '/' << shard_count << ": " << units.size() << " of " << frame.size() << " units\n";
+        render_tiles(world, units);
+        TRACE_SCOPE("checkpoint");
+        return accumulation.save(checkpoint_path, checkpoint_key(world));
+    }
+
+    bool coordinate_workers(const hittable& world)
+    {
+        // Hands the frame units to whichever worker connection is free and adds the sums they
+        // send back. A worker that disconnects, or holds its unit longer than worker_timeout,
+        // has the unit put back at the front of the queue for the next free one.
+        int listener = open_socket(coordinator_address, true);
+        if (listener < 0)
+        {
+            return false;
+        }
+        auto key = checkpoint_key(world);
+        auto units = frame_units();
+        std::deque<work_unit> queue(units.begin(), units.end());
+
+        class connection
+        {
+        public:
+            std::unique_ptr<socket_channel> channel;
+            bool ready = false; // said hello with matching settings
+            bool busy = false;  // has unit outstanding
+            work_unit unit;
+            std::chrono::steady_clock::time_point sent; // when unit was handed out
+        };
+        std::vector<connection> workers;
+        size_t completed = 0;
+        std::vector<char> payload;
+        tile_buffer tile;
+
+        auto drop = [&](connection& worker, const char* reason)
+        {
+            if (worker.busy)
+            {
+                std::clog << "\rWorker " << reason << ", tile " << worker.unit.tile << " samples "
+                          << worker.unit.first_sample << '+' << worker.unit.sample_count << " go back in the queue\n";
+                queue.push_front(worker.unit);
+            }
+            worker.channel.reset();
+        };
+
+        std::clog << "Waiting for workers on " << coordinator_address << '\n';
+        while (completed < units.size())
+        {
+            for (auto& worker : workers)
+            {
+                if (worker.channel && worker.ready && !worker.busy && !queue.empty())
+                {
+                    worker.unit = queue.front();
+                    queue.pop_front();
+                    worker.busy = true;
+                    worker.sent = std::chrono::steady_clock::now();
+                    if (!worker.channel->send(message_unit, worker.unit))
+                    {
+                        drop(worker, "lost");
+                    }
+                }
+            }
+            workers.erase(std::remove_if(workers.begin(), workers.end(), [](const connection& worker) { return !worker.channel; }),
+                          workers.end());
+
+            // Wakes up in time for the first outstanding unit to run out.
+            auto now = std::chrono::steady_clock::now();
+            auto wait = std::chrono::milliseconds(-1);
+            std::vector<pollfd> fds{{listener, POLLIN, 0}};
+            for (const auto& worker : workers)
+            {
+                fds.push_back({worker.channel->descriptor(), POLLIN, 0});
+                if (worker.busy)
+                {
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        worker.sent + std::chrono::duration<double>(worker_timeout) - now);
+                    left = std::max(left, std::chrono::milliseconds(0)) + std::chrono::milliseconds(1);
+                    wait = (wait.count() < 0) ? left : std::min(wait, left);
+                }
+            }
+            if (::poll(fds.data(), fds.size(), int(std::min<long long>(wait.count(), 1 << 30))) < 0)
+            {
+                if (errno == EINTR) continue;
+                std::cerr << "Polling workers failed: " << std::strerror(errno) << '\n';
+                ::close(listener);
+                return false;
+            }
+
+            for (size_t k = 0; k + 1 < fds.size(); k++)
+            {
+                if (!(fds[k + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                {
+                    continue;
+                }
+                auto& worker = workers[k];
+                message_header header;
+                if (!worker.channel->receive(header, payload))
+                {
+                    drop(worker, "lost");
+                }
+                else if (header.kind == message_hello && !worker.ready)
+                {
+                    worker.ready = (std::string(payload.begin(), payload.end()) == key);
+                    if (!worker.ready)
+                    {
+                        std::string reason = "Coordinator refused a worker with different render settings";
+                        std::clog << '\r' << reason << '\n';
+                        worker.channel->send(message_done, work_unit(), reason.data(), reason.size());
+                        drop(worker, "refused");
+                    }
+                }
+                else if (header.kind == message_result && worker.busy && header.unit.tile == worker.unit.tile
+                         && header.unit.first_sample == worker.unit.first_sample)
+                {
+                    tile_bounds(worker.unit.tile, tile.x0, tile.y0, tile.x1, tile.y1);
+                    if (!tile.unpack(payload))
+                    {
+                        drop(worker, "sent a malformed result");
+                        continue;
+                    }
+                    add_tile(tile, worker.unit.sample_count);
+                    worker.busy = false;
+                    completed++;
+                    std::clog << "\rUnits remaining: " << (units.size() - completed) << ' ' << std::flush;
+                }
+                else
+                {
+                    drop(worker, "sent an unexpected message");
+                }
+            }
+            for (auto& worker : workers)
+            {
+                if (worker.channel && worker.busy
+                    && std::chrono::steady_clock::now() - worker.sent > std::chrono::duration<double>(worker_timeout))
+                {
+                    drop(worker, "timed out");
+                }
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                int fd = ::accept(listener, nullptr, nullptr);
+                if (fd >= 0)
+                {
+                    // Bounds a result that stops halfway; a silent worker is caught above.
+                    set_socket_timeout(fd, 30);
+                    connection added;
+                    added.channel = std::make_unique<socket_channel>(fd);
+                    workers.push_back(std::move(added));
+                }
+            }
+        }
+
+        for (auto& worker : workers)
+        {
+            if (worker.channel)
+            {
+                worker.channel->send(message_done, work_unit());
+            }
+        }
+        ::close(listener);
+        return checkpoint_path.empty() || accumulation.save(checkpoint_path, key);
+    }
+
+    bool serve_coordinator(const hittable& world)
+    {
+        // Worker side: one connection per render thread, each rendering the units it is sent
+        // until the coordinator says it is done.
+        auto key = checkpoint_key(world);
+        std::atomic<bool> failed{false};
+        std::atomic<int> units_done{0};
+        std::mutex stats_mutex;
+
+        auto worker = [&](int worker_index)
+        {
+            thread_stats() = render_stats();
+            int fd = open_socket(worker_address, false);
+            if (fd < 0)
+            {
+                failed = true;
+                return;
+            }
+            socket_channel channel(fd);
+            tile_buffer tile;
+            message_header header;
+            std::vector<char> payload;
+            std::vector<double> result;
+            bool ok = channel.send(message_hello, work_unit(), key.data(), key.size());
+            while (ok && channel.receive(header, payload) && header.kind == message_unit)
+            {
+                TRACE_SCOPE("tile", header.unit.tile);
+                trace_tile(world, header.unit, false, tile);
+                tile.pack(result);
+                ok = channel.send(message_result, header.unit, result.data(), result.size() * sizeof(double));
+                int done = ++units_done;
+                if (worker_index == 0)
+                {
+                    std::clog << "\rUnits rendered: " << done << ' ' << std::flush;
+                }
+            }
+            if (!ok || header.kind != message_done || !payload.empty())
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                std::cerr << '\r' << (payload.empty() || header.kind != message_done ? "Lost the coordinator"
+                                                                                    : std::string(payload.begin(), payload.end())) << '\n';
+                failed = true;
+            }
+
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            stats.merge(thread_stats());
+        };
+
+        std::vector<std::thread> threads;
+        for (int t = 1; t < worker_count(); t++)
+        {
+            threads.emplace_back(worker, t);
+        }
+        worker(0);
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        return !failed;
+    }
+
+    void output_tile(int x0, int y0, int x1, int y1, const std::vector<color>& pixels)
+    {
+        // Hands finished linear colors to the 8-bit image and the output stream.
+        if (image)
+        {
+            for (int j = y0; j < y1; j++)
+            {
+                for (int i = x0; i < x1; i++)
+                {
+                    write_color(image + 3 * (size_t(j) * raster_width + i), pixels[size_t(j - y0) * (x1 - x0) + (i - x0)]);
+                }
+            }
+        }
+        if (stream)
+        {
+            stream->write_tile(x0, y0, x1 - x0, y1 - y0, pixels.data());
+        }
+    }
+
+    void output_held_image()
+    {
+        // Resolves the accumulated sums, denoised if asked for, and writes them tile by tile.
+        if (denoise)
+        {
+            TRACE_SCOPE("denoise");
+            perf_phase_totals events(count_hardware_events, stats.perf_by_phase[stat_phase_denoise]);
+            perf_phase_scope counters(&events);
+            for (int j = 0; j < raster_height; j++)
+            {
+                for (int i = 0; i < raster_width; i++)
+                {
+                    denoise_input.set_color(i, j, accumulation.average(i, j));
+                }
+            }
+            atrous_denoiser().apply(denoise_input, worker_count(), &events);
+        }
+
+        std::vector<color> pixels;
+        for (int tile = 0; tile < tiles_x * tiles_y; tile++)
+        {
+            int x0, y0, x1, y1;
+            tile_bounds(tile, x0, y0, x1, y1);
+            pixels.clear();
+            for (int j = y0; j < y1; j++)
+            {
+                for (int i = x0; i < x1; i++)
+                {
+                    pixels.push_back(denoise ? denoise_input.get(i, j) : accumulation.average(i, j));
+                }
+            }
+            output_tile(x0, y0, x1, y1, pixels);
+        }
+        convergence = accumulation.summary();
+        denoise_input = denoise_buffers();
+        accumulation = accumulation_buffer();
+    }
+
+    std::string checkpoint_key(const hittable& world) const
+    {
+        // Everything a checkpoint's samples depend on that can be checked cheaply.
+        std::ostringstream key;
+        auto box = world.bounding_box();
+        key.precision(17);
+        key << image_width << 'x' << image_height << " raster " << raster_width << 'x' << raster_height
+            << '+' << raster_x0 << '+' << raster_y0 << " window " << window_x0 << ' ' << window_y0 << ' '
+            << window_x1 << ' ' << window_y1 << " tile " << tile_size << " seed " << seed
+            << " bounces " << max_bounces << " from " << lookfrom << " at " << lookat << " up " << up
+            << " vfov " << vfov << " environment " << use_environment_light << " filtering " << texture_filtering
+            << " world " << box.x.min << ' ' << box.y.min << ' ' << box.z.min
+            << ' ' << box.x.max << ' ' << box.y.max << ' ' << box.z.max;
+        if (defocus_angle > 0)
+        {
+            key << " defocus " << defocus_angle; // only when set, so pinhole checkpoints still match
+        }
+        return key.str();
+    }
+
+    bool prepare_primary_hits(const hittable& world) const
+    {
+        // Whether primary_hits can be used: it needs a fixed sample count, every sample of
+        // the frame rendered here, and a scene file whose materials it can refer to.
+        if (!primary_hits->usable() || max_bounces <= 0)
+        {
+            std::clog << "The primary hit cache needs a scene file, not using it\n";
+            return false;
+        }
+        if (deadline > 0 || time_budget > 0 || resume || sharded() || !worker_address.empty())
+        {
+            std::clog << "The primary hit cache can't follow time limits, resume or distribute, not using it\n";
+            return false;
+        }
+        if (!primary_hits->prepare(checkpoint_key(world), raster_width, raster_height, samples_per_pixel))
+        {
+            std::clog << "The primary hits of " << samples_per_pixel << " spp would take more than "
+                      << (primary_hit_cache::max_bytes >> 20) << " MB, not caching them\n";
+            return false;
+        }
+        std::clog << (primary_hits->replaying ? "Shading from cached primary hits\n" : "Recording primary hits\n");
+        return true;
+    }
+
+    double pass_seconds_estimate(const std::vector<int>& tiles, int sample_count) const
+    {
+        // Wall time a pass over tiles should take, from what each tile cost last time. The
+        // tiles spread over the workers, but no pass is faster than its slowest tile.
+        double total = 0, slowest = 0;
+        for (int tile : tiles)
+        {
+            total += tile_sample_seconds[tile];
+            slowest = std::max(slowest, tile_sample_seconds[tile]);
+        }
+        return sample_count * std::max(total / worker_count(), slowest);
+    }
+
+    int affordable_samples(const std::vector<int>& tiles, int limit) const
+    {
+        // Largest pass over tiles, up to limit samples, expected to finish by the deadline.
+        std::chrono::duration<double> remaining = deadline_end - std::chrono::steady_clock::now();
+        double per_sample = pass_seconds_estimate(tiles, 1);
+        if (per_sample <= 0)
+        {
+            return limit;
+        }
+        return int(std::clamp(remaining.count() / per_sample, 0.0, double(limit)));
+    }
+
+    std::vector<int> noisiest_tiles() const
+    {
+        // Up to a quarter of the tiles, those with the highest mean relative error among the
+        // ones still short of samples_per_pixel, noisiest first. Empty once all have it.
+        std::vector<std::pair<double, int>> noise;
+        int tile_count = tiles_x * tiles_y;
+        for (int tile = 0; tile < tile_count; tile++)
+        {
+            int x0, y0, x1, y1;
+            tile_bounds(tile, x0, y0, x1, y1);
+            if (accumulation.samples(x0, y0) < samples_per_pixel)
+            {
+                noise.emplace_back(accumulation.mean_relative_error(x0, y0, x1, y1), tile);
+            }
+        }
+        std::sort(noise.begin(), noise.end(), std::greater<>());
+        std::vector<int> tiles;
+        for (size_t k = 0; k < std::min(noise.size(), std::max<size_t>(1, tile_count / 4)); k++)
+        {
+            tiles.push_back(noise[k].second);
+        }
+        return tiles;
+    }
+
+    void pass_finished(int samples_done)
+    {
+        if (write_previews && preview_files && !output_path.empty())
+        {
+            TRACE_SCOPE("preview");
+            write_preview();
+        }
+        if (on_pass)
+        {
+            on_pass(samples_done);
+        }
+    }
+
+    bool write_preview() const
+    {
+        // The image so far, in the output's format, to preview_path().
+        auto format = output_format.empty() ? image_format_from_path(output_path) : output_format;
+        std::vector<color> pixels(size_t(raster_width) * raster_height);
+        for (int j = 0; j < raster_height; j++)
+        {
+            for (int i = 0; i < raster_width; i++)
+            {
+                pixels[size_t(j) * raster_width + i] = accumulation.average(i, j);
+            }
+        }
+        if (is_float_format(format))
+        {
+            return write_float_image(preview_path(), format, raster_width, raster_height, pixels.data());
+        }
+        std::vector<unsigned char> rgb(pixels.size() * 3);
+        for (size_t k = 0; k < pixels.size(); k++)
+        {
+            write_color(&rgb[3 * k], pixels[k]);
+        }
+        return write_image(preview_path(), format, raster_width, raster_height, rgb.data(), worker_count());
+    }
+
+    bool render_passes(const hittable& world)
+    {
+        // Progressive rendering: passes of samples_per_pass samples accumulate into the
+        // buffer. With a checkpoint_path it is saved every checkpoint_interval seconds and
+        // at the end, and resuming continues from the samples the checkpoint holds.
+        //
+        // With a deadline, the first pass takes one sample to measure what every tile costs,
+        // and each later pass is cut down to what should still fit, up to samples_per_pixel.
+        // Once not even one more sample of the whole image fits, refine_noisy_tiles spends
+        // what is left on the noisiest tiles.
+        auto key = checkpoint_key(world);
+        if (!checkpoint_path.empty() && resume && std::filesystem::exists(checkpoint_path))
+        {
+            if (!accumulation.load(checkpoint_path, key))
+            {
+                return false;
+            }
+            std::clog << "Resuming from " << accumulation.completed_samples() << " samples per pixel\n";
+        }
+
+        auto last_save = std::chrono::steady_clock::now();
+        auto save_checkpoint = [&](bool final)
+        {
+            std::chrono::duration<double> since_save = std::chrono::steady_clock::now() - last_save;
+            if (checkpoint_path.empty() || (!final && since_save.count() < checkpoint_interval))
+            {
+                return true;
+            }
+            TRACE_SCOPE("checkpoint");
+            last_save = std::chrono::steady_clock::now();
+            return accumulation.save(checkpoint_path, key);
+        };
+
+        // AOVs and denoising guides come from the first pass of this run, so a render that is
+        // already at its target still traces one sample for them when they are wanted, kept
+        // out of the image.
+        bool needs_aov_pass = std::find(recorded_aovs.begin(), recorded_aovs.end(), true) != recorded_aovs.end();
+        auto tiles = all_tiles();
+        int done = accumulation.completed_samples();
+        bool first_pass = true;
+        bool out_of_time = false;
+        while (done < samples_per_pixel || (first_pass && needs_aov_pass))
+        {
+            int count = std::max(1, std::min(samples_per_pass, samples_per_pixel - done));
+            if (first_pass && (deadline > 0 || write_previews))
+            {
+                count = 1; // measures tile costs, and gets a first preview out quickly
+            }
+            else if (deadline > 0)
+            {
+                count = affordable_samples(tiles, count);
+                if (count < 1)
+                {
+                    out_of_time = true;
+                    break;
+                }
+            }
+            aov_pass = first_pass;
+            guides_only = done >= samples_per_pixel;
+            render_tiles(world, continue_tiles(tiles, count));
+            bool image_unchanged = guides_only;
+            guides_only = false;
+            if (cancelled())
+            {
+                return false;
+            }
+            first_pass = false;
+            if (image_unchanged)
+            {
+                std::clog << "\rThe checkpoint already holds " << done << " samples per pixel, traced one more for the AOVs only\n";
+                continue;
+            }
+            done += count;
+            std::clog << "\rPass done: " << done << '/' << samples_per_pixel << " samples per pixel\n";
+            pass_finished(done);
+            if (!save_checkpoint(false))
+            {
+                return false;
+            }
+        }
+
+        aov_pass = false;
+        while (out_of_time && refine_noisy_tiles)
+        {
+            auto noisy = noisiest_tiles();
+            int count = noisy.empty() ? 0 : affordable_samples(noisy, samples_per_pass);
+            if (count < 1)
+            {
+                break;
+            }
+            auto units = continue_tiles(noisy, count);
+            for (auto& unit : units)
+            {
+                // No tile goes past samples_per_pixel.
+                unit.sample_count = std::min(unit.sample_count, samples_per_pixel - unit.first_sample);
+            }
+            render_tiles(world, units);
+            if (cancelled())
+            {
+                return false;
+            }
+            std::clog << "\rRefined " << noisy.size() << " tiles by up to " << count << " samples per pixel\n";
+            pass_finished(int(accumulation.summary().mean_samples));
+            if (!save_checkpoint(false))
+            {
+                return false;
+            }
+        }
+        return save_checkpoint(true);
+    }
+
+    bool open_stream()
+    {
+        // Streamed formats are written tile by tile during the render instead of at the end.
+        stream.reset();
+        auto format = output_format.empty() ? image_format_from_path(output_path) : output_format;
+        if (!open_aov_streams(format))
+        {
+            return false;
+        }
+        bool streamed = is_streamed_format(format) || (out_of_core && format == "png");
+        if (out_of_core && !output_path.empty() && !streamed)
+        {
+            std::cerr << "Out-of-core output needs png, ppm, pfm or qoi, not " << format << '\n';
+            return false;
+        }
+        if (output_path.empty() || !streamed)
+        {
+            return true;
+        }
+        if (!ensure_parent_directory(output_path))
+        {
+            return false;
+        }
+        stream = make_tile_stream(format, tile_size);
+        if (!stream->open(output_path, raster_width, raster_height))
+        {
+            std::cerr << "Failed to write " << output_path << '\n';
+            stream.reset();
+            return false;
+        }
+        return true;
+    }
+
+    bool open_aov_streams(const std::string& format)
+    {
+        // AOVs go next to the output (test_albedo.exr, ...), in its format when that is a
+        // float one and as pfm otherwise.
+        auto aov_format = is_float_format(format) ? format : "pfm";
+        for (int k = 0; k < aov_kinds; k++)
+        {
+            // The denoiser is guided by albedo, normal and depth, written or not.
+            recorded_aovs[k] = write_aovs[k] || (denoise && (k == aov_albedo || k == aov_normal || k == aov_depth));
+            aov_streams[k].reset();
+            if (!write_aovs[k] || output_path.empty())
+            {
+                continue;
+            }
+            auto path = sibling_image_path(output_path, aov_names[k], aov_format);
+            aov_streams[k] = make_tile_stream(aov_format, tile_size);
+            if (!ensure_parent_directory(path) || !aov_streams[k]->open(path, raster_width, raster_height))
+            {
+                std::cerr << "Failed to write " << path << '\n';
+                aov_streams[k].reset();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void fit_samples_to_budget(const hittable& world)
+    {
+        // Traces one sample on a sparse pixel grid to estimate the cost of a full pass,
+        // then lowers samples_per_pixel so the whole render fits in time_budget seconds.
+        TRACE_SCOPE("time budget calibration");
+        auto start = std::chrono::steady_clock::now();
+        thread_rng().reseed(mix_seed(seed, ~0ull));
+
+        const int stride = 8;
+        long traced = 0;
+        for (int j = window_y0 + stride / 2; j < window_y1; j += stride)
+        {
+            for (int i = window_x0 + stride / 2; i < window_x1; i += stride)
+            {
+                ray_color(get_ray(raster_x0 + i, raster_y0 + j), max_bounces, world);
+                traced++;
+            }
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double window_pixels = double(window_x1 - window_x0) * (window_y1 - window_y0);
+        double seconds_per_pass = elapsed.count() / std::max(traced, 1L) * window_pixels / worker_count();
+        double remaining = time_budget - elapsed.count();
+        int affordable = (seconds_per_pass > 0) ? int(remaining / seconds_per_pass) : samples_per_pixel;
+        affordable = std::clamp(affordable, 1, samples_per_pixel);
+
+        std::clog << "Time budget " << time_budget << "s: " << affordable << " samples per pixel\n";
+        samples_per_pixel = affordable;
     }
 
     vec3 sample_square() const
@@ -57,8 +1029,27 @@ private:
     {
         auto offset = sample_square();
         auto pixel_sample_center = pixel00_loc + ((i + offset.x()) * pixel_delta_u) + ((j + offset.y()) * pixel_delta_v);
-        auto ray_direction = pixel_sample_center - camera_center;
-        return ray(camera_center, ray_direction);
+        auto ray_origin = (defocus_angle <= 0) ? camera_center : defocus_disk_sample();
+        auto ray_direction = pixel_sample_center - ray_origin;
+        ray r(ray_origin, ray_direction);
+        add_differentials(r);
+        return r;
+    }
+
+    point3 defocus_disk_sample() const
+    {
+        // A random point on the lens.
+        auto p = random_in_unit_disk();
+        return camera_center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
+    }
+
+    void add_differentials(ray& r) const
+    {
+        // The neighbouring pixels' rays leave from the same point, one pixel delta apart.
+        if (texture_filtering)
+        {
+            r.set_differentials(vec3(), vec3(), pixel_delta_u, pixel_delta_v);
+        }
     }
 
     color environmental_light(const ray&r) const
@@ -71,31 +1062,286 @@ private:
         return lerp(startcolor, endcolor, a);
     }
 
-    color ray_color(const ray& r, int depth ,const hittable& world) const
+    color trace_sample(const hittable& world, int i, int j, int sample, aov_sample* first_hit) const
     {
+        // One camera sample of raster pixel i,j. With a primary hit cache the camera ray's
+        // hit is recorded into it, or taken from it instead of tracing the ray.
+        if (!primary)
+        {
+            return ray_color(get_ray(raster_x0 + i, raster_y0 + j), max_bounces, world, first_hit);
+        }
+        auto& cached = primary->at(i, j, sample);
+        auto& generator = thread_rng();
+        if (primary->replaying && cached.kind != primary_retrace)
+        {
+            hit_record rec;
+            primary->load(cached, rec);
+            generator.state = cached.rng_state;
+            ray r(camera_center, cached.direction);
+            add_differentials(r);
+            return shade(r, cached.kind == primary_surface, rec, max_bounces, world, first_hit);
+        }
+        if (primary->replaying)
+        {
+            generator.state = cached.rng_state;
+            return ray_color(get_ray(raster_x0 + i, raster_y0 + j), max_bounces, world, first_hit);
+        }
+
+        cached.kind = primary_retrace;
+        cached.rng_state = generator.state;
+        auto r = get_ray(raster_x0 + i, raster_y0 + j);
+        STAT_RAY(stat_camera_ray);
+        hit_record rec;
+        bool hit = world.hit(r, interval(0.001, infinity), rec);
+        if (hit)
+        {
+            rec.set_differentials(r);
+        }
+        primary->store(cached, r, hit, rec, generator.state);
+        return shade(r, hit, rec, max_bounces, world, first_hit);
+    }
+
+    void path_ended(int depth) const
+    {
+        STAT_INC(path_length[std::min(max_bounces - depth, int(render_stats::max_path_length))]);
+    }
+
+    color ray_color(const ray& r, int depth ,const hittable& world, aov_sample* first_hit = nullptr) const
+    {
+        // first_hit, when given, receives what this ray hits for the AOVs.
         if (depth <= 0)
         {
+            path_ended(depth);
             return color(0,0,0);
         }
 
+        STAT_RAY(depth == max_bounces ? stat_camera_ray : stat_bounce_ray);
         hit_record rec;
+        bool hit = world.hit(r, interval(0.001, infinity), rec);
+        if (hit)
+        {
+            rec.set_differentials(r);
+        }
+        return shade(r, hit, rec, depth, world, first_hit);
+    }
 
-        if (world.hit(r, interval(0.001, infinity), rec))
+    color shade(const ray& r, bool hit, const hit_record& rec, int depth, const hittable& world, aov_sample* first_hit) const
+    {
+        // The rest of ray_color once r has been traced to rec.
+        if (hit)
         {
             ray scattered;
             color attenuation;
             color emission_color = rec.mat->emitted(rec.u, rec.v, rec.p);
+            aov_sample* look_past = nullptr;
+            if (first_hit && rec.mat->passes_through(rec))
+            {
+                look_past = first_hit;
+            }
+            else if (first_hit)
+            {
+                first_hit->albedo = rec.mat->surface_albedo(rec);
+                first_hit->normal = rec.normal;
+                first_hit->emission = emission_color;
+                first_hit->depth = rec.t * r.direction().length();
+                first_hit->material_id = rec.mat->id;
+            }
             if (rec.mat->scatter(r, rec, attenuation, scattered))
             {
-                color scatter_color = attenuation * ray_color(scattered, depth-1, world);
+                color scatter_color = attenuation * ray_color(scattered, depth-1, world, look_past);
+                if (look_past)
+                {
+                    look_past->depth += rec.t * r.direction().length();
+                }
                 return emission_color + scatter_color;
             }
             // no scatter ray
+            path_ended(depth);
             return emission_color;
         }
         // no hit
-        //return environmental_light(r);
-        return color(0,0,0);
+        path_ended(depth);
+        color background = use_environment_light ? environmental_light(r) : color(0,0,0);
+        if (first_hit)
+        {
+            *first_hit = aov_sample();
+            first_hit->emission = background;
+        }
+        return background;
+    }
+
+    void render_tiles(const hittable& world, const std::vector<work_unit>& units)
+    {
+        // Renders the units on all workers, in order as far as the threads allow.
+        TRACE_SCOPE("render tiles");
+        int tile_count = int(units.size());
+        std::atomic<int> next_tile{0};
+        std::atomic<int> tiles_done{0};
+        std::mutex stats_mutex;
+
+        // Out of core, a tile may only start when its band is within band_window bands of the
+        // oldest unfinished one. That bounds the bands the output stream holds at any time.
+        std::vector<int> band_tiles_left(out_of_core ? tiles_y : 0, tiles_x);
+        int oldest_band = 0;
+        int band_window = std::max(2, worker_count() / tiles_x + 2);
+        std::mutex band_mutex;
+        std::condition_variable band_finished;
+
+        auto worker = [&](int worker_index)
+        {
+            bool report_progress = (worker_index == 0);
+            thread_stats() = render_stats();
+            perf_counter_group counters;
+            if (count_hardware_events && counters.open())
+            {
+                counters.start();
+            }
+
+            for (int next = next_tile++; next < tile_count && !cancelled(); next = next_tile++)
+            {
+                int tile = units[next].tile;
+                int band = tile / tiles_x;
+                if (out_of_core)
+                {
+                    std::unique_lock<std::mutex> lock(band_mutex);
+                    band_finished.wait(lock, [&] { return band < oldest_band + band_window || cancelled(); });
+                }
+
+                render_tile(world, units[next]);
+
+                if (out_of_core)
+                {
+                    std::lock_guard<std::mutex> lock(band_mutex);
+                    if (--band_tiles_left[band] == 0)
+                    {
+                        while (oldest_band < tiles_y && band_tiles_left[oldest_band] == 0)
+                        {
+                            oldest_band++;
+                        }
+                        band_finished.notify_all();
+                    }
+                }
+                int done = ++tiles_done;
+                if (report_progress)
+                {
+                    std::clog << "\rTiles remaining: " << (tile_count - done) << ' ' << std::flush;
+                }
+            }
+            if (out_of_core)
+            {
+                // Wakes workers waiting on a band that a cancelled render will never finish.
+                std::lock_guard<std::mutex> lock(band_mutex);
+                band_finished.notify_all();
+            }
+            auto& thread_counters = thread_stats();
+            perf_counter_values events;
+            if (counters.is_open())
+            {
+                events = counters.read();
+                thread_counters.perf_by_phase[stat_phase_render].merge(events);
+            }
+
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            stats.merge(thread_counters);
+            if (events.valid)
+            {
+                // One entry per worker, summed over the passes.
+                if (int(stats.perf_by_thread.size()) <= worker_index)
+                {
+                    stats.perf_by_thread.resize(worker_index + 1);
+                }
+                stats.perf_by_thread[worker_index].merge(events);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int t = 1; t < worker_count(); t++)
+        {
+            threads.emplace_back(worker, t);
+        }
+        worker(0);
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    png_text render_metadata() const
+    {
+        // What a deadline render achieved, as key and value pairs.
+        auto number = [](double value)
+        {
+            std::ostringstream text;
+            text << value;
+            return text.str();
+        };
+        return {
+            {"deadline_seconds", number(deadline)},
+            {"render_seconds", number(stats.phase_seconds[stat_phase_render])},
+            {"samples_per_pixel", number(convergence.mean_samples)},
+            {"min_samples_per_pixel", number(convergence.min_samples)},
+            {"max_samples_per_pixel", number(convergence.max_samples)},
+            {"relative_error", number(convergence.relative_error)},
+        };
+    }
+
+    bool write_metadata(const png_text& metadata) const
+    {
+        // Next to the output as JSON (test.png -> test_render.json), whatever its format.
+        auto path = sibling_image_path(output_path, "render", "json");
+        std::ofstream out(path);
+        out << "{\n";
+        for (size_t k = 0; k < metadata.size(); k++)
+        {
+            out << "  \"" << metadata[k].first << "\": " << metadata[k].second << (k + 1 < metadata.size() ? ",\n" : "\n");
+        }
+        out << "}\n";
+        if (!out)
+        {
+            std::cerr << "Failed to write " << path << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    bool write_output()
+    {
+        TRACE_SCOPE("encode");
+        // This thread and the PNG encoder's helpers; streamed outputs are encoded on the
+        // render threads and count in the render phase.
+        perf_phase_totals events(count_hardware_events, stats.perf_by_phase[stat_phase_encode]);
+        perf_phase_scope counters(&events);
+        bool written = true;
+        // Deadline renders also note how far they got, in PNG text chunks and a JSON file.
+        auto metadata = (deadline > 0) ? render_metadata() : png_text();
+        if (stream)
+        {
+            written = stream->close();
+            stream.reset();
+        }
+        else if (!output_path.empty())
+        {
+            written = write_image(output_path, output_format, raster_width, raster_height, image, worker_count(), metadata,
+                                  &events);
+        }
+        if (!metadata.empty() && !output_path.empty())
+        {
+            written = write_metadata(metadata) && written;
+        }
+        for (auto& aov_stream : aov_streams)
+        {
+            if (aov_stream)
+            {
+                written = aov_stream->close() && written;
+                aov_stream.reset();
+            }
+        }
+        free(image);
+        if (write_heatmaps && !output_path.empty())
+        {
+            written = heatmaps.write(output_path, output_format) && written;
+        }
+        return written;
     }
 
 public:
@@ -104,32 +1350,158 @@ public:
     int samples_per_pixel = 10;
     int max_bounces = 10;
     double vfov = 60; //vertical view angle
+    double defocus_angle = 0; // degrees the rays through a pixel spread over, seen from lookat; 0 is a pinhole
 
     point3 lookfrom = point3(0,0,0);
     point3 lookat = point3(0,0,-1);
     vec3 up = vec3(0,1,0); // Camera up
- 
-    void render(const hittable& world)
+    bool use_environment_light = false; // sky gradient instead of black for escaped rays
+    bool texture_filtering = true; // ray differentials pick image texture mip levels; false point samples the finest
+
+    int thread_count = 0;      // 0 uses every hardware thread
+    int tile_size = 32;        // tiles are the unit of work handed to threads
+    uint64_t seed = 0;
+    double time_budget = 0;    // seconds, 0 means unlimited
+    std::string output_path = "output/test.png";
+    std::string output_format; // empty infers it from output_path, an empty output_path skips writing
+    bool write_heatmaps = false; // also write per-pixel time/rays/steps images next to output_path
+    bool count_hardware_events = false; // per-thread perf_event_open counters, reported in stats
+    bool out_of_core = false;  // render band by band and stream to disk, never holding the full image
+    std::array<bool, aov_kinds> write_aovs{}; // AOV images written next to output_path
+    bool denoise = false;      // filter the image guided by albedo, normal and depth before writing
+    std::string checkpoint_path; // non-empty renders progressively and saves the sums here
+    bool resume = false;       // continue from checkpoint_path if it exists
+    int samples_per_pass = 16; // progressive pass size
+    double checkpoint_interval = 60; // seconds between checkpoints, one is always saved at the end
+    double deadline = 0;       // seconds for the whole render, progressive passes stop before it; 0 means none
+    bool refine_noisy_tiles = false; // with a deadline, spend time left after the last full pass on the noisiest tiles
+    std::string coordinator_address; // non-empty hands the frame to worker processes instead of rendering it
+    std::string worker_address;      // non-empty renders units for the coordinator there and writes no image
+    int shard_samples = 0;     // samples per distributed work unit, 0 keeps tiles whole
+    double worker_timeout = 600; // seconds a worker may hold a unit before it is given to another
+    int shard_index = 0;       // with shard_count > 0, render only every shard_count-th unit from
+    int shard_count = 0;       // shard_index on and save the partial sums to checkpoint_path
+    bool write_previews = false; // render in passes and write the image so far to preview_path() after each
+    bool preview_files = true; // false leaves writing the previews to on_pass
+    std::function<void(int samples_done)> on_pass; // called after every progressive pass
+    std::atomic<bool>* cancel = nullptr; // set from another thread to stop; render() then returns false without writing
+    primary_hit_cache* primary_hits = nullptr; // records camera ray hits, or shades from them if they still match
+    // Crop window: only rays for [crop_x0, crop_x1) x [crop_y0, crop_y1) are traced, with the
+    // full frame's projection. In pixels, or fractions of the frame if crop_normalized. An
+    // empty window renders the whole frame.
+    double crop_x0 = 0, crop_y0 = 0, crop_x1 = 0, crop_y1 = 0;
+    bool crop_normalized = false;
+    bool crop_keep_frame = false; // write a full-size image with only the window filled, not just the window
+
+    render_stats stats;        // filled in by render(), merged from every worker thread
+    long long rays_traced = 0; // filled in by render()
+
+    bool cancelled() const
     {
+        return cancel && cancel->load(std::memory_order_relaxed);
+    }
+
+    // The held image of a progressive render, in on_pass. It is the crop window if there is one.
+    int held_width() const { return raster_width; }
+    int held_height() const { return raster_height; }
+    color held_pixel(int i, int j) const { return accumulation.average(i, j); }
+
+    std::string preview_path() const
+    {
+        return sibling_image_path(output_path, "preview", "");
+    }
+
+    bool render(const hittable& world)
+    {
+        auto render_start = std::chrono::steady_clock::now();
+        stats = render_stats();
+        if (out_of_core && (write_heatmaps || holds_image()))
+        {
+            std::cerr << "Heatmaps, denoising and checkpoints cover the full image and can't be combined with out-of-core output\n";
+            return false;
+        }
+        if (deadline > 0 && time_budget > 0)
+        {
+            std::cerr << "Use either a time budget or a deadline, not both\n";
+            return false;
+        }
+        if ((sharded() || !worker_address.empty())
+            && (denoise || write_heatmaps || deadline > 0 || time_budget > 0 || resume
+                || std::find(write_aovs.begin(), write_aovs.end(), true) != write_aovs.end()))
+        {
+            std::cerr << "Distributed renders can't denoise, resume, follow a time limit or write heatmaps and AOVs\n";
+            return false;
+        }
+        if (shard_count > 0 && checkpoint_path.empty())
+        {
+            std::cerr << "A shard needs a checkpoint path to save its samples to\n";
+            return false;
+        }
+        deadline_end = render_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                          std::chrono::duration<double>(deadline));
         initialize();
-        for (size_t j = 0; j < image_height; j++)
+        primary = (primary_hits && prepare_primary_hits(world)) ? primary_hits : nullptr;
+        if (!worker_address.empty())
         {
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-            for (size_t i = 0; i < image_width; i++)
-            {
-                color pixel_color(0,0,0);
-                for (size_t sample = 0; sample < samples_per_pixel; sample++)
-                {
-                    auto r = get_ray(i, j);
-                    pixel_color += ray_color(r,max_bounces,world);
-                }
-                write_color(image, pixel_color * (1.0 / samples_per_pixel));
-            } 
+            bool served = serve_coordinator(world);
+            free(image);
+            rays_traced = stats.total_rays();
+            stats.phase_seconds[stat_phase_render] += std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count();
+            std::clog << "\rDone.                    \n";
+            return served;
         }
-        stbi_write_png("output/test.png", image_width, image_height, 3 , (void*)image, image_width*3);
-        free(image);
+        if (!open_stream())
+        {
+            free(image);
+            return false;
+        }
+        if (time_budget > 0)
+        {
+            fit_samples_to_budget(world);
+        }
+        bool rendered = true;
+        if (!coordinator_address.empty())
+        {
+            rendered = coordinate_workers(world);
+        }
+        else if (shard_count > 0)
+        {
+            rendered = render_shard(world);
+        }
+        else if (progressive())
+        {
+            rendered = render_passes(world);
+        }
+        else
+        {
+            aov_pass = true;
+            render_tiles(world, continue_tiles(all_tiles(), samples_per_pixel));
+        }
+        if (!rendered || cancelled())
+        {
+            free(image);
+            return false;
+        }
+        if (primary && !primary->replaying)
+        {
+            primary->finish();
+        }
+
+        rays_traced = stats.total_rays();
+        auto denoise_start = std::chrono::steady_clock::now();
+        stats.phase_seconds[stat_phase_render] += std::chrono::duration<double>(denoise_start - render_start).count();
+        if (holds_image())
+        {
+            output_held_image();
+        }
+        auto encode_start = std::chrono::steady_clock::now();
+        stats.phase_seconds[stat_phase_denoise] += std::chrono::duration<double>(encode_start - denoise_start).count();
+
+        bool written = write_output();
+        stats.phase_seconds[stat_phase_encode] += std::chrono::duration<double>(std::chrono::steady_clock::now() - encode_start).count();
 
         std::clog << "\rDone.                    \n";
+        return written;
     }
 
 };
\ No newline at end of file
@@ -5,6 +5,12 @@
 
 using color = vec3;
 
+double luminance(const color& c)
+{
+    // Rec. 709 weights.
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 double linear_to_gamma(double linear_component)
 {
     if (linear_component > 0)
@@ -14,10 +20,8 @@ double linear_to_gamma(double linear_component)
     return 0;
 }
 
-void write_color(unsigned char* image, const color& pixel_color)
+void write_color(unsigned char* pixel, const color& pixel_color)
 {
-    static int pixels_written = 0;
-
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -33,9 +37,7 @@ void write_color(unsigned char* image, const color& pixel_color)
     int gbyte = int(256*intensity.clamp(g));
     int bbyte = int(256*intensity.clamp(b));
 
-    image[pixels_written*3 + 0] = rbyte;
-    image[pixels_written*3 + 1] = gbyte;
-    image[pixels_written*3 + 2] = bbyte;
-
-    pixels_written++;
+    pixel[0] = rbyte;
+    pixel[1] = gbyte;
+    pixel[2] = bbyte;
 }
\ No newline at end of file
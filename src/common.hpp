@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
@@ -18,10 +19,53 @@ double degrees_to_radians(double degrees)
     return degrees * pi / 180.0;
 }
 
+uint64_t mix_seed(uint64_t seed, uint64_t value)
+{
+    // splitmix64 finalizer, used to derive independent streams from (seed, value) pairs.
+    uint64_t z = seed + 0x9e3779b97f4a7c15ull * (value + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+class rng
+{
+public:
+    // PCG32: small state, cheap to reseed, safe to keep one per thread.
+    uint64_t state;
+    uint64_t inc;
+
+    rng(uint64_t seed = 0) { reseed(seed); }
+
+    void reseed(uint64_t seed)
+    {
+        state = 0;
+        inc = (mix_seed(seed, 0x5851f42d4c957f2dull) << 1) | 1;
+        next_uint();
+        state += mix_seed(seed, 0);
+        next_uint();
+    }
+
+    uint32_t next_uint()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+        uint32_t rot = uint32_t(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+};
+
+rng& thread_rng()
+{
+    thread_local rng generator;
+    return generator;
+}
+
 double random_double()
 {
     // returns a random real in [0,1).
-    return std::rand() / (RAND_MAX+1.0);
+    return thread_rng().next_uint() * (1.0 / 4294967296.0);
 }
 
 double random_double(double min, double max)
@@ -33,6 +77,7 @@ double random_double(double min, double max)
 // Common headers
 
 #include "interval.hpp"
+#include "stats.hpp"
 #include "color.hpp"
 #include "ray.hpp"
 #include "vec3.hpp"
\ No newline at end of file
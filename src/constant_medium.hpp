@@ -7,59 +7,61 @@
 class constant_medium : public hittable
 {
 private:
-    std::shared_ptr<hittable> boundary;
+    const hittable* boundary;
+    bool convex_boundary; // at most one span, so none is searched for past it
     double neg_inv_density;
-    std::shared_ptr<material> phase_function;
+    isotropic phase_function; // held here, so it lives wherever the medium does
 
 public:
-    constant_medium(std::shared_ptr<hittable> boundary, double density, std::shared_ptr<texture> tex)
-        : boundary(boundary), neg_inv_density(-1/density), phase_function(std::make_shared<isotropic>(tex)) {}
-    constant_medium(std::shared_ptr<hittable> boundary, double density, const color& albedo)
-        : boundary(boundary), neg_inv_density(-1/density), phase_function(std::make_shared<isotropic>(albedo)) {}
+    constant_medium(const hittable* boundary, double density, const texture* tex)
+        : boundary(boundary), convex_boundary(boundary->convex()), neg_inv_density(-1/density), phase_function(tex) {}
+    constant_medium(const hittable* boundary, double density, const color& albedo)
+        : boundary(boundary), convex_boundary(boundary->convex()), neg_inv_density(-1/density), phase_function(albedo) {}
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
-    {
-        hit_record rec1, rec2;
+    void set_material_id(int id) { phase_function.id = id; }
 
-        if (!boundary->hit(r, interval::universe, rec1))
-        {
-            return false;
-        }
+    aabb bounding_box() const override { return boundary->bounding_box(); }
 
-        if (!boundary->hit(r, interval(rec1.t+0.0001,infinity), rec2))
-        {
-            return false;
-        }
-        
-        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
-
-        if (rec1.t >= rec2.t)
-        {
-            return false;
-        }
-        
-        if (rec1.t < 0)
-        {
-            rec1.t = 0;
-        }
-        
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+    {
+        // One exponentially distributed free path, spent across the boundary's inside spans
+        // in order; the boundary may be concave or made of several shells. Spans are asked for
+        // one at a time and only within ray_t: most paths end in the first one, and a convex
+        // boundary has no second, so neither costs a search past it.
+        STAT_INC(intersection_tests[stat_medium]);
         auto ray_length = r.direction().length();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-        auto hit_distance = neg_inv_density * std::log(random_double());
-
-        if (hit_distance > distance_inside_boundary)
+        double hit_distance = -1; // drawn at the first span that overlaps ray_t
+        auto search = interval(std::fmax(ray_t.min, 0.0), ray_t.max);
+        interval span;
+        while (search.min < search.max && boundary->inside_spans(r, search, &span, 1) == 1)
         {
-            return false;
-        }
-        
-        rec.t = rec1.t + hit_distance / ray_length;
-        rec.p = r.at(rec.t);
+            search.min = span.max + 0.0001;
+            if (span.min >= span.max)
+            {
+                continue;
+            }
+            if (hit_distance < 0)
+            {
+                hit_distance = neg_inv_density * std::log(random_double());
+            }
+            auto distance_inside_boundary = span.size() * ray_length;
+            if (hit_distance <= distance_inside_boundary)
+            {
+                rec.t = span.min + hit_distance / ray_length;
+                rec.p = r.at(rec.t);
 
-        rec.normal = vec3(1,0,0);
-        rec.front_face = true;
-        rec.mat = phase_function;
-
-        return true;
+                rec.normal = vec3(1,0,0);
+                rec.front_face = true;
+                rec.dpdu = rec.dpdv = vec3(); // no surface, so no texture footprint
+                rec.mat = &phase_function;
+                return true;
+            }
+            hit_distance -= distance_inside_boundary;
+            if (convex_boundary)
+            {
+                break;
+            }
+        }
+        return false;
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Raw deflate (RFC 1951) with fixed Huffman codes, the same coding stb_image_write uses,
+// but able to compress independent pieces of one stream. Every piece but the last ends
+// with an empty stored block, which byte-aligns it, so compressed pieces can simply be
+// concatenated into a valid stream. The adler32/crc32 helpers let the pieces' checksums
+// be combined without touching the data again.
+
+class bit_writer
+{
+public:
+    std::vector<unsigned char>& out;
+    uint32_t buffer = 0;
+    int count = 0;
+
+    bit_writer(std::vector<unsigned char>& out) : out(out) {}
+
+    void add(uint32_t bits, int length)
+    {
+        // Appends length bits, least significant first.
+        buffer |= bits << count;
+        count += length;
+        while (count >= 8)
+        {
+            out.push_back((unsigned char)(buffer & 0xff));
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    void add_huffman(uint32_t code, int length)
+    {
+        // Huffman codes are packed starting from their most significant bit.
+        uint32_t reversed = 0;
+        for (int k = 0; k < length; k++)
+        {
+            reversed |= ((code >> k) & 1) << (length - 1 - k);
+        }
+        add(reversed, length);
+    }
+
+    void align()
+    {
+        if (count > 0)
+        {
+            add(0, 8 - count);
+        }
+    }
+};
+
+class deflate_encoder
+{
+public:
+    // Chain depth trades speed for ratio, 32 is close to stb's default level.
+    int max_chain = 32;
+
+    void compress(const unsigned char* data, size_t size, bool final, std::vector<unsigned char>& out) const
+    {
+        bit_writer bits(out);
+        bits.add(final ? 1 : 0, 1); // BFINAL
+        bits.add(1, 2);             // BTYPE = fixed Huffman
+
+        const int hash_bits = 15;
+        const size_t window = 32768;
+        std::vector<int64_t> head(size_t(1) << hash_bits, -1);
+        std::vector<int64_t> previous(window, -1);
+        auto hash = [&](size_t i)
+        {
+            uint32_t v = data[i] | (data[i+1] << 8) | (data[i+2] << 16);
+            return (v * 2654435761u) >> (32 - hash_bits);
+        };
+
+        size_t i = 0;
+        while (i < size)
+        {
+            int best_length = 0;
+            size_t best_distance = 0;
+            if (i + 3 <= size)
+            {
+                auto h = hash(i);
+                int64_t candidate = head[h];
+                int chain = max_chain;
+                size_t limit = std::min<size_t>(258, size - i);
+                while (candidate >= 0 && i - candidate <= window - 1 && chain-- > 0)
+                {
+                    const unsigned char* a = data + candidate;
+                    const unsigned char* b = data + i;
+                    int length = 0;
+                    while (size_t(length) < limit && a[length] == b[length])
+                    {
+                        length++;
+                    }
+                    if (length > best_length)
+                    {
+                        best_length = length;
+                        best_distance = i - candidate;
+                        if (size_t(length) == limit) break;
+                    }
+                    candidate = previous[candidate % window];
+                }
+                previous[i % window] = head[h];
+                head[h] = int64_t(i);
+            }
+
+            if (best_length >= 3)
+            {
+                write_match(bits, best_length, int(best_distance));
+                // Index the skipped positions so later matches can refer to them.
+                for (size_t k = i + 1; k < i + best_length && k + 3 <= size; k++)
+                {
+                    auto h = hash(k);
+                    previous[k % window] = head[h];
+                    head[h] = int64_t(k);
+                }
+                i += best_length;
+            }
+            else
+            {
+                write_literal(bits, data[i]);
+                i++;
+            }
+        }
+        write_literal(bits, 256); // end of block
+
+        if (!final)
+        {
+            // Empty stored block: byte-aligns the piece so the next one can follow it directly.
+            bits.add(0, 1);
+            bits.add(0, 2);
+            bits.align();
+            bits.add(0x0000, 16);
+            bits.add(0xffff, 16);
+        }
+        bits.align();
+    }
+
+private:
+    static void write_literal(bit_writer& bits, int symbol)
+    {
+        if (symbol <= 143)      bits.add_huffman(0x30 + symbol, 8);
+        else if (symbol <= 255) bits.add_huffman(0x190 + symbol - 144, 9);
+        else if (symbol <= 279) bits.add_huffman(symbol - 256, 7);
+        else                    bits.add_huffman(0xc0 + symbol - 280, 8);
+    }
+
+    static void write_match(bit_writer& bits, int length, int distance)
+    {
+        static const int length_base[] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+        static const int length_extra[] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+        static const int distance_base[] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+        static const int distance_extra[] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+        int l = 28;
+        while (length_base[l] > length) l--;
+        write_literal(bits, 257 + l);
+        bits.add(length - length_base[l], length_extra[l]);
+
+        int d = 29;
+        while (distance_base[d] > distance) d--;
+        bits.add_huffman(d, 5);
+        bits.add(distance - distance_base[d], distance_extra[d]);
+    }
+};
+
+uint32_t adler32(const unsigned char* data, size_t size, uint32_t adler = 1)
+{
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (size > 0)
+    {
+        size_t block = std::min<size_t>(size, 5552); // largest run that can't overflow before the modulo
+        size -= block;
+        while (block--)
+        {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    // Checksum of the concatenation, given each part's checksum and the second part's length.
+    const uint32_t base = 65521;
+    uint32_t remainder = uint32_t(size2 % base);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = uint32_t((uint64_t(remainder) * sum1) % base);
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - remainder;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= (base << 1)) sum2 -= (base << 1);
+    if (sum2 >= base) sum2 -= base;
+    return (sum2 << 16) | sum1;
+}
+
+uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0)
+{
+    static const auto table = []
+    {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t k = 0; k < size; k++)
+    {
+        crc = table[(crc ^ data[k]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "common.hpp"
+#include "perf_counters.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Edge-avoiding à-trous wavelet denoiser (Dammertz et al. 2010). Five passes of a 5x5
+// B-spline kernel with taps spread 1, 2, 4, 8 and 16 pixels apart cover a 125 pixel
+// footprint. Each tap is weighted by how similar its color, albedo, normal and depth are
+// to the center pixel's, so the blur stops at geometric and texture edges. Lighting is
+// filtered with the albedo divided out and multiplied back in afterwards, which keeps
+// textures sharp.
+//
+// Every channel is a separate float plane and the inner loops run along rows with only
+// multiplies and adds (fast_exp_neg below), so the compiler vectorizes them.
+
+class denoise_buffers
+{
+    // Full image color and the first-hit guides, one float plane per channel.
+public:
+    int width = 0;
+    int height = 0;
+    std::array<std::vector<float>, 3> color;
+    std::array<std::vector<float>, 3> albedo;
+    std::array<std::vector<float>, 3> normal;
+    std::vector<float> depth;
+
+    void resize(int w, int h)
+    {
+        width = w;
+        height = h;
+        size_t size = size_t(w) * h;
+        for (int c = 0; c < 3; c++)
+        {
+            color[c].assign(size, 0);
+            albedo[c].assign(size, 0);
+            normal[c].assign(size, 0);
+        }
+        depth.assign(size, 0);
+    }
+
+    void set_color(int x, int y, const ::color& pixel)
+    {
+        size_t index = size_t(y) * width + x;
+        for (int c = 0; c < 3; c++)
+        {
+            color[c][index] = float(pixel[c]);
+        }
+    }
+
+    void set_guides(int x, int y, const ::color& pixel_albedo, const vec3& pixel_normal, double pixel_depth)
+    {
+        size_t index = size_t(y) * width + x;
+        for (int c = 0; c < 3; c++)
+        {
+            albedo[c][index] = float(pixel_albedo[c]);
+            normal[c][index] = float(pixel_normal[c]);
+        }
+        // Misses are infinitely far, keep them finite so differences stay defined.
+        depth[index] = float(std::min(pixel_depth, 1e20));
+    }
+
+    ::color get(int x, int y) const
+    {
+        size_t index = size_t(y) * width + x;
+        return ::color(color[0][index], color[1][index], color[2][index]);
+    }
+};
+
+float fast_exp_neg(float t)
+{
+    // exp(-t) for t >= 0 as (1 - t/256)^256. Within 1% where the weights matter, and
+    // made of multiplies only, so loops using it vectorize. t is capped first: a miss next
+    // to a hit gives an infinite depth term, and inf - inf in the max below is NaN.
+    t = (t < 256.0f) ? t : 256.0f; // also maps NaN to 256
+    float x = 1.0f - t * (1.0f / 256);
+    x = 0.5f * (x + std::fabs(x)); // max(x, 0) without a branch
+    x *= x; x *= x; x *= x; x *= x;
+    x *= x; x *= x; x *= x; x *= x;
+    return x;
+}
+
+class atrous_denoiser
+{
+public:
+    int iterations = 5;
+    float sigma_color = 1.0f;   // on tone-compressed lighting, halved every pass
+    float sigma_albedo = 0.1f;
+    float sigma_normal = 0.3f;
+    float sigma_depth = 0.05f;  // relative to the center pixel's depth
+
+    void apply(denoise_buffers& image, int thread_count, perf_phase_totals* events = nullptr) const
+    {
+        // events, if given, gets the hardware counters of the helper threads; the calling
+        // thread's are left to the caller's own scope.
+        const int width = image.width;
+        const int height = image.height;
+        const size_t size = size_t(width) * height;
+
+        // Divide out the albedo; misses and black surfaces are filtered as they are.
+        std::array<std::vector<float>, 3> modulation;
+        for (int c = 0; c < 3; c++)
+        {
+            modulation[c].resize(size);
+            for (size_t k = 0; k < size; k++)
+            {
+                float a = image.albedo[c][k];
+                modulation[c][k] = (a > 0.001f) ? a : 1.0f;
+                image.color[c][k] /= modulation[c][k];
+            }
+        }
+
+        std::array<std::vector<float>, 3> guide, filtered;
+        for (int c = 0; c < 3; c++)
+        {
+            guide[c].resize(size);
+            filtered[c].resize(size);
+        }
+
+        float inverse_sigma_color = 1 / (sigma_color * sigma_color);
+        for (int pass = 0; pass < iterations; pass++)
+        {
+            // Colors are compared after c / (1 + c), so bright lights don't dominate.
+            for (int c = 0; c < 3; c++)
+            {
+                for (size_t k = 0; k < size; k++)
+                {
+                    float value = std::max(image.color[c][k], 0.0f);
+                    guide[c][k] = value / (1 + value);
+                }
+            }
+            int step = 1 << pass;
+            for_each_row(height, thread_count, events, [&](int y)
+            {
+                filter_row(image, guide, filtered, y, step, inverse_sigma_color);
+            });
+            std::swap(image.color, filtered);
+            inverse_sigma_color *= 4;
+        }
+
+        for (int c = 0; c < 3; c++)
+        {
+            for (size_t k = 0; k < size; k++)
+            {
+                image.color[c][k] *= modulation[c][k];
+            }
+        }
+    }
+
+private:
+    static float square(float x) { return x * x; }
+
+    template <typename function>
+    static void for_each_row(int height, int thread_count, perf_phase_totals* events, const function& row)
+    {
+        std::atomic<int> next_row{0};
+        auto worker = [&]()
+        {
+            for (int y = next_row++; y < height; y = next_row++)
+            {
+                row(y);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int t = 1; t < std::min(thread_count, height); t++)
+        {
+            threads.emplace_back([&]()
+            {
+                perf_phase_scope counters(events); // the calling thread is its caller's to count
+                worker();
+            });
+        }
+        worker();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    void filter_row(const denoise_buffers& image, const std::array<std::vector<float>, 3>& guide,
+                    std::array<std::vector<float>, 3>& out, int y, int step, float inverse_sigma_color) const
+    {
+        static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+        const int width = image.width;
+        const float inverse_sigma_albedo = 1 / (sigma_albedo * sigma_albedo);
+        const float inverse_sigma_normal = 1 / (sigma_normal * sigma_normal);
+        const size_t p_row = size_t(y) * width;
+
+        // The row is filtered in chunks whose sums live on the stack. The compiler can see
+        // those don't alias the image planes, which is what lets the tap loop vectorize.
+        const int chunk = 64;
+        for (int x0 = 0; x0 < width; x0 += chunk)
+        {
+            const int x1 = std::min(x0 + chunk, width);
+            float sum_r[chunk] = {}, sum_g[chunk] = {}, sum_b[chunk] = {}, sum_weight[chunk] = {};
+            float depth_scale[chunk];
+            for (int x = x0; x < x1; x++)
+            {
+                depth_scale[x - x0] = 1 / (sigma_depth * std::max(image.depth[p_row + x], 1e-6f));
+            }
+
+            for (int ty = -2; ty <= 2; ty++)
+            {
+                int yq = y + ty * step;
+                if (yq < 0 || yq >= image.height)
+                {
+                    continue;
+                }
+                const size_t q_row = size_t(yq) * width;
+                for (int tx = -2; tx <= 2; tx++)
+                {
+                    // Taps that fall outside the image are left out, the weight sum renormalizes.
+                    const int dx = tx * step;
+                    const int begin = std::max(x0, -dx);
+                    const int end = std::min(x1, width - dx);
+                    if (begin >= end)
+                    {
+                        continue;
+                    }
+                    const float k = kernel[ty + 2] * kernel[tx + 2];
+
+                    // One pointer per plane, starting at the first pixel the tap covers.
+                    const size_t p = p_row + begin;
+                    const size_t q = q_row + begin + dx;
+                    const int o = begin - x0;
+                    const float *gp_r = &guide[0][p], *gp_g = &guide[1][p], *gp_b = &guide[2][p];
+                    const float *gq_r = &guide[0][q], *gq_g = &guide[1][q], *gq_b = &guide[2][q];
+                    const float *ap_r = &image.albedo[0][p], *ap_g = &image.albedo[1][p], *ap_b = &image.albedo[2][p];
+                    const float *aq_r = &image.albedo[0][q], *aq_g = &image.albedo[1][q], *aq_b = &image.albedo[2][q];
+                    const float *np_x = &image.normal[0][p], *np_y = &image.normal[1][p], *np_z = &image.normal[2][p];
+                    const float *nq_x = &image.normal[0][q], *nq_y = &image.normal[1][q], *nq_z = &image.normal[2][q];
+                    const float *cq_r = &image.color[0][q], *cq_g = &image.color[1][q], *cq_b = &image.color[2][q];
+                    const float *dp = &image.depth[p], *dq = &image.depth[q];
+
+                    for (int i = 0; i < end - begin; i++)
+                    {
+                        float color_distance = square(gp_r[i] - gq_r[i]) + square(gp_g[i] - gq_g[i]) + square(gp_b[i] - gq_b[i]);
+                        float albedo_distance = square(ap_r[i] - aq_r[i]) + square(ap_g[i] - aq_g[i]) + square(ap_b[i] - aq_b[i]);
+                        float normal_distance = square(np_x[i] - nq_x[i]) + square(np_y[i] - nq_y[i]) + square(np_z[i] - nq_z[i]);
+                        float depth_distance = (dq[i] - dp[i]) * depth_scale[o + i];
+
+                        float exponent = color_distance * inverse_sigma_color + albedo_distance * inverse_sigma_albedo
+                                       + normal_distance * inverse_sigma_normal + depth_distance * depth_distance;
+                        float weight = k * fast_exp_neg(exponent);
+
+                        sum_r[o + i] += weight * cq_r[i];
+                        sum_g[o + i] += weight * cq_g[i];
+                        sum_b[o + i] += weight * cq_b[i];
+                        sum_weight[o + i] += weight;
+                    }
+                }
+            }
+
+            // The center tap always has weight 3/8 * 3/8, so the sum is never zero.
+            for (int x = x0; x < x1; x++)
+            {
+                out[0][p_row + x] = sum_r[x - x0] / sum_weight[x - x0];
+                out[1][p_row + x] = sum_g[x - x0] / sum_weight[x - x0];
+                out[2][p_row + x] = sum_b[x - x0] / sum_weight[x - x0];
+            }
+        }
+    }
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Distributed rendering. A coordinator splits the frame into work units and hands them
+// to worker processes over sockets, one connection per worker thread; workers send back
+// each unit's radiance sums, which the coordinator adds into its accumulation buffer.
+// The render server (render_server.hpp) uses the same messages for its jobs.
+// Addresses are "unix:PATH" for a Unix socket, or "HOST:PORT" or just "PORT" for TCP.
+//
+// Messages are a fixed header followed by payload_size bytes, in the machines' native
+// byte order, so coordinator and workers must share an architecture.
+
+class work_unit
+{
+    // Samples first_sample .. first_sample + sample_count - 1 of one tile. They are seeded
+    // from the tile and first_sample alone, so a unit renders the same wherever it runs.
+public:
+    int tile = 0;
+    int first_sample = 0;
+    int sample_count = 0;
+};
+
+enum message_kind : int32_t
+{
+    message_hello,  // worker to coordinator, payload is the render settings key
+    message_unit,   // coordinator to worker, a unit to render
+    message_result, // worker to coordinator, the unit's sums
+    message_done,   // coordinator to worker, no more work; server to client, job over.
+                    // A payload says what went wrong.
+    message_job,    // client to render server, the working directory and options, '\0' separated
+    message_status, // render server to client, a line of progress
+    message_preview // render server to client, the image so far: path and format, '\0' ended,
+                    // then int32 width and height and float linear RGB pixels
+};
+
+class message_header
+{
+public:
+    int32_t kind = message_hello;
+    work_unit unit;
+    uint32_t payload_size = 0;
+};
+
+class socket_channel
+{
+    // Blocking, whole-message reads and writes on a connected socket.
+public:
+    explicit socket_channel(int socket_fd) : fd(socket_fd) {}
+    ~socket_channel() { if (fd >= 0) ::close(fd); }
+    socket_channel(const socket_channel&) = delete;
+    socket_channel& operator=(const socket_channel&) = delete;
+
+    int descriptor() const { return fd; }
+
+    bool send(message_kind kind, const work_unit& unit, const void* payload = nullptr, size_t size = 0)
+    {
+        message_header header;
+        header.kind = kind;
+        header.unit = unit;
+        header.payload_size = uint32_t(size);
+        return send_all(&header, sizeof(header)) && send_all(payload, size);
+    }
+
+    bool receive(message_header& header, std::vector<char>& payload)
+    {
+        if (!receive_all(&header, sizeof(header)) || header.payload_size > max_payload)
+        {
+            return false;
+        }
+        payload.resize(header.payload_size);
+        return receive_all(payload.data(), payload.size());
+    }
+
+private:
+    static const uint32_t max_payload = 1u << 30;
+    int fd;
+
+    bool send_all(const void* data, size_t size)
+    {
+        // MSG_NOSIGNAL: a peer that died makes this fail instead of killing the process.
+        auto bytes = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return false;
+            bytes += sent;
+            size -= size_t(sent);
+        }
+        return true;
+    }
+
+    bool receive_all(void* data, size_t size)
+    {
+        auto bytes = static_cast<char*>(data);
+        while (size > 0)
+        {
+            ssize_t received = ::recv(fd, bytes, size, 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) return false;
+            bytes += received;
+            size -= size_t(received);
+        }
+        return true;
+    }
+};
+
+bool parse_socket_address(const std::string& address, std::string& unix_path, std::string& host, std::string& port)
+{
+    if (address.compare(0, 5, "unix:") == 0)
+    {
+        unix_path = address.substr(5);
+        return !unix_path.empty() && unix_path.size() < sizeof(sockaddr_un::sun_path);
+    }
+    auto colon = address.rfind(':');
+    host = (colon == std::string::npos) ? "" : address.substr(0, colon);
+    port = (colon == std::string::npos) ? address : address.substr(colon + 1);
+    return !port.empty();
+}
+
+void set_socket_timeout(int fd, int seconds)
+{
+    // Makes a blocking read or write on fd fail after seconds without progress, so a peer
+    // that hangs while still connected is treated like one that went away.
+    timeval timeout{seconds, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+int open_socket(const std::string& address, bool listening)
+{
+    // Returns a listening or connected socket, or -1 after printing why.
+    std::string unix_path, host, port;
+    if (!parse_socket_address(address, unix_path, host, port))
+    {
+        std::cerr << "Invalid socket address '" << address << "'\n";
+        return -1;
+    }
+
+    int fd = -1;
+    if (!unix_path.empty())
+    {
+        sockaddr_un local{};
+        local.sun_family = AF_UNIX;
+        std::strncpy(local.sun_path, unix_path.c_str(), sizeof(local.sun_path) - 1);
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listening)
+        {
+            ::unlink(unix_path.c_str()); // left over from an earlier coordinator
+        }
+        auto connected = listening ? ::bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local))
+                                   : ::connect(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local));
+        if (fd >= 0 && connected != 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        addrinfo* results = nullptr;
+        if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results) == 0)
+        {
+            for (auto candidate = results; candidate && fd < 0; candidate = candidate->ai_next)
+            {
+                fd = ::socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+                if (fd < 0) continue;
+                int on = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                if (listening)
+                {
+                    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                }
+                auto connected = listening ? ::bind(fd, candidate->ai_addr, candidate->ai_addrlen)
+                                           : ::connect(fd, candidate->ai_addr, candidate->ai_addrlen);
+                if (connected != 0)
+                {
+                    ::close(fd);
+                    fd = -1;
+                }
+            }
+            ::freeaddrinfo(results);
+        }
+    }
+
+    if (fd >= 0 && listening && ::listen(fd, 64) != 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+    {
+        std::cerr << "Cannot " << (listening ? "listen on " : "connect to ") << address << ": " << std::strerror(errno) << '\n';
+    }
+    return fd;
+}
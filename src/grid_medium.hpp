@@ -0,0 +1,407 @@
+#pragma once
+
+#include "hittable.hpp"
+#include "material.hpp"
+#include "noise.hpp"
+#include "scene_arena.hpp"
+#include "texture.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// Heterogeneous participating media. A density_field holds densities at the nodes of a
+// lattice spanning a box, trilinearly interpolated between them; density_grid stores them
+// densely, sparse_density_grid (sparse_volume.hpp) in bricks. grid_medium samples
+// collisions in a field with delta tracking (Woodcock tracking) and estimates
+// transmittance with ratio tracking, both against a grid of majorants: the largest density
+// in each block of majorant_cell^3 lattice cells.
+//
+// Rays walk the majorants in two levels of Amanatides and Woo's traversal: coarse cells of
+// majorant_block^3 majorant cells, and inside the coarse cells that hold any density, the
+// majorant cells. Empty space is crossed a coarse cell at a time and tentative collisions
+// are spaced by each cell's own bound, so the number of density lookups follows the
+// density along the ray rather than the length of the ray inside the box.
+
+class density_field
+{
+    // Densities at the nodes of an nx*ny*nz lattice spanning bounds, trilinearly
+    // interpolated between them and zero outside.
+public:
+    aabb bounds;
+    int nx = 0, ny = 0, nz = 0; // lattice nodes along each axis, at least 2
+
+    density_field(const aabb& bounds, int nx, int ny, int nz)
+        : bounds(bounds), nx(std::max(2, nx)), ny(std::max(2, ny)), nz(std::max(2, nz)) {}
+    virtual ~density_field() = default;
+
+    point3 node_position(int i, int j, int k) const
+    {
+        return point3(bounds.x.min + bounds.x.size() * i / (nx - 1),
+                      bounds.y.min + bounds.y.size() * j / (ny - 1),
+                      bounds.z.min + bounds.z.size() * k / (nz - 1));
+    }
+
+    virtual double lookup(const point3& p) const = 0;
+
+    // The largest node value in [i0, i1] x [j0, j1] x [k0, k1], clamped to the lattice;
+    // bounds the interpolated density in the cells between them.
+    virtual float max_over(int i0, int j0, int k0, int i1, int j1, int k1) const = 0;
+
+    virtual size_t memory_bytes() const = 0;
+
+protected:
+    bool lattice_coordinates(const point3& p, int& i, int& j, int& k, double& fx, double& fy, double& fz) const
+    {
+        // The cell containing p, and p's position in it; false outside the bounds.
+        double gx = (p.x() - bounds.x.min) / bounds.x.size() * (nx - 1);
+        double gy = (p.y() - bounds.y.min) / bounds.y.size() * (ny - 1);
+        double gz = (p.z() - bounds.z.min) / bounds.z.size() * (nz - 1);
+        if (!(gx >= 0 && gy >= 0 && gz >= 0 && gx <= nx - 1 && gy <= ny - 1 && gz <= nz - 1))
+        {
+            return false;
+        }
+        i = std::min(int(gx), nx - 2);
+        j = std::min(int(gy), ny - 2);
+        k = std::min(int(gz), nz - 2);
+        fx = gx - i;
+        fy = gy - j;
+        fz = gz - k;
+        return true;
+    }
+
+    static double trilinear(const double c[8], double fx, double fy, double fz)
+    {
+        // c indexed by dx + 2 dy + 4 dz.
+        auto mix = [](double a, double b, double t) { return a + t * (b - a); };
+        double near = mix(mix(c[0], c[1], fx), mix(c[2], c[3], fx), fy);
+        double far = mix(mix(c[4], c[5], fx), mix(c[6], c[7], fx), fy);
+        return mix(near, far, fz);
+    }
+};
+
+class density_grid : public density_field
+{
+    // Dense storage, nx*ny*nz floats.
+public:
+    std::vector<float> values; // x fastest
+
+    density_grid(const aabb& bounds, int nx, int ny, int nz)
+        : density_field(bounds, nx, ny, nz), values(size_t(this->nx) * this->ny * this->nz, 0.0f) {}
+
+    float& at(int i, int j, int k) { return values[(size_t(k) * ny + j) * nx + i]; }
+    float at(int i, int j, int k) const { return values[(size_t(k) * ny + j) * nx + i]; }
+
+    double lookup(const point3& p) const override
+    {
+        int i, j, k;
+        double fx, fy, fz;
+        if (!lattice_coordinates(p, i, j, k, fx, fy, fz))
+        {
+            return 0;
+        }
+        const float* c = &values[(size_t(k) * ny + j) * nx + i];
+        size_t row = size_t(nx), slice = size_t(nx) * ny;
+        double corners[8] = {c[0], c[1], c[row], c[row + 1], c[slice], c[slice + 1], c[slice + row], c[slice + row + 1]};
+        return trilinear(corners, fx, fy, fz);
+    }
+
+    float max_over(int i0, int j0, int k0, int i1, int j1, int k1) const override
+    {
+        float largest = 0;
+        for (int k = std::max(k0, 0); k <= std::min(k1, nz - 1); k++)
+        {
+            for (int j = std::max(j0, 0); j <= std::min(j1, ny - 1); j++)
+            {
+                for (int i = std::max(i0, 0); i <= std::min(i1, nx - 1); i++)
+                {
+                    largest = std::max(largest, at(i, j, k));
+                }
+            }
+        }
+        return largest;
+    }
+
+    size_t memory_bytes() const override { return values.size() * sizeof(float); }
+};
+
+density_grid* cloud_density(scene_arena& arena, const point3& center, double radius, int resolution, uint64_t seed = 0)
+{
+    // A puff of smoke filling about a sphere: fBm noise on a density falling off from the
+    // center, clamped to [0, 1], with empty space between the wisps and around them.
+    auto half = vec3(radius, radius, radius) * 1.25;
+    auto cloud = arena.make<density_grid>(aabb(center - half, center + half), resolution, resolution, resolution);
+    auto& grid = *cloud;
+    noise_generator generator(seed);
+    std::vector<double> x(grid.nx), y(grid.nx), z(grid.nx), amount(grid.nx);
+    for (int k = 0; k < grid.nz; k++)
+    {
+        for (int j = 0; j < grid.ny; j++)
+        {
+            for (int i = 0; i < grid.nx; i++)
+            {
+                auto q = (grid.node_position(i, j, k) - center) / radius;
+                x[i] = 3 * q.x();
+                y[i] = 3 * q.y();
+                z[i] = 3 * q.z();
+            }
+            generator.fractal_batch(simplex_basis, false, 5, grid.nx, x.data(), y.data(), z.data(), amount.data());
+            for (int i = 0; i < grid.nx; i++)
+            {
+                auto q = (grid.node_position(i, j, k) - center) / radius;
+                grid.at(i, j, k) = float(std::clamp(1.2 * (1 - q.length()) + amount[i] - 0.15, 0.0, 1.0));
+            }
+        }
+    }
+    return cloud;
+}
+
+class grid_walk
+{
+    // Amanatides and Woo's traversal of a grid of count[0] x count[1] x count[2] cells of the
+    // given size from low, along r from parameter t on.
+public:
+    int cell[3];
+
+    grid_walk(const ray& r, double t, const point3& low, const vec3& size, const int count[3])
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double origin = r.origin()[axis], direction = r.direction()[axis];
+            this->count[axis] = count[axis];
+            cell[axis] = std::clamp(int((origin + t * direction - low[axis]) / size[axis]), 0, count[axis] - 1);
+            if (direction > 0)
+            {
+                step[axis] = 1;
+                next_t[axis] = (low[axis] + (cell[axis] + 1) * size[axis] - origin) / direction;
+                delta_t[axis] = size[axis] / direction;
+            }
+            else if (direction < 0)
+            {
+                step[axis] = -1;
+                next_t[axis] = (low[axis] + cell[axis] * size[axis] - origin) / direction;
+                delta_t[axis] = -size[axis] / direction;
+            }
+            else
+            {
+                step[axis] = 0;
+                next_t[axis] = delta_t[axis] = infinity;
+            }
+        }
+        find_exit();
+    }
+
+    double exit_t() const { return next_t[exit_axis]; }
+
+    bool advance()
+    {
+        // To the next cell along the ray; false once that leaves the grid.
+        int axis = exit_axis;
+        cell[axis] += step[axis];
+        next_t[axis] += delta_t[axis];
+        find_exit();
+        return cell[axis] >= 0 && cell[axis] < count[axis];
+    }
+
+private:
+    int count[3], step[3];
+    double next_t[3], delta_t[3];
+    int exit_axis = 0;
+
+    void find_exit()
+    {
+        exit_axis = (next_t[0] < next_t[1]) ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+    }
+};
+
+class grid_medium : public hittable
+{
+public:
+    static constexpr int majorant_cell = 8;  // lattice cells per majorant cell along each axis
+    static constexpr int majorant_block = 8; // majorant cells per coarse cell along each axis
+
+    grid_medium(const density_field* field, double density, const texture* tex)
+        : field(field), density(density), phase_function(tex)
+    {
+        build_majorants();
+    }
+    grid_medium(const density_field* field, double density, const color& albedo)
+        : field(field), density(density), phase_function(albedo)
+    {
+        build_majorants();
+    }
+
+    void set_material_id(int id) { phase_function.id = id; }
+
+    aabb bounding_box() const override { return field->bounds; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+    {
+        // Delta tracking: a tentative collision at density d under majorant m is real with
+        // probability d / m, otherwise tracking goes on past it.
+        STAT_INC(intersection_tests[stat_medium]);
+        double collision = infinity;
+        track(r, ray_t, [&](double t, double majorant)
+        {
+            STAT_INC(medium_tracking[stat_density_lookups]);
+            if (random_double() * majorant < density * field->lookup(r.at(t)))
+            {
+                collision = t;
+                return true;
+            }
+            return false;
+        });
+        if (collision == infinity)
+        {
+            return false;
+        }
+
+        rec.t = collision;
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(1,0,0);
+        rec.front_face = true;
+        rec.dpdu = rec.dpdv = vec3(); // no surface, so no texture footprint
+        rec.mat = &phase_function;
+        return true;
+    }
+
+    double transmittance(const ray& r, interval ray_t) const
+    {
+        // Ratio tracking: the product of 1 - d / m over the tentative collisions, an unbiased
+        // estimate of exp(-optical depth) that never needs to scatter. Russian roulette ends
+        // the walk once little light is left.
+        double estimate = 1;
+        track(r, ray_t, [&](double t, double majorant)
+        {
+            STAT_INC(medium_tracking[stat_density_lookups]);
+            estimate *= 1 - density * field->lookup(r.at(t)) / majorant;
+            if (estimate < 0.1)
+            {
+                if (random_double() < 0.5)
+                {
+                    estimate = 0;
+                    return true;
+                }
+                estimate *= 2;
+            }
+            return false;
+        });
+        return estimate;
+    }
+
+private:
+    const density_field* field;
+    double density; // scales the field's values
+    isotropic phase_function;
+    int cells[3] = {1, 1, 1}, blocks[3] = {1, 1, 1};
+    vec3 cell_size, block_size;
+    std::vector<float> majorants;       // per majorant cell, x fastest, scaled by density and rounded up
+    std::vector<float> block_majorants; // the largest of each coarse cell's majorants
+
+    void build_majorants()
+    {
+        int nodes[3] = {field->nx, field->ny, field->nz};
+        for (int axis = 0; axis < 3; axis++)
+        {
+            cells[axis] = (nodes[axis] - 1 + majorant_cell - 1) / majorant_cell;
+            blocks[axis] = (cells[axis] + majorant_block - 1) / majorant_block;
+            cell_size[axis] = field->bounds.axis_interval(axis).size() * majorant_cell / (nodes[axis] - 1);
+            block_size[axis] = cell_size[axis] * majorant_block;
+        }
+        majorants.assign(size_t(cells[0]) * cells[1] * cells[2], 0.0f);
+        block_majorants.assign(size_t(blocks[0]) * blocks[1] * blocks[2], 0.0f);
+        for (int k = 0; k < cells[2]; k++)
+        {
+            for (int j = 0; j < cells[1]; j++)
+            {
+                for (int i = 0; i < cells[0]; i++)
+                {
+                    int i0 = i * majorant_cell, j0 = j * majorant_cell, k0 = k * majorant_cell;
+                    float largest = field->max_over(i0, j0, k0, i0 + majorant_cell, j0 + majorant_cell, k0 + majorant_cell);
+                    // Rounded up, so the density never exceeds the bound however it's rounded.
+                    float majorant = (largest > 0) ? std::nextafter(float(density * largest), float(infinity)) : 0.0f;
+                    majorants[(size_t(k) * cells[1] + j) * cells[0] + i] = majorant;
+                    float& block = block_majorants[(size_t(k / majorant_block) * blocks[1] + j / majorant_block) * blocks[0] + i / majorant_block];
+                    block = std::max(block, majorant);
+                }
+            }
+        }
+    }
+
+    template <typename Visit>
+    void track(const ray& r, interval ray_t, Visit&& visit) const
+    {
+        // Calls visit(t, majorant) at tentative collisions along r within ray_t, spaced by
+        // exponential steps under each majorant cell's bound, until it returns true. The
+        // majorant is per unit distance; t is the ray parameter. Coarse cells without
+        // density are crossed in one step, the others cell by cell: the fine walk goes on
+        // from one occupied coarse cell into the next and only restarts after a skip.
+        if (!field->bounds.clip(r, ray_t))
+        {
+            return;
+        }
+        double speed = r.direction().length();
+        const point3 low(field->bounds.x.min, field->bounds.y.min, field->bounds.z.min);
+
+        grid_walk coarse(r, ray_t.min, low, block_size, blocks);
+        grid_walk fine(r, ray_t.min, low, cell_size, cells);
+        bool fine_at_t = true;
+        double t = ray_t.min;
+        while (true)
+        {
+            STAT_INC(medium_tracking[stat_majorant_cells]);
+            const int* b = coarse.cell;
+            double block_exit = std::min(coarse.exit_t(), ray_t.max);
+            if (block_majorants[(size_t(b[2]) * blocks[1] + b[1]) * blocks[0] + b[0]] > 0)
+            {
+                if (!fine_at_t)
+                {
+                    fine = grid_walk(r, t, low, cell_size, cells);
+                    fine_at_t = true;
+                }
+                while (true)
+                {
+                    STAT_INC(medium_tracking[stat_majorant_cells]);
+                    const int* c = fine.cell;
+                    double exit = std::min(fine.exit_t(), block_exit);
+                    double majorant = majorants[(size_t(c[2]) * cells[1] + c[1]) * cells[0] + c[0]];
+                    if (majorant > 0)
+                    {
+                        double inverse_rate = -1 / (majorant * speed);
+                        double collision = t;
+                        while (true)
+                        {
+                            collision += inverse_rate * std::log(random_double());
+                            if (collision >= exit)
+                            {
+                                break;
+                            }
+                            if (visit(collision, majorant))
+                            {
+                                return;
+                            }
+                        }
+                    }
+                    t = exit;
+                    if (fine.exit_t() > block_exit)
+                    {
+                        // The cell reaches into the next coarse cell; the walk resumes there.
+                        break;
+                    }
+                    if (!fine.advance())
+                    {
+                        return;
+                    }
+                }
+            }
+            else
+            {
+                fine_at_t = false;
+            }
+            if (block_exit >= ray_t.max || !coarse.advance())
+            {
+                return;
+            }
+            t = block_exit;
+        }
+    }
+};
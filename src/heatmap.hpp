@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.hpp"
+#include "image_io.hpp"
+#include "image_stream.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+class pixel_cost_map
+{
+    // Per-pixel render cost: wall time, rays traced and traversal steps (BVH nodes plus
+    // primitive intersection tests). Written as false color images next to the beauty pass.
+    // Traversal steps come from the render statistics and read zero under RT_NO_STATS.
+    // With a float format (pfm, exr) the raw values are written instead of colors.
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<float> nanoseconds;
+    std::vector<float> rays;
+    std::vector<float> steps;
+
+    void resize(int w, int h)
+    {
+        width = w;
+        height = h;
+        nanoseconds.assign(size_t(w) * h, 0);
+        rays.assign(size_t(w) * h, 0);
+        steps.assign(size_t(w) * h, 0);
+    }
+
+    void record(int i, int j, double seconds, long long ray_count, long long step_count)
+    {
+        auto index = size_t(j) * width + i;
+        // Summed, progressive renders record every pass.
+        nanoseconds[index] += float(seconds * 1e9);
+        rays[index] += float(ray_count);
+        steps[index] += float(step_count);
+    }
+
+    bool write(const std::string& beauty_path, const std::string& format) const
+    {
+        bool ok = write_channel(nanoseconds, sibling_image_path(beauty_path, "time", format), format, "time (ns)");
+        ok = write_channel(rays, sibling_image_path(beauty_path, "rays", format), format, "rays") && ok;
+        ok = write_channel(steps, sibling_image_path(beauty_path, "steps", format), format, "traversal steps") && ok;
+        return ok;
+    }
+
+private:
+    static color false_color(double x)
+    {
+        // Black -> blue -> red -> yellow -> white ramp over [0,1].
+        static const color stops[] = {
+            color(0, 0, 0), color(0.1, 0.05, 0.5), color(0.8, 0.1, 0.3), color(1.0, 0.7, 0.0), color(1, 1, 1)
+        };
+        x = interval::zero_to_one.clamp(x) * 4;
+        int k = std::min(int(x), 3);
+        return lerp(stops[k], stops[k + 1], x - k);
+    }
+
+    bool write_channel(const std::vector<float>& values, const std::string& path, const std::string& format, const char* label) const
+    {
+        // Normalized to the 99th percentile so a few pathological pixels don't flatten the rest.
+        std::vector<float> sorted(values);
+        auto percentile = sorted.begin() + (sorted.size() * 99) / 100;
+        std::nth_element(sorted.begin(), percentile, sorted.end());
+        double scale = (*percentile > 0) ? 1.0 / *percentile : 0;
+        double total = 0;
+        float peak = 0;
+        for (auto value : values)
+        {
+            total += value;
+            peak = std::max(peak, value);
+        }
+        std::clog << "Heatmap " << path << ": " << label << " mean " << total / values.size()
+                  << ", p99 " << *percentile << ", max " << peak << '\n';
+
+        auto resolved_format = format.empty() ? image_format_from_path(path) : format;
+        if (is_float_format(resolved_format))
+        {
+            std::vector<color> raw;
+            raw.reserve(values.size());
+            for (auto value : values)
+            {
+                raw.emplace_back(value, value, value);
+            }
+            return write_float_image(path, resolved_format, width, height, raw.data());
+        }
+
+        std::vector<unsigned char> image(values.size() * 3);
+        for (size_t k = 0; k < values.size(); k++)
+        {
+            // write_color applies gamma 2, square the ramp so the colors survive it.
+            auto c = false_color(values[k] * scale);
+            write_color(&image[3 * k], c * c);
+        }
+        return write_image(path, format, width, height, image.data());
+    }
+};
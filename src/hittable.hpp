@@ -1,5 +1,6 @@
 #pragma once
 #include "common.hpp"
+#include "aabb.hpp"
 
 class material;
 
@@ -8,18 +9,64 @@ class hit_record
 public:
     point3 p;
     vec3 normal;
-    std::shared_ptr<material> mat;
+    const material* mat = nullptr; // owned by the shape that was hit, no reference counting per hit
     double t;
     double u;
     double v;
     bool front_face;
 
+    // Surface derivatives, set by the shapes: of p and of the outward normal with respect
+    // to u and v (the normal's are zero on flat shapes).
+    vec3 dpdu, dpdv;
+    vec3 dndu, dndv;
+
+    // Set by set_differentials: how p and normal change towards the next pixel, and the
+    // width in uv of the texture footprint of one pixel (0 when unknown).
+    vec3 dpdx, dpdy;
+    vec3 dndx, dndy;
+    double uv_footprint = 0;
+
     void set_face_normal(const ray& r, const vec3& outward_normal)
     {
         // outward_normal is assumed to have unit length
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    void set_differentials(const ray& r)
+    {
+        // Intersects r's differential rays with the tangent plane at p, then expresses
+        // the offsets in u and v by least squares over dpdu and dpdv.
+        uv_footprint = 0;
+        if (!r.has_differentials)
+        {
+            return;
+        }
+        double facing = dot(r.direction(), normal);
+        double a = dot(dpdu, dpdu), b = dot(dpdu, dpdv), c = dot(dpdv, dpdv);
+        double determinant = a * c - b * b;
+        if (facing == 0 || determinant <= 1e-12 * a * c)
+        {
+            dpdx = dpdy = dndx = dndy = vec3();
+            return;
+        }
+        auto transfer = [&](const vec3& dodx, const vec3& dddx)
+        {
+            vec3 offset = dodx + t * dddx;
+            return offset - (dot(offset, normal) / facing) * r.direction();
+        };
+        dpdx = transfer(r.dodx, r.dddx);
+        dpdy = transfer(r.dody, r.dddy);
+
+        double dudx = (c * dot(dpdx, dpdu) - b * dot(dpdx, dpdv)) / determinant;
+        double dvdx = (a * dot(dpdx, dpdv) - b * dot(dpdx, dpdu)) / determinant;
+        double dudy = (c * dot(dpdy, dpdu) - b * dot(dpdy, dpdv)) / determinant;
+        double dvdy = (a * dot(dpdy, dpdv) - b * dot(dpdy, dpdu)) / determinant;
+        double side = front_face ? 1 : -1;
+        dndx = side * (dudx * dndu + dvdx * dndv);
+        dndy = side * (dudy * dndu + dvdy * dndv);
+        uv_footprint = std::fmax(std::sqrt(dudx * dudx + dvdx * dvdx), std::sqrt(dudy * dudy + dvdy * dvdy));
+    }
 };
 
 class hittable
@@ -27,4 +74,47 @@ class hittable
 public:
     virtual ~hittable() = default;
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+    virtual aabb bounding_box() const = 0;
+
+    // Closed and convex, so a ray is inside it along one span at most.
+    virtual bool convex() const { return false; }
+
+    virtual int inside_spans(const ray& r, interval ray_t, interval* spans, int max_count) const
+    {
+        // The parts of r within ray_t inside a closed surface with outward facing normals, as
+        // entry/exit pairs in order along the ray; returns how many. This version walks the
+        // surface hits one by one, so concave shapes and nested shells work; convex shapes
+        // can answer in one go. A span that starts before ray_t.min or ends past ray_t.max is
+        // cut there. The walk stops at max_count spans without looking for more, so callers
+        // that get max_count back ask again from past the last span's end for the rest.
+        int count = 0;
+        bool inside = false, seen_surface = false;
+        double entry = ray_t.min, t = ray_t.min;
+        hit_record rec;
+        while (count < max_count && hit(r, interval(t, ray_t.max), rec))
+        {
+            if (rec.front_face)
+            {
+                if (!inside)
+                {
+                    entry = rec.t;
+                    inside = true;
+                }
+            }
+            else if (inside || !seen_surface)
+            {
+                // An exit without an entry before it means r starts inside; one after another
+                // exit is the same crossing seen twice, e.g. on a shared mesh edge.
+                spans[count++] = interval(inside ? entry : ray_t.min, rec.t);
+                inside = false;
+            }
+            seen_surface = true;
+            t = rec.t + 0.0001;
+        }
+        if (inside && count < max_count)
+        {
+            spans[count++] = interval(entry, ray_t.max);
+        }
+        return count;
+    }
 };
\ No newline at end of file
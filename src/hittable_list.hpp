@@ -7,13 +7,17 @@
 class hittable_list : public hittable
 {
 public:
-    std::vector<std::shared_ptr<hittable>> objects;
+    std::vector<const hittable*> objects;
 
     hittable_list() {}
-    hittable_list(std::shared_ptr<hittable> object) { add(object);};
+    hittable_list(const hittable* object) { add(object);};
 
     void clear() { objects.clear(); }
-    void add(std::shared_ptr<hittable> object) { objects.push_back(object); }
+    void add(const hittable* object)
+    {
+        objects.push_back(object);
+        bbox = aabb(bbox, object->bounding_box());
+    }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override
     {
@@ -32,4 +36,9 @@ public:
         }
         return hit_anything;
     }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    aabb bbox;
 };
\ No newline at end of file
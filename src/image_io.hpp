@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+
+#include "image_stream.hpp"
+#include "png_writer.hpp"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+std::string image_format_from_path(const std::string& path)
+{
+    // Infers the output format from the file extension, defaulting to png.
+    auto ext = std::filesystem::path(path).extension().string();
+    if (ext.empty())
+    {
+        return "png";
+    }
+    ext = ext.substr(1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (ext == "jpeg")
+    {
+        return "jpg";
+    }
+    return ext;
+}
+
+bool is_supported_image_format(const std::string& format)
+{
+    return format == "png" || format == "ppm" || format == "pfm" || format == "exr" || format == "qoi"
+        || format == "bmp" || format == "tga" || format == "jpg";
+}
+
+bool ensure_parent_directory(const std::string& path)
+{
+    auto parent = std::filesystem::path(path).parent_path();
+    if (parent.empty())
+    {
+        return true;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(parent, ec);
+    if (ec)
+    {
+        std::cerr << "Cannot create directory " << parent << ": " << ec.message() << '\n';
+        return false;
+    }
+    return true;
+}
+
+bool write_ppm(const std::string& path, int width, int height, const unsigned char* data)
+{
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+    size_t size = size_t(width) * height * 3;
+    bool ok = std::fwrite(data, 1, size, file) == size;
+    return (std::fclose(file) == 0) && ok;
+}
+
+std::string sibling_image_path(const std::string& path, const std::string& channel, const std::string& format)
+{
+    // output/test.png -> output/test_albedo.png, with the extension replaced by format if given.
+    std::filesystem::path sibling(path);
+    auto extension = format.empty() ? sibling.extension().string() : "." + format;
+    sibling.replace_filename(sibling.stem().string() + "_" + channel + extension);
+    return sibling.string();
+}
+
+bool write_float_image(const std::string& path, const std::string& format, int width, int height, const color* pixels)
+{
+    // Whole image of linear colors in a float format (pfm or exr).
+    auto stream = make_tile_stream(format, height);
+    if (!stream || !ensure_parent_directory(path) || !stream->open(path, width, height))
+    {
+        return false;
+    }
+    stream->write_tile(0, 0, width, height, pixels);
+    return stream->close();
+}
+
+bool write_image(const std::string& path, std::string format, int width, int height, const unsigned char* data,
+                 int thread_count = 1, const png_text& text = {}, perf_phase_totals* events = nullptr)
+{
+    // data is tightly packed 8-bit RGB, top row first. PNG bands are compressed on
+    // thread_count threads, the helpers' hardware counters going to events, and carry text
+    // as tEXt chunks, the other formats drop it; pfm and exr store the 8-bit values scaled
+    // to [0,1].
+    if (format.empty())
+    {
+        format = image_format_from_path(path);
+    }
+    if (!is_supported_image_format(format))
+    {
+        std::cerr << "Unsupported image format '" << format << "'\n";
+        return false;
+    }
+    if (!ensure_parent_directory(path))
+    {
+        return false;
+    }
+
+    bool ok = false;
+    if (format == "png")
+    {
+        ok = png_encoder().write(path, width, height, data, thread_count, text, events);
+    }
+    else if (format == "ppm")
+    {
+        ok = write_ppm(path, width, height, data);
+    }
+    else if (format == "qoi")
+    {
+        qoi_stream stream(height);
+        ok = stream.open(path, width, height);
+        if (ok)
+        {
+            stream.write_rgb8_rows(data, height);
+            ok = stream.close();
+        }
+    }
+    else if (is_float_format(format))
+    {
+        std::vector<color> pixels(size_t(width) * height);
+        for (size_t k = 0; k < pixels.size(); k++)
+        {
+            pixels[k] = color(data[3*k], data[3*k + 1], data[3*k + 2]) / 255.0;
+        }
+        ok = write_float_image(path, format, width, height, pixels.data());
+    }
+    else if (format == "bmp")
+    {
+        ok = stbi_write_bmp(path.c_str(), width, height, 3, data);
+    }
+    else if (format == "tga")
+    {
+        ok = stbi_write_tga(path.c_str(), width, height, 3, data);
+    }
+    else if (format == "jpg")
+    {
+        ok = stbi_write_jpg(path.c_str(), width, height, 3, data, 95);
+    }
+
+    if (!ok)
+    {
+        std::cerr << "Failed to write " << path << '\n';
+    }
+    return ok;
+}
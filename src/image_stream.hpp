@@ -0,0 +1,585 @@
+#pragma once
+
+#include "common.hpp"
+#include "png_writer.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class tile_stream
+{
+    // Receives finished tiles while the render is still running and writes them out, so
+    // encoding overlaps rendering. write_tile may be called from any thread, in any order.
+public:
+    virtual ~tile_stream() = default;
+    virtual bool open(const std::string& path, int width, int height) = 0;
+    // pixels holds tile_width * tile_height final linear colors, row by row.
+    virtual void write_tile(int x0, int y0, int tile_width, int tile_height, const color* pixels) = 0;
+    virtual bool close() = 0;
+};
+
+class raster_stream : public tile_stream
+{
+    // Formats with a fixed size per pixel: tiles are written straight to their offset.
+public:
+    bool open(const std::string& path, int w, int h) override
+    {
+        width = w;
+        height = h;
+        file = std::fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            return false;
+        }
+        auto header = make_header();
+        std::fwrite(header.data(), 1, header.size(), file);
+        data_offset = long(header.size());
+        return true;
+    }
+
+    void write_tile(int x0, int y0, int tile_width, int tile_height, const color* pixels) override
+    {
+        std::vector<unsigned char> row(size_t(tile_width) * pixel_size());
+        std::lock_guard<std::mutex> lock(file_mutex);
+        for (int j = 0; j < tile_height; j++)
+        {
+            for (int i = 0; i < tile_width; i++)
+            {
+                encode_pixel(pixels[size_t(j) * tile_width + i], &row[size_t(i) * pixel_size()]);
+            }
+            std::fseek(file, data_offset + long(row_index(y0 + j) * width + x0) * long(pixel_size()), SEEK_SET);
+            std::fwrite(row.data(), 1, row.size(), file);
+        }
+    }
+
+    bool close() override
+    {
+        bool ok = !std::ferror(file);
+        ok = (std::fclose(file) == 0) && ok;
+        file = nullptr;
+        return ok;
+    }
+
+    ~raster_stream() override
+    {
+        if (file)
+        {
+            std::fclose(file);
+        }
+    }
+
+protected:
+    int width = 0;
+    int height = 0;
+
+    virtual std::string make_header() const = 0;
+    virtual size_t pixel_size() const = 0;
+    virtual void encode_pixel(const color& c, unsigned char* out) const = 0;
+    virtual long row_index(int y) const { return y; }
+
+private:
+    FILE* file = nullptr;
+    long data_offset = 0;
+    std::mutex file_mutex;
+};
+
+class ppm_stream : public raster_stream
+{
+    // Binary PPM, 8-bit gamma encoded like write_color.
+protected:
+    std::string make_header() const override
+    {
+        return "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    }
+    size_t pixel_size() const override { return 3; }
+    void encode_pixel(const color& c, unsigned char* out) const override { write_color(out, c); }
+};
+
+class pfm_stream : public raster_stream
+{
+    // Portable float map: linear 32-bit float RGB, little endian, rows stored bottom to top.
+protected:
+    std::string make_header() const override
+    {
+        return "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    }
+    size_t pixel_size() const override { return 3 * sizeof(float); }
+    void encode_pixel(const color& c, unsigned char* out) const override
+    {
+        float rgb[3] = {float(c.x()), float(c.y()), float(c.z())};
+        std::memcpy(out, rgb, sizeof(rgb));
+    }
+    long row_index(int y) const override { return height - 1 - y; }
+};
+
+class band_stream : public tile_stream
+{
+    // Base for formats that are encoded sequentially. Tiles are converted to 8 bits and held
+    // back until their whole row of tiles is done and every row above it has been encoded,
+    // so only the bands still being rendered are ever in memory.
+public:
+    band_stream(int tile_size) : tile_size(tile_size) {}
+
+    bool open(const std::string& path, int w, int h) override
+    {
+        width = w;
+        height = h;
+        tiles_per_row = (width + tile_size - 1) / tile_size;
+        return open_file(path);
+    }
+
+    void write_tile(int x0, int y0, int tile_width, int tile_height, const color* pixels) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(band_mutex);
+            auto& band = pending[y0 / tile_size];
+            if (band.pixels.empty())
+            {
+                band.pixels.resize(size_t(width) * tile_height * 3);
+                band.rows = tile_height;
+            }
+            for (int j = 0; j < tile_height; j++)
+            {
+                for (int i = 0; i < tile_width; i++)
+                {
+                    write_color(&band.pixels[(size_t(j) * width + x0 + i) * 3], pixels[size_t(j) * tile_width + i]);
+                }
+            }
+            band.tiles_done++;
+            if (encoding)
+            {
+                return; // the thread already encoding will pick this band up
+            }
+            encoding = true;
+        }
+
+        // Encodes outside the lock so other threads can keep handing in tiles meanwhile.
+        for (;;)
+        {
+            band_buffer band;
+            {
+                std::lock_guard<std::mutex> lock(band_mutex);
+                auto next = pending.begin();
+                if (next == pending.end() || next->first != next_band || next->second.tiles_done < tiles_per_row)
+                {
+                    encoding = false;
+                    return;
+                }
+                band = std::move(next->second);
+                pending.erase(next);
+                next_band++;
+            }
+            encode_rows(band.pixels.data(), band.rows);
+        }
+    }
+
+    void write_rgb8_rows(const unsigned char* pixels, int rows)
+    {
+        // For callers that already hold 8-bit rows, in order.
+        std::lock_guard<std::mutex> lock(band_mutex);
+        encode_rows(pixels, rows);
+    }
+
+    bool close() override
+    {
+        bool complete = pending.empty();
+        return finish() && complete;
+    }
+
+protected:
+    int width = 0;
+    int height = 0;
+
+    virtual bool open_file(const std::string& path) = 0;
+    virtual void encode_rows(const unsigned char* pixels, int rows) = 0;
+    virtual bool finish() = 0;
+
+private:
+    class band_buffer
+    {
+    public:
+        std::vector<unsigned char> pixels;
+        int rows = 0;
+        int tiles_done = 0;
+    };
+
+    int tile_size;
+    int tiles_per_row = 0;
+    std::mutex band_mutex;
+    std::map<int, band_buffer> pending;
+    int next_band = 0;
+    bool encoding = false;
+};
+
+class qoi_stream : public band_stream
+{
+    // "Quite OK Image" format.
+public:
+    using band_stream::band_stream;
+
+    ~qoi_stream() override
+    {
+        if (file)
+        {
+            std::fclose(file);
+        }
+    }
+
+protected:
+    bool open_file(const std::string& path) override
+    {
+        file = std::fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            return false;
+        }
+        unsigned char header[14] = {'q', 'o', 'i', 'f'};
+        put_u32(header + 4, uint32_t(width));
+        put_u32(header + 8, uint32_t(height));
+        header[12] = 3; // RGB
+        header[13] = 0; // sRGB with linear alpha
+        std::fwrite(header, 1, sizeof(header), file);
+        return true;
+    }
+
+    bool finish() override
+    {
+        static const unsigned char end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        flush_run();
+        output.insert(output.end(), end_marker, end_marker + 8);
+        std::fwrite(output.data(), 1, output.size(), file);
+        bool ok = !std::ferror(file);
+        ok = (std::fclose(file) == 0) && ok;
+        file = nullptr;
+        return ok;
+    }
+
+    void encode_rows(const unsigned char* pixels, int rows) override
+    {
+        size_t size = size_t(rows) * width * 3;
+        for (size_t k = 0; k < size; k += 3)
+        {
+            const unsigned char* px = pixels + k;
+            if (px[0] == previous[0] && px[1] == previous[1] && px[2] == previous[2])
+            {
+                if (++run == 62)
+                {
+                    flush_run();
+                }
+                continue;
+            }
+            flush_run();
+
+            int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+            if (index_used[hash] && index[hash][0] == px[0] && index[hash][1] == px[1] && index[hash][2] == px[2])
+            {
+                output.push_back((unsigned char)hash);
+            }
+            else
+            {
+                index_used[hash] = true;
+                index[hash][0] = px[0];
+                index[hash][1] = px[1];
+                index[hash][2] = px[2];
+
+                signed char dr = (signed char)(px[0] - previous[0]);
+                signed char dg = (signed char)(px[1] - previous[1]);
+                signed char db = (signed char)(px[2] - previous[2]);
+                signed char dr_dg = (signed char)(dr - dg);
+                signed char db_dg = (signed char)(db - dg);
+
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                {
+                    output.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                }
+                else if (dr_dg >= -8 && dr_dg <= 7 && dg >= -32 && dg <= 31 && db_dg >= -8 && db_dg <= 7)
+                {
+                    output.push_back((unsigned char)(0x80 | (dg + 32)));
+                    output.push_back((unsigned char)((dr_dg + 8) << 4 | (db_dg + 8)));
+                }
+                else
+                {
+                    output.push_back(0xfe);
+                    output.insert(output.end(), px, px + 3);
+                }
+            }
+            previous[0] = px[0];
+            previous[1] = px[1];
+            previous[2] = px[2];
+        }
+
+        std::fwrite(output.data(), 1, output.size(), file);
+        output.clear();
+    }
+
+private:
+    FILE* file = nullptr;
+
+    // Encoder state carried across bands.
+    unsigned char index[64][3] = {};
+    bool index_used[64] = {}; // the decoder's table starts out with transparent black
+    unsigned char previous[3] = {0, 0, 0};
+    int run = 0;
+    std::vector<unsigned char> output;
+
+    static void put_u32(unsigned char* out, uint32_t value)
+    {
+        out[0] = (unsigned char)(value >> 24);
+        out[1] = (unsigned char)(value >> 16);
+        out[2] = (unsigned char)(value >> 8);
+        out[3] = (unsigned char)value;
+    }
+
+    void flush_run()
+    {
+        if (run > 0)
+        {
+            output.push_back((unsigned char)(0xc0 | (run - 1)));
+            run = 0;
+        }
+    }
+};
+
+class png_stream : public band_stream
+{
+    // PNG appended band by band: each band is filtered against the last row of the one
+    // before it and compressed as the next piece of the zlib stream.
+public:
+    using band_stream::band_stream;
+
+protected:
+    bool open_file(const std::string& path) override
+    {
+        rows_encoded = 0;
+        previous_row.clear();
+        return png.open(path, width, height);
+    }
+
+    void encode_rows(const unsigned char* pixels, int rows) override
+    {
+        const size_t stride = size_t(width) * 3;
+        rows_encoded += rows;
+        png.write_band(png_encoder().encode_band(pixels, previous_row.empty() ? nullptr : previous_row.data(),
+                                                 width, rows, rows_encoded == height));
+        previous_row.assign(pixels + (rows - 1) * stride, pixels + rows * stride);
+    }
+
+    bool finish() override
+    {
+        return png.close();
+    }
+
+private:
+    png_file png;
+    int rows_encoded = 0;
+    std::vector<unsigned char> previous_row;
+};
+
+uint16_t float_to_half(float value)
+{
+    // IEEE half precision, rounded to nearest even. Overflow becomes infinity and values
+    // below the smallest denormal become zero.
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t mantissa = bits & 0x7fffff;
+    int exponent = int((bits >> 23) & 0xff);
+    if (exponent == 0xff)
+    {
+        return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0)); // infinity or NaN
+    }
+    exponent = exponent - 127 + 15;
+    if (exponent >= 31)
+    {
+        return uint16_t(sign | 0x7c00);
+    }
+
+    uint32_t half;
+    uint32_t rest, halfway;
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+        {
+            return uint16_t(sign);
+        }
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        half = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+        rest = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+    if (rest > halfway || (rest == halfway && (half & 1)))
+    {
+        half++; // a carry into the exponent is still the correctly rounded value
+    }
+    return uint16_t(sign | half);
+}
+
+class exr_stream : public tile_stream
+{
+    // OpenEXR scanline image: half float R, G, B channels, no compression, one scanline per
+    // block. Every block has a fixed size, so like raster_stream tiles go straight to their
+    // offset. Channels are stored one after another within a scanline, in name order B, G, R.
+public:
+    bool open(const std::string& path, int w, int h) override
+    {
+        width = w;
+        height = h;
+        file = std::fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            return false;
+        }
+
+        std::vector<unsigned char> header = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0}; // magic, version 2, scanline
+        auto put_u32 = [](std::vector<unsigned char>& out, uint32_t value)
+        {
+            for (int k = 0; k < 4; k++) out.push_back((unsigned char)(value >> (8 * k)));
+        };
+        auto put_float = [&](std::vector<unsigned char>& out, float value)
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            put_u32(out, bits);
+        };
+        auto attribute = [&](const char* name, const char* type, const std::vector<unsigned char>& value)
+        {
+            header.insert(header.end(), name, name + std::strlen(name) + 1);
+            header.insert(header.end(), type, type + std::strlen(type) + 1);
+            put_u32(header, uint32_t(value.size()));
+            header.insert(header.end(), value.begin(), value.end());
+        };
+
+        std::vector<unsigned char> channels;
+        for (const char* name : {"B", "G", "R"})
+        {
+            channels.push_back((unsigned char)name[0]);
+            channels.push_back(0);
+            put_u32(channels, 1);                         // half
+            channels.insert(channels.end(), {0, 0, 0, 0}); // linear flag, reserved
+            put_u32(channels, 1);                         // x sampling
+            put_u32(channels, 1);                         // y sampling
+        }
+        channels.push_back(0);
+        std::vector<unsigned char> window;
+        for (int value : {0, 0, width - 1, height - 1})
+        {
+            put_u32(window, uint32_t(value));
+        }
+        std::vector<unsigned char> center, unit;
+        put_float(center, 0);
+        put_float(center, 0);
+        put_float(unit, 1);
+
+        attribute("channels", "chlist", channels);
+        attribute("compression", "compression", {0});
+        attribute("dataWindow", "box2i", window);
+        attribute("displayWindow", "box2i", window);
+        attribute("lineOrder", "lineOrder", {0}); // increasing y
+        attribute("pixelAspectRatio", "float", unit);
+        attribute("screenWindowCenter", "v2f", center);
+        attribute("screenWindowWidth", "float", unit);
+        header.push_back(0);
+
+        data_offset = long(header.size()) + 8L * height;
+        for (int y = 0; y < height; y++)
+        {
+            uint64_t offset = uint64_t(data_offset) + uint64_t(y) * block_size();
+            put_u32(header, uint32_t(offset));
+            put_u32(header, uint32_t(offset >> 32));
+        }
+        std::fwrite(header.data(), 1, header.size(), file);
+        return true;
+    }
+
+    void write_tile(int x0, int y0, int tile_width, int tile_height, const color* pixels) override
+    {
+        std::vector<unsigned char> row(size_t(tile_width) * 2);
+        std::lock_guard<std::mutex> lock(file_mutex);
+        for (int j = 0; j < tile_height; j++)
+        {
+            int y = y0 + j;
+            long block = data_offset + long(y) * block_size();
+            unsigned char block_header[8];
+            uint32_t data_size = uint32_t(width) * 6;
+            for (int k = 0; k < 4; k++)
+            {
+                block_header[k] = (unsigned char)(uint32_t(y) >> (8 * k));
+                block_header[4 + k] = (unsigned char)(data_size >> (8 * k));
+            }
+            std::fseek(file, block, SEEK_SET);
+            std::fwrite(block_header, 1, sizeof(block_header), file);
+
+            for (int channel = 0; channel < 3; channel++)
+            {
+                for (int i = 0; i < tile_width; i++)
+                {
+                    uint16_t half = float_to_half(float(pixels[size_t(j) * tile_width + i][2 - channel]));
+                    row[2 * i] = (unsigned char)half;
+                    row[2 * i + 1] = (unsigned char)(half >> 8);
+                }
+                std::fseek(file, block + 8 + (long(channel) * width + x0) * 2, SEEK_SET);
+                std::fwrite(row.data(), 1, row.size(), file);
+            }
+        }
+    }
+
+    bool close() override
+    {
+        bool ok = !std::ferror(file);
+        ok = (std::fclose(file) == 0) && ok;
+        file = nullptr;
+        return ok;
+    }
+
+    ~exr_stream() override
+    {
+        if (file)
+        {
+            std::fclose(file);
+        }
+    }
+
+private:
+    int width = 0;
+    int height = 0;
+    FILE* file = nullptr;
+    long data_offset = 0;
+    std::mutex file_mutex;
+
+    long block_size() const { return 8 + long(width) * 6; }
+};
+
+bool is_float_format(const std::string& format)
+{
+    // Linear, unclamped formats. AOVs are always written in one of these.
+    return format == "pfm" || format == "exr";
+}
+
+bool is_streamed_format(const std::string& format)
+{
+    // Formats written tile by tile during every render. PNG can be streamed too, but is
+    // only when memory matters, since compressing it at the end runs on every thread.
+    return format == "ppm" || format == "pfm" || format == "exr" || format == "qoi";
+}
+
+std::unique_ptr<tile_stream> make_tile_stream(const std::string& format, int tile_size)
+{
+    if (format == "ppm") return std::make_unique<ppm_stream>();
+    if (format == "pfm") return std::make_unique<pfm_stream>();
+    if (format == "exr") return std::make_unique<exr_stream>();
+    if (format == "qoi") return std::make_unique<qoi_stream>(tile_size);
+    if (format == "png") return std::make_unique<png_stream>(tile_size);
+    return nullptr;
+}
@@ -0,0 +1,511 @@
+#pragma once
+
+#include "common.hpp"
+#include "texture.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Image textures for scenes whose texture maps don't fit in memory.
+//
+// A source image (binary PPM with maxval 255, or PFM for linear values) is converted
+// once into a tiled mip file, SOURCE.rtx next to it: every level of a box-filtered mip
+// pyramid cut into 32x32 texel tiles of gamma 2 encoded bytes, the same encoding as the
+// 8-bit outputs. Tiles so hold [0, 1]: brighter PFM values are clamped, with a warning;
+// emissive textures get their range from the diffuse_light strength.
+// The file is memory-mapped, and tiles are decoded on demand into one global LRU cache
+// shared by all textures, whose size is capped (--texture-cache MB). A render touching
+// many large textures so only holds the tiles it recently used; the mapped pages are
+// clean file pages the kernel reclaims as needed.
+//
+// Each thread keeps the last few tiles it used, so most texel fetches don't touch the
+// shared cache or its lock.
+
+class mapped_file
+{
+public:
+    mapped_file() = default;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file()
+    {
+        if (memory)
+        {
+            ::munmap(memory, length);
+        }
+    }
+
+    bool open(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || ::fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        void* mapped = ::mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            return false;
+        }
+        memory = mapped;
+        length = size_t(info.st_size);
+        return true;
+    }
+
+    const unsigned char* data() const { return static_cast<const unsigned char*>(memory); }
+    size_t size() const { return length; }
+
+private:
+    void* memory = nullptr;
+    size_t length = 0;
+};
+
+class tiled_texture_header
+{
+    // Followed by level_count tiled_texture_level records, then the tiles.
+public:
+    static constexpr char magic_text[8] = "RTMIPT1";
+    static const int tile_size = 32;
+    static const int max_levels = 32;
+
+    char magic[8];
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t level_count = 0;
+    uint32_t reserved = 0;
+};
+
+class tiled_texture_level
+{
+public:
+    uint32_t width = 0, height = 0;
+    uint32_t tiles_x = 0, tiles_y = 0;
+    uint64_t offset = 0; // of the level's first tile; tiles are stored row by row
+};
+
+const size_t texture_tile_bytes = size_t(tiled_texture_header::tile_size) * tiled_texture_header::tile_size * 3;
+
+bool read_source_image(const std::string& path, int& width, int& height, std::vector<color>& texels)
+{
+    // Binary PPM (8-bit, gamma 2 like the outputs) or PFM (linear), top row first in texels.
+    std::ifstream in(path, std::ios::binary);
+    std::string kind;
+    double range = 0;
+    if (!(in >> kind >> width >> height >> range) || width <= 0 || height <= 0 || (kind != "P6" && kind != "PF"))
+    {
+        std::cerr << "Image textures must be binary PPM (P6) or PFM (PF) files: " << path << '\n';
+        return false;
+    }
+    if (kind == "P6" && range != 255)
+    {
+        std::cerr << "Image textures must be 8-bit PPM files (maxval 255), " << path << " has maxval " << range << '\n';
+        return false;
+    }
+    in.get(); // the single whitespace before the data
+    texels.resize(size_t(width) * height);
+    if (kind == "P6")
+    {
+        std::vector<unsigned char> bytes(texels.size() * 3);
+        in.read(reinterpret_cast<char*>(bytes.data()), std::streamsize(bytes.size()));
+        for (size_t k = 0; k < texels.size(); k++)
+        {
+            auto decode = [&](int c) { double g = (bytes[3*k + c] + 0.5) / 256; return g * g; };
+            texels[k] = color(decode(0), decode(1), decode(2));
+        }
+    }
+    else
+    {
+        // Rows are stored bottom to top; a negative scale means little endian floats.
+        std::vector<float> values(texels.size() * 3);
+        in.read(reinterpret_cast<char*>(values.data()), std::streamsize(values.size() * sizeof(float)));
+        if (range > 0)
+        {
+            for (auto& value : values)
+            {
+                auto bytes = reinterpret_cast<unsigned char*>(&value);
+                std::swap(bytes[0], bytes[3]);
+                std::swap(bytes[1], bytes[2]);
+            }
+        }
+        for (int j = 0; j < height; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                const float* v = &values[3 * (size_t(height - 1 - j) * width + i)];
+                texels[size_t(j) * width + i] = color(v[0], v[1], v[2]);
+            }
+        }
+        float largest = values.empty() ? 0 : *std::max_element(values.begin(), values.end());
+        if (largest > 1)
+        {
+            std::clog << "Texture " << path << " has values up to " << largest
+                      << ", tiled textures hold [0, 1] and clamp them\n";
+        }
+    }
+    if (!in)
+    {
+        std::cerr << "Image file " << path << " is cut short\n";
+        return false;
+    }
+    return true;
+}
+
+bool build_tiled_texture(const std::string& source, const std::string& target)
+{
+    // Writes the mip pyramid of source as a tiled texture file, through a temporary file
+    // so a concurrent render never maps a half-written one.
+    int width, height;
+    std::vector<color> level;
+    if (!read_source_image(source, width, height, level))
+    {
+        return false;
+    }
+
+    tiled_texture_header header;
+    std::memcpy(header.magic, tiled_texture_header::magic_text, sizeof(header.magic));
+    header.width = uint32_t(width);
+    header.height = uint32_t(height);
+    std::vector<tiled_texture_level> levels;
+    for (int w = width, h = height; ; w = std::max(1, (w + 1) / 2), h = std::max(1, (h + 1) / 2))
+    {
+        tiled_texture_level info;
+        info.width = uint32_t(w);
+        info.height = uint32_t(h);
+        info.tiles_x = uint32_t((w + tiled_texture_header::tile_size - 1) / tiled_texture_header::tile_size);
+        info.tiles_y = uint32_t((h + tiled_texture_header::tile_size - 1) / tiled_texture_header::tile_size);
+        levels.push_back(info);
+        if ((w == 1 && h == 1) || int(levels.size()) == tiled_texture_header::max_levels)
+        {
+            break;
+        }
+    }
+    header.level_count = uint32_t(levels.size());
+    uint64_t offset = sizeof(header) + levels.size() * sizeof(tiled_texture_level);
+    for (auto& info : levels)
+    {
+        info.offset = offset;
+        offset += uint64_t(info.tiles_x) * info.tiles_y * texture_tile_bytes;
+    }
+
+    auto temporary = target + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(levels.data()), std::streamsize(levels.size() * sizeof(tiled_texture_level)));
+
+    const int tile_size = tiled_texture_header::tile_size;
+    std::vector<unsigned char> tile(texture_tile_bytes);
+    for (size_t l = 0; l < levels.size(); l++)
+    {
+        int w = int(levels[l].width), h = int(levels[l].height);
+        if (l > 0)
+        {
+            // 2x2 box filter of the level above, in linear values; odd edges repeat.
+            int above_w = int(levels[l - 1].width), above_h = int(levels[l - 1].height);
+            std::vector<color> next(size_t(w) * h);
+            for (int j = 0; j < h; j++)
+            {
+                for (int i = 0; i < w; i++)
+                {
+                    int x0 = std::min(2 * i, above_w - 1), x1 = std::min(2 * i + 1, above_w - 1);
+                    int y0 = std::min(2 * j, above_h - 1), y1 = std::min(2 * j + 1, above_h - 1);
+                    next[size_t(j) * w + i] = 0.25 * (level[size_t(y0) * above_w + x0] + level[size_t(y0) * above_w + x1]
+                                                    + level[size_t(y1) * above_w + x0] + level[size_t(y1) * above_w + x1]);
+                }
+            }
+            level.swap(next);
+        }
+        // Tiles past the edge repeat the last row and column.
+        for (uint32_t ty = 0; ty < levels[l].tiles_y; ty++)
+        {
+            for (uint32_t tx = 0; tx < levels[l].tiles_x; tx++)
+            {
+                for (int y = 0; y < tile_size; y++)
+                {
+                    int j = std::min(int(ty) * tile_size + y, h - 1);
+                    for (int x = 0; x < tile_size; x++)
+                    {
+                        int i = std::min(int(tx) * tile_size + x, w - 1);
+                        write_color(&tile[3 * (size_t(y) * tile_size + x)], level[size_t(j) * w + i]);
+                    }
+                }
+                out.write(reinterpret_cast<const char*>(tile.data()), std::streamsize(tile.size()));
+            }
+        }
+    }
+    out.close();
+    std::error_code error;
+    if (!out || (std::filesystem::rename(temporary, target, error), error))
+    {
+        std::cerr << "Cannot write tiled texture " << target << '\n';
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+class texture_tile
+{
+    // One decoded tile, linear values.
+public:
+    std::array<float, texture_tile_bytes> texels;
+};
+
+class tiled_texture_file
+{
+public:
+    uint32_t id = 0; // unique for the process, part of every tile's cache key
+    std::vector<tiled_texture_level> levels;
+    mapped_file mapped;
+
+    bool open(const std::string& path)
+    {
+        static std::atomic<uint32_t> next_id{0};
+        if (!mapped.open(path) || mapped.size() < sizeof(tiled_texture_header))
+        {
+            std::cerr << "Cannot map tiled texture " << path << '\n';
+            return false;
+        }
+        tiled_texture_header header;
+        std::memcpy(&header, mapped.data(), sizeof(header));
+        size_t table_end = sizeof(header) + size_t(header.level_count) * sizeof(tiled_texture_level);
+        if (std::memcmp(header.magic, tiled_texture_header::magic_text, sizeof(header.magic)) != 0
+            || header.level_count == 0 || header.level_count > uint32_t(tiled_texture_header::max_levels)
+            || mapped.size() < table_end)
+        {
+            std::cerr << path << " is not a tiled texture\n";
+            return false;
+        }
+        levels.resize(header.level_count);
+        std::memcpy(levels.data(), mapped.data() + sizeof(header), levels.size() * sizeof(tiled_texture_level));
+        const auto& last = levels.back();
+        if (mapped.size() < last.offset + uint64_t(last.tiles_x) * last.tiles_y * texture_tile_bytes)
+        {
+            std::cerr << "Tiled texture " << path << " is cut short\n";
+            return false;
+        }
+        id = next_id++;
+        return true;
+    }
+
+    void decode(int level, int tile, texture_tile& out) const
+    {
+        static const auto table = []()
+        {
+            std::array<float, 256> values;
+            for (int b = 0; b < 256; b++)
+            {
+                double g = (b + 0.5) / 256;
+                values[b] = float(g * g);
+            }
+            return values;
+        }();
+        const unsigned char* bytes = mapped.data() + levels[level].offset + size_t(tile) * texture_tile_bytes;
+        for (size_t k = 0; k < texture_tile_bytes; k++)
+        {
+            out.texels[k] = table[bytes[k]];
+        }
+    }
+};
+
+class texture_tile_cache
+{
+    // Decoded tiles of every tiled texture, least recently used dropped past the capacity.
+public:
+    static texture_tile_cache& instance()
+    {
+        static texture_tile_cache cache;
+        return cache;
+    }
+
+    void set_capacity(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity = std::max<size_t>(bytes / sizeof(texture_tile), 1);
+        evict();
+    }
+
+    std::shared_ptr<const texture_tile> get(const tiled_texture_file& file, int level, int tile)
+    {
+        uint64_t key = (uint64_t(file.id) << 40) | (uint64_t(level) << 32) | uint32_t(tile);
+
+        // The thread's recent tiles first, a small direct-mapped table.
+        class recent_entry
+        {
+        public:
+            uint64_t key = ~0ull;
+            std::shared_ptr<const texture_tile> tile;
+        };
+        thread_local std::array<recent_entry, 16> recent;
+        auto& slot = recent[(key ^ (key >> 29)) % recent.size()];
+        if (slot.key == key)
+        {
+            return slot.tile;
+        }
+
+        STAT_INC(texture_tiles[stat_shared_tile_lookups]);
+        std::shared_ptr<const texture_tile> found;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto entry = entries.find(key);
+            if (entry != entries.end())
+            {
+                order.splice(order.begin(), order, entry->second);
+                found = entry->second->second;
+            }
+        }
+        if (!found)
+        {
+            // Decoded outside the lock; two threads may both load a tile, one copy is kept.
+            STAT_INC(texture_tiles[stat_tile_loads]);
+            auto loaded = std::make_shared<texture_tile>();
+            file.decode(level, tile, *loaded);
+            std::lock_guard<std::mutex> lock(mutex);
+            auto entry = entries.find(key);
+            if (entry != entries.end())
+            {
+                found = entry->second->second;
+            }
+            else
+            {
+                order.emplace_front(key, loaded);
+                entries[key] = order.begin();
+                evict();
+                found = loaded;
+            }
+        }
+        slot.key = key;
+        slot.tile = found;
+        return found;
+    }
+
+private:
+    std::mutex mutex;
+    size_t capacity = (size_t(256) << 20) / sizeof(texture_tile);
+    std::list<std::pair<uint64_t, std::shared_ptr<const texture_tile>>> order; // most recent first
+    std::unordered_map<uint64_t, decltype(order)::iterator> entries;
+
+    void evict()
+    {
+        // Tiles still held by some thread's recent table stay alive until it moves on.
+        while (entries.size() > capacity)
+        {
+            entries.erase(order.back().first);
+            order.pop_back();
+        }
+    }
+};
+
+class image_texture : public texture
+{
+    // Bilinear lookups in a tiled mip file; u and v wrap, v = 0 is the bottom row. Filtered
+    // lookups blend the two levels around the footprint's size.
+public:
+    bool load(const std::string& path)
+    {
+        // path is a .rtx file, or a source image converted to path.rtx when that is missing
+        // or older than it.
+        auto tiled = path;
+        if (std::filesystem::path(path).extension() != ".rtx")
+        {
+            tiled = path + ".rtx";
+            std::error_code error;
+            auto source_time = std::filesystem::last_write_time(path, error);
+            if (error)
+            {
+                std::cerr << "Cannot find image texture " << path << '\n';
+                return false;
+            }
+            auto tiled_time = std::filesystem::last_write_time(tiled, error);
+            if (error || tiled_time < source_time)
+            {
+                std::clog << "Building tiled mip texture " << tiled << '\n';
+                if (!build_tiled_texture(path, tiled))
+                {
+                    return false;
+                }
+            }
+        }
+        return file.open(tiled);
+    }
+
+    int level_count() const { return int(file.levels.size()); }
+
+    color value(double u, double v, const point3&) const override
+    {
+        return sample(u, v, 0);
+    }
+
+    color filtered_value(double u, double v, const point3&, double footprint) const override
+    {
+        // The level whose texels are about as wide as the footprint.
+        const auto& finest = file.levels[0];
+        double texels = footprint * std::max(finest.width, finest.height);
+        return sample(u, v, texels > 1 ? std::log2(texels) : 0);
+    }
+
+    color sample(double u, double v, double level) const
+    {
+        // Trilinear between the two levels around a fractional one.
+        level = std::clamp(level, 0.0, double(level_count() - 1));
+        int coarser = std::min(int(level) + 1, level_count() - 1);
+        double blend = level - int(level);
+        auto finer_value = bilinear(u, v, int(level));
+        return blend > 0 ? (1 - blend) * finer_value + blend * bilinear(u, v, coarser) : finer_value;
+    }
+
+private:
+    tiled_texture_file file;
+
+    color bilinear(double u, double v, int level) const
+    {
+        STAT_INC(texture_tiles[stat_texel_fetches]);
+        const auto& info = file.levels[level];
+        double x = (u - std::floor(u)) * info.width - 0.5;
+        double y = (1 - (v - std::floor(v))) * info.height - 0.5;
+        int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+        double fx = x - x0, fy = y - y0;
+        auto wrap = [](int value, uint32_t size) { int m = value % int(size); return m < 0 ? m + int(size) : m; };
+        int xs[2] = {wrap(x0, info.width), wrap(x0 + 1, info.width)};
+        int ys[2] = {wrap(y0, info.height), wrap(y0 + 1, info.height)};
+
+        // The four texels are usually in one tile.
+        const int tile_size = tiled_texture_header::tile_size;
+        std::shared_ptr<const texture_tile> tile;
+        int current = -1;
+        color result(0, 0, 0);
+        for (int b = 0; b < 2; b++)
+        {
+            for (int a = 0; a < 2; a++)
+            {
+                int index = (ys[b] / tile_size) * int(info.tiles_x) + xs[a] / tile_size;
+                if (index != current)
+                {
+                    tile = texture_tile_cache::instance().get(file, level, index);
+                    current = index;
+                }
+                const float* texel = &tile->texels[3 * (size_t(ys[b] % tile_size) * tile_size + xs[a] % tile_size)];
+                double weight = (a ? fx : 1 - fx) * (b ? fy : 1 - fy);
+                result += weight * color(texel[0], texel[1], texel[2]);
+            }
+        }
+        return result;
+    }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "camera.hpp"
+#include "scene.hpp"
+#include "shared_framebuffer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+// Interactive preview for placing the camera. The frame is rendered at 1/8, 1/4 and 1/2
+// resolution with one sample each, then at full resolution in progressive passes up to
+// the scene's samples per pixel, and every step is published to a shared framebuffer
+// (shared_framebuffer.hpp) for viewers to poll. When a viewer changes the view, the work
+// in flight is cancelled and the refinement starts over from the coarsest step.
+
+int run_interactive(const scene& s, const std::string& segment)
+{
+    const camera& settings = s.cam;
+    if (settings.crop_x1 > settings.crop_x0 || !settings.coordinator_address.empty() || !settings.worker_address.empty()
+        || settings.shard_count > 0)
+    {
+        std::cerr << "Interactive renders show the whole frame on this machine, without --crop or distribution\n";
+        return 1;
+    }
+
+    // Only previews are written, the output, checkpoint and time limit options don't apply.
+    camera base = settings;
+    base.output_path.clear();
+    base.checkpoint_path.clear();
+    base.resume = false;
+    base.deadline = 0;
+    base.time_budget = 0;
+    base.out_of_core = false;
+    base.denoise = false;
+    base.write_heatmaps = false;
+    base.write_aovs = {};
+    base.write_previews = true;
+
+    int width = base.image_width;
+    int height = std::max(1, int(width / base.aspect_ratio));
+    shared_framebuffer framebuffer;
+    if (!framebuffer.create(segment, width, height))
+    {
+        return 1;
+    }
+    auto& header = *framebuffer.header;
+    header.target_samples = uint32_t(base.samples_per_pixel);
+    for (int k = 0; k < 3; k++)
+    {
+        header.view.lookfrom[k] = base.lookfrom[k];
+        header.view.lookat[k] = base.lookat[k];
+        header.view.up[k] = base.up[k];
+    }
+    header.view.vfov = base.vfov;
+    std::clog << "Interactive render of " << width << 'x' << height << " in shared memory " << segment << '\n';
+
+    // Polls the viewers' requests so a render learns of them within a millisecond, however
+    // long its current pass is.
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> finished{false};
+    std::atomic<uint64_t> rendering_version{0};
+    std::thread watcher([&]()
+    {
+        while (!finished)
+        {
+            if (header.quit.load() || header.view_version.load(std::memory_order_acquire) != rendering_version.load())
+            {
+                cancel = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    while (!header.quit.load())
+    {
+        uint64_t version = header.view_version.load(std::memory_order_acquire);
+        rendering_version = version;
+        cancel = false;
+        const auto& view = header.view;
+        base.lookfrom = point3(view.lookfrom[0], view.lookfrom[1], view.lookfrom[2]);
+        base.lookat = point3(view.lookat[0], view.lookat[1], view.lookat[2]);
+        base.up = vec3(view.up[0], view.up[1], view.up[2]);
+        base.vfov = view.vfov;
+
+        auto start = std::chrono::steady_clock::now();
+        for (int scale : {8, 4, 2, 1})
+        {
+            if (cancel)
+            {
+                break;
+            }
+            camera cam = base;
+            cam.image_width = std::max(1, width / scale);
+            cam.samples_per_pixel = (scale > 1) ? 1 : base.samples_per_pixel;
+            cam.cancel = &cancel;
+            cam.on_pass = [&](int samples_done)
+            {
+                // Coarse images are upscaled by repeating pixels.
+                int held_width = cam.held_width(), held_height = cam.held_height();
+                framebuffer.write_frame(uint32_t(scale), uint32_t(samples_done), version, [&](int x, int y)
+                {
+                    return cam.held_pixel(std::min(x * held_width / width, held_width - 1),
+                                          std::min(y * held_height / height, held_height - 1));
+                });
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                std::clog << "View " << version << ": 1/" << scale << " resolution, " << samples_done << " spp at "
+                          << elapsed.count() << " ms\n";
+            };
+            cam.render(s.world);
+        }
+        while (!cancel)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    finished = true;
+    watcher.join();
+    return 0;
+}
@@ -9,6 +9,13 @@ public:
 
     interval(double min, double max) : min(min), max(max) {}
 
+    interval(const interval& a, const interval& b)
+    {
+        // Create the interval tightly enclosing the two input intervals.
+        min = a.min <= b.min ? a.min : b.min;
+        max = a.max >= b.max ? a.max : b.max;
+    }
+
     double size() const
     {
         return max - min;
@@ -37,6 +44,12 @@ public:
         return x;
     }
 
+    interval expand(double delta) const
+    {
+        auto padding = delta/2;
+        return interval(min - padding, max + padding);
+    }
+
     static const interval empty, universe, zero_to_one;
 };
 
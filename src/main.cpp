@@ -1,50 +1,102 @@
 #include "common.hpp"
 #include "camera.hpp"
-#include "hittable.hpp"
-#include "hittable_list.hpp"
-#include "material.hpp"
-#include "sphere.hpp"
-#include "quad.hpp"
-#include "constant_medium.hpp"
-
-int main()
+#include "interactive.hpp"
+#include "options.hpp"
+#include "render_server.hpp"
+#include "scene.hpp"
+#include "trace.hpp"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
 {
-    hittable_list world;
-
-    // Cornell box
-
-    auto red   = std::make_shared<lambertian>(color(.65, .05, .05));
-    auto white = std::make_shared<lambertian>(color(.73, .73, .73));
-    auto green = std::make_shared<lambertian>(color(.12, .45, .15));
-    auto light = std::make_shared<diffuse_light>(color(15, 15, 15));
-    auto see_thru = std::make_shared<one_sided_material>(white);
-    auto sphere1_mat = std::make_shared<metal>(color(0.5,0.5,0.5));
-    auto sphere2_mat = std::make_shared<dielectric>(1.5);
-
-    world.add(std::make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
-    world.add(std::make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
-    world.add(std::make_shared<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light));
-    world.add(std::make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
-    world.add(std::make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
-    world.add(std::make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
-    world.add(std::make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,555,0), see_thru));
-
-    world.add(std::make_shared<sphere>(point3(450,75, 300),75,sphere1_mat));
-    world.add(std::make_shared<sphere>(point3(100,75, 300),75,sphere2_mat));
-    auto boundary = std::make_shared<sphere>(point3(275,75, 250),75,sphere2_mat);
-    world.add(boundary);
-    world.add(std::make_shared<constant_medium>(boundary,0.5,color(0.15,0.65,0.9)));
-    
-
-    camera cam;
-
-    cam.aspect_ratio      = 1.0;
-    cam.image_width       = 800;
-    cam.samples_per_pixel = 1000;
-    cam.max_bounces       = 25;
-    cam.lookfrom = point3(278, 278, -1000);
-    cam.lookat   = point3(278, 278, 0);
-    cam.up     = vec3(0,1,0);
-
-    cam.render(world);
-}
\ No newline at end of file
+    render_options options;
+    if (!parse_args(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+    if (options.show_help)
+    {
+        print_usage(argv[0]);
+        return 0;
+    }
+    if (!options.serve_address.empty())
+    {
+        return serve_renders(options.serve_address);
+    }
+    if (!options.submit_address.empty())
+    {
+        // Everything but --submit itself goes to the server.
+        std::vector<std::string> job;
+        for (int i = 1; i < argc; i++)
+        {
+            if (std::string(argv[i]) == "--submit")
+            {
+                i++;
+                continue;
+            }
+            job.push_back(argv[i]);
+        }
+        return submit_render(options.submit_address, job);
+    }
+
+    if (options.cache_primary_hits)
+    {
+        std::cerr << "--primary-cache only helps renders submitted to a --serve process\n";
+        return 2;
+    }
+    if (!options.trace_path.empty())
+    {
+        tracer::instance().enable();
+    }
+
+    perf_counter_values scene_events, bvh_events;
+    auto build_start = std::chrono::steady_clock::now();
+    scene s;
+    {
+        TRACE_SCOPE("scene build");
+        perf_phase_scope counters(options.count_hardware_events, scene_events);
+        if (!build_scene(options.scene, s))
+        {
+            return 1;
+        }
+        options.apply(s.cam);
+    }
+    double scene_seconds = seconds_since(build_start);
+
+    auto bvh_start = std::chrono::steady_clock::now();
+    {
+        TRACE_SCOPE("bvh build");
+        perf_phase_scope counters(options.count_hardware_events, bvh_events);
+        s.build_bvh();
+    }
+    double bvh_seconds = seconds_since(bvh_start);
+
+    if (!options.interactive_segment.empty())
+    {
+        return run_interactive(s, options.interactive_segment);
+    }
+
+    bool rendered = s.cam.render(s.world);
+
+    auto& stats = s.cam.stats;
+    stats.phase_seconds[stat_phase_scene_build] += scene_seconds;
+    stats.phase_seconds[stat_phase_bvh_build] += bvh_seconds;
+    stats.perf_by_phase[stat_phase_scene_build].merge(scene_events);
+    stats.perf_by_phase[stat_phase_bvh_build].merge(bvh_events);
+    if (options.print_stats)
+    {
+        stats.print_summary(std::clog);
+    }
+    write_reports(options, stats);
+
+    return rendered ? 0 : 1;
+}
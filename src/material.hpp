@@ -5,6 +5,8 @@
 
 class material{
 public:
+    int id = -1; // declaration order in its scene (scene::add_material), written to the material id AOV
+
     virtual color emitted(double u, double v, const point3& p) const
     {
         return color(0,0,0);
@@ -13,16 +15,95 @@ public:
     {
         return false;
     }
+    virtual color surface_albedo(const hit_record& /*rec*/) const
+    {
+        // Surface color without lighting, for the albedo AOV.
+        return color(0,0,0);
+    }
+    virtual bool passes_through(const hit_record& /*rec*/) const
+    {
+        // True where rays continue unchanged, so the AOVs look past the surface.
+        return false;
+    }
 };
 
+// Ray differentials of scattered rays (see ray.hpp). Their origins move with the hit
+// point; their directions follow the mirror or refraction direction as the incoming one
+// and the normal change. Rough bounces fan out by rough_spread radians per pixel instead,
+// which puts their texture lookups on coarse mip levels: the bounce blurs far more than
+// that anyway.
+
+constexpr double rough_spread = 0.05;
+
+void pass_differentials(const ray& ray_in, const hit_record& rec, ray& scattered)
+{
+    // scattered continues in ray_in's direction.
+    if (ray_in.has_differentials)
+    {
+        scattered.set_differentials(rec.dpdx, rec.dpdy, ray_in.dddx, ray_in.dddy);
+    }
+}
+
+void reflect_differentials(const ray& ray_in, const hit_record& rec, double scale, ray& scattered)
+{
+    // scattered is reflect(ray_in.direction(), rec.normal) times scale.
+    if (!ray_in.has_differentials)
+    {
+        return;
+    }
+    const auto& d = ray_in.direction();
+    const auto& n = rec.normal;
+    auto turn = [&](const vec3& dddx, const vec3& dndx)
+    {
+        double dfacing = dot(dddx, n) + dot(d, dndx);
+        return scale * (dddx - 2 * (dot(d, n) * dndx + dfacing * n));
+    };
+    scattered.set_differentials(rec.dpdx, rec.dpdy, turn(ray_in.dddx, rec.dndx), turn(ray_in.dddy, rec.dndy));
+}
+
+void refract_differentials(const ray& ray_in, const hit_record& rec, double ri, ray& scattered)
+{
+    // scattered is refract(unit_vector(ray_in.direction()), rec.normal, ri).
+    if (!ray_in.has_differentials)
+    {
+        return;
+    }
+    double length = ray_in.direction().length();
+    auto d = ray_in.direction() / length;
+    const auto& n = rec.normal;
+    double cos_in = -dot(d, n);
+    double cos_out = -dot(scattered.direction(), n);
+    double mu = ri * cos_in - cos_out;
+    auto turn = [&](const vec3& dddx, const vec3& dndx)
+    {
+        double dcos_in = -dot(dddx / length, n) - dot(d, dndx);
+        double dmu = (ri - ri * ri * cos_in / cos_out) * dcos_in;
+        return ri * dddx / length + mu * dndx + dmu * n;
+    };
+    scattered.set_differentials(rec.dpdx, rec.dpdy, turn(ray_in.dddx, rec.dndx), turn(ray_in.dddy, rec.dndy));
+}
+
+void rough_differentials(const ray& ray_in, const hit_record& rec, ray& scattered)
+{
+    if (!ray_in.has_differentials)
+    {
+        return;
+    }
+    const auto& d = scattered.direction();
+    auto across = unit_vector(cross(d, std::fabs(d.x()) > 0.9 ? vec3(0,1,0) : vec3(1,0,0)));
+    auto spread = rough_spread * d.length();
+    scattered.set_differentials(rec.dpdx, rec.dpdy, spread * across, spread * cross(unit_vector(d), across));
+}
+
 class lambertian : public material
 {
 public:
-    lambertian(const color& albedo) : albedo(std::make_shared<solid_color>(albedo)) {}
-    lambertian(std::shared_ptr<texture> albedo) : albedo(albedo) {}
+    lambertian(const color& albedo) : albedo(albedo) {}
+    lambertian(const texture* albedo) : albedo(albedo) {}
 
     bool scatter(const ray& ray_in, const hit_record& rec, color& attenuation, ray& scattered) const override
     {
+        STAT_INC(scatter_events[stat_lambertian]);
         auto scatter_direction = rec.normal + random_unit_vector();
 
         // Catch degenerate scatter direction
@@ -31,31 +112,46 @@ public:
             scatter_direction = rec.normal;
         }
         scattered = ray(rec.p, scatter_direction);
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        rough_differentials(ray_in, rec, scattered);
+        attenuation = albedo.value(rec.u, rec.v, rec.p, rec.uv_footprint);
         return true;
     }
-    
+
+    color surface_albedo(const hit_record& rec) const override { return albedo.value(rec.u, rec.v, rec.p, rec.uv_footprint); }
+
 private:
-    std::shared_ptr<texture> albedo;    
+    flat_texture albedo;    
 };
 
 class metal : public material
 {
 public:
-    metal(const color& albedo, double fuzz = 0) : albedo(std::make_shared<solid_color>(albedo)), fuzz(fuzz < 1 ? fuzz : 1) {}
-    metal(std::shared_ptr<texture> albedo, double fuzz = 0) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+    metal(const color& albedo, double fuzz = 0) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+    metal(const texture* albedo, double fuzz = 0) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
     bool scatter(const ray& ray_in, const hit_record& rec, color& attenuation, ray& scattered) const override
     {
+        STAT_INC(scatter_events[stat_metal]);
         vec3 reflected = reflect(ray_in.direction(), rec.normal);
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
+        double length = reflected.length();
+        reflected = reflected / length + (fuzz * random_unit_vector());
         scattered = ray(rec.p, reflected);
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        if (fuzz > 0)
+        {
+            rough_differentials(ray_in, rec, scattered);
+        }
+        else
+        {
+            reflect_differentials(ray_in, rec, 1 / length, scattered);
+        }
+        attenuation = albedo.value(rec.u, rec.v, rec.p, rec.uv_footprint);
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    color surface_albedo(const hit_record& rec) const override { return albedo.value(rec.u, rec.v, rec.p, rec.uv_footprint); }
+
 private:
-    std::shared_ptr<texture> albedo;
+    flat_texture albedo;
     double fuzz;
 };
 
@@ -77,6 +173,7 @@ public:
 
     bool scatter(const ray& ray_in, const hit_record& rec, color& attenuation, ray& scattered) const override
     {
+        STAT_INC(scatter_events[stat_dielectric]);
         attenuation = color(1.0,1.0,1.0);
         double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
 
@@ -84,48 +181,52 @@ public:
         double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
         double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
         bool cannot_refract = ri * sin_theta > 1.0;
-        vec3 direction;
         if (cannot_refract || reflectance(cos_theta,ri) > random_double())
         {
-            direction = reflect(unit_direction, rec.normal);
+            scattered = ray(rec.p, reflect(unit_direction, rec.normal));
+            reflect_differentials(ray_in, rec, 1 / ray_in.direction().length(), scattered);
         }
         else
         {
-            direction = refract(unit_direction, rec.normal, ri);
+            scattered = ray(rec.p, refract(unit_direction, rec.normal, ri));
+            refract_differentials(ray_in, rec, ri, scattered);
         }
-
-        scattered = ray(rec.p, direction);
         return true;
     }
+
+    color surface_albedo(const hit_record&) const override { return color(1,1,1); }
 };
 
 class diffuse_light : public material
 {
 public:
-    diffuse_light(const color& emission_color, double emission_strength = 1.0) : emission_color(std::make_shared<solid_color>(emission_color)), emission_strength(emission_strength) {}
-    diffuse_light(std::shared_ptr<texture> emission_color, double emission_strength = 1.0) : emission_color(emission_color), emission_strength(emission_strength) {}
+    diffuse_light(const color& emission_color, double emission_strength = 1.0) : emission_color(emission_color), emission_strength(emission_strength) {}
+    diffuse_light(const texture* emission_color, double emission_strength = 1.0) : emission_color(emission_color), emission_strength(emission_strength) {}
 
     color emitted(double u, double v, const point3& p) const override
     {
-        return emission_strength * emission_color->value(u, v, p);
+        STAT_INC(scatter_events[stat_diffuse_light]); // lights absorb, so count their hits instead
+        return emission_strength * emission_color.value(u, v, p);
     }
 
 private:
-    std::shared_ptr<texture> emission_color;
+    flat_texture emission_color;
     double emission_strength;
 };
 
 class one_sided_material : public material
 {
 public:
-    one_sided_material(std::shared_ptr<material> mat) : mat(mat)  {}
+    one_sided_material(const material* mat) : mat(mat)  {}
 
     bool scatter(const ray& ray_in, const hit_record& rec, color& attenuation, ray& scattered) const override
     {
+        STAT_INC(scatter_events[stat_one_sided]);
         if (!rec.front_face)
         {
             attenuation = color(1.0,1.0,1.0);
             scattered = ray(rec.p, ray_in.direction());
+            pass_differentials(ray_in, rec, scattered);
             return true;
         }
         else
@@ -134,24 +235,31 @@ public:
         }  
     }
 
+    color surface_albedo(const hit_record& rec) const override { return mat->surface_albedo(rec); }
+    bool passes_through(const hit_record& rec) const override { return !rec.front_face; }
+
 private:
-    std::shared_ptr<material> mat;
+    const material* mat;
 };
 
 class isotropic : public material
 {
 private:
-    std::shared_ptr<texture> tex;
+    flat_texture tex;
 
 public:
-    isotropic(const color& albedo) : tex(std::make_shared<solid_color>(albedo)) {}
-    isotropic(std::shared_ptr<texture> tex) : tex(tex) {}
+    isotropic(const color& albedo) : tex(albedo) {}
+    isotropic(const texture* tex) : tex(tex) {}
 
     bool scatter(const ray& ray_in, const hit_record& rec, color& attenuation, ray& scattered) const override
     {
+        STAT_INC(scatter_events[stat_isotropic]);
         scattered = ray(rec.p, random_unit_vector());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        rough_differentials(ray_in, rec, scattered);
+        attenuation = tex.value(rec.u, rec.v, rec.p, rec.uv_footprint);
         return true;
     }
 
+    color surface_albedo(const hit_record& rec) const override { return tex.value(rec.u, rec.v, rec.p, rec.uv_footprint); }
+
 };
\ No newline at end of file
@@ -0,0 +1,113 @@
+// Merges partial renders of one frame into an image.
+//
+//   g++ -std=c++17 -O3 -pthread src/merge.cpp -o merge
+//   ./merge --output output/frame.png [--format FMT] [--checkpoint PATH] PARTIAL...
+//
+// Partials are the files --checkpoint writes: those of --shard K/N runs, coordinators,
+// or interrupted progressive renders. Their radiance sums and sample counts are added,
+// so every pixel's average weighs each partial by the samples it holds there. All of
+// them must come from the same render settings and hold different samples (shards of
+// one frame, not copies of the same one). --checkpoint also saves the merged sums.
+
+#include "common.hpp"
+#include "accumulation.hpp"
+#include "image_io.hpp"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+bool write_merged_image(const accumulation_buffer& merged, const std::string& path, std::string format)
+{
+    if (format.empty())
+    {
+        format = image_format_from_path(path);
+    }
+    std::vector<color> pixels(size_t(merged.width) * merged.height);
+    for (int j = 0; j < merged.height; j++)
+    {
+        for (int i = 0; i < merged.width; i++)
+        {
+            pixels[size_t(j) * merged.width + i] = merged.average(i, j);
+        }
+    }
+    if (is_float_format(format))
+    {
+        return write_float_image(path, format, merged.width, merged.height, pixels.data());
+    }
+    std::vector<unsigned char> rgb(pixels.size() * 3);
+    for (size_t k = 0; k < pixels.size(); k++)
+    {
+        write_color(&rgb[3 * k], pixels[k]);
+    }
+    return write_image(path, format, merged.width, merged.height, rgb.data(), int(std::thread::hardware_concurrency()));
+}
+
+int main(int argc, char** argv)
+{
+    std::string output_path, output_format, checkpoint_path;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if ((arg == "-o" || arg == "--output") && has_value)       output_path = argv[++i];
+        else if ((arg == "-f" || arg == "--format") && has_value)  output_format = argv[++i];
+        else if (arg == "--checkpoint" && has_value)               checkpoint_path = argv[++i];
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            std::cerr << "Unknown option " << arg << '\n';
+            inputs.clear();
+            break;
+        }
+        else inputs.push_back(arg);
+    }
+    if (inputs.empty() || (output_path.empty() && checkpoint_path.empty()))
+    {
+        std::cerr << "Usage: " << argv[0] << " --output PATH [--format FMT] [--checkpoint PATH] PARTIAL...\n";
+        return 2;
+    }
+
+    accumulation_buffer merged;
+    std::string key;
+    for (size_t k = 0; k < inputs.size(); k++)
+    {
+        accumulation_buffer partial;
+        std::string partial_key;
+        if (!partial.read(inputs[k], partial_key))
+        {
+            return 1;
+        }
+        if (k == 0)
+        {
+            merged = std::move(partial);
+            key = partial_key;
+            continue;
+        }
+        if (partial.width != merged.width || partial.height != merged.height || partial_key != key)
+        {
+            std::cerr << inputs[k] << " was rendered with different settings than " << inputs[0] << '\n';
+            return 1;
+        }
+        merged.merge(partial);
+    }
+
+    auto summary = merged.summary();
+    std::clog << "Merged " << inputs.size() << " partials: " << summary.mean_samples << " samples per pixel (min "
+              << summary.min_samples << ", max " << summary.max_samples << ")\n";
+    if (summary.min_samples == 0)
+    {
+        std::clog << "Some pixels have no samples and stay black\n";
+    }
+
+    bool ok = true;
+    if (!checkpoint_path.empty())
+    {
+        ok = ensure_parent_directory(checkpoint_path) && merged.save(checkpoint_path, key);
+    }
+    if (!output_path.empty())
+    {
+        ok = write_merged_image(merged, output_path, output_format) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "hittable_list.hpp"
+#include "triangle.hpp"
+
+#include <array>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+bool closed_convex(const std::vector<point3>& vertices, const std::vector<std::array<int, 3>>& triangles)
+{
+    // Whether the triangles, wound counter clockwise seen from outside, make one closed
+    // convex surface: every edge is shared by exactly two of them, which don't fold
+    // inward there, and all of them are connected. A closed, connected, locally convex
+    // surface is convex (Tietze-Nakajima). Meshes with unwelded vertices answer false.
+    std::map<std::pair<int, int>, std::vector<int>> edges; // by vertex pair, the triangles on it
+    for (size_t k = 0; k < triangles.size(); k++)
+    {
+        for (int e = 0; e < 3; e++)
+        {
+            int a = triangles[k][e], b = triangles[k][(e + 1) % 3];
+            edges[{std::min(a, b), std::max(a, b)}].push_back(int(k));
+        }
+    }
+
+    std::vector<int> parent(triangles.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto root = [&](int k)
+    {
+        while (parent[k] != k)
+        {
+            k = parent[k] = parent[parent[k]];
+        }
+        return k;
+    };
+    double extent = 0; // scales the tolerance for the flat edges inside triangulated polygons
+    for (const auto& v : vertices)
+    {
+        extent = std::fmax(extent, v.length());
+    }
+    double tolerance = 1e-9 * extent;
+    for (const auto& [edge, sharing] : edges)
+    {
+        if (sharing.size() != 2)
+        {
+            return false;
+        }
+        for (int side = 0; side < 2; side++)
+        {
+            const auto& face = triangles[sharing[side]];
+            const auto& other = triangles[sharing[1 - side]];
+            int opposite = other[0] + other[1] + other[2] - edge.first - edge.second;
+            auto normal = cross(vertices[face[1]] - vertices[face[0]], vertices[face[2]] - vertices[face[0]]);
+            if (dot(normal, vertices[opposite] - vertices[face[0]]) > tolerance * normal.length())
+            {
+                return false;
+            }
+        }
+        parent[root(sharing[0])] = root(sharing[1]);
+    }
+    for (size_t k = 0; k < triangles.size(); k++)
+    {
+        if (root(int(k)) != root(0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool load_obj(const std::string& path, const material* mat, hittable_list& out, scene_arena& arena,
+              double scale = 1.0, const vec3& offset = vec3(0,0,0), bool* convex = nullptr)
+{
+    // Minimal Wavefront OBJ reader: vertex positions and polygonal faces (fan triangulated).
+    // With convex, also tells whether the faces make one closed convex surface.
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Cannot open mesh " << path << '\n';
+        return false;
+    }
+
+    std::vector<point3> vertices;
+    std::vector<std::array<int, 3>> triangles;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream in(line);
+        std::string keyword;
+        in >> keyword;
+        if (keyword == "v")
+        {
+            double x, y, z;
+            in >> x >> y >> z;
+            vertices.push_back(scale * point3(x, y, z) + offset);
+        }
+        else if (keyword == "f")
+        {
+            std::vector<int> face;
+            std::string token;
+            while (in >> token)
+            {
+                // "7", "7/1" and "7/1/3" all refer to vertex 7; negative indices count from the end.
+                int index = std::stoi(token.substr(0, token.find('/')));
+                index = (index < 0) ? int(vertices.size()) + index : index - 1;
+                if (index < 0 || index >= int(vertices.size()))
+                {
+                    std::cerr << path << ": face references missing vertex\n";
+                    return false;
+                }
+                face.push_back(index);
+            }
+            for (size_t k = 2; k < face.size(); k++)
+            {
+                out.add(triangle::from_vertices(arena, vertices[face[0]], vertices[face[k-1]], vertices[face[k]], mat));
+                triangles.push_back({face[0], face[k-1], face[k]});
+            }
+        }
+    }
+    if (convex)
+    {
+        *convex = !triangles.empty() && closed_convex(vertices, triangles);
+    }
+    return true;
+}
+
+void tessellated_torus(const point3& center, double major_radius, double minor_radius, int rings, int sides,
+                       const material* mat, hittable_list& out, scene_arena& arena)
+{
+    // Procedural mesh with rings*sides*2 triangles, lying in the xz plane, wound counter
+    // clockwise seen from outside like OBJ faces, so the normals point outward.
+    auto vertex = [&](int ring, int side)
+    {
+        double theta = 2 * pi * (ring % rings) / rings;
+        double phi = 2 * pi * (side % sides) / sides;
+        double r = major_radius + minor_radius * std::cos(phi);
+        return center + point3(r * std::cos(theta), minor_radius * std::sin(phi), r * std::sin(theta));
+    };
+
+    for (int ring = 0; ring < rings; ring++)
+    {
+        for (int side = 0; side < sides; side++)
+        {
+            auto a = vertex(ring, side);
+            auto b = vertex(ring + 1, side);
+            auto c = vertex(ring + 1, side + 1);
+            auto d = vertex(ring, side + 1);
+            out.add(triangle::from_vertices(arena, a, c, b, mat));
+            out.add(triangle::from_vertices(arena, a, d, c, mat));
+        }
+    }
+}
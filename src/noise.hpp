@@ -0,0 +1,293 @@
+#pragma once
+
+#include "texture.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+// Procedural noise: improved Perlin noise (Perlin 2002) and 3D simplex noise (Gustavson's
+// formulation of Perlin 2001), summed over octaves as fBm or turbulence, and textures made
+// from them. Both share one seeded permutation table and the 12 cube edge gradients.
+//
+// Points are evaluated in blocks of structure-of-arrays data. Per point, the lattice cell is
+// hashed through the permutation table and its corner gradients looked up; the arithmetic
+// after that (fade weights and interpolation for Perlin, corner falloffs for simplex) runs
+// as plain loops over the block, which the compiler vectorizes. Octaves loop around whole
+// blocks, so n points at k octaves take k passes of those loops.
+
+enum noise_basis
+{
+    perlin_basis,
+    simplex_basis
+};
+
+class noise_generator
+{
+public:
+    static constexpr int block = 64; // points per vectorized step
+
+    explicit noise_generator(uint64_t seed = 0)
+    {
+        // A shuffled permutation of 0..255, doubled so hashing lattice coordinates needs no
+        // wrapping beyond the first & 255.
+        std::array<int, 256> order;
+        for (int k = 0; k < 256; k++)
+        {
+            order[k] = k;
+        }
+        rng generator(seed);
+        for (int k = 255; k > 0; k--)
+        {
+            std::swap(order[k], order[generator.next_uint() % uint32_t(k + 1)]);
+        }
+        for (int k = 0; k < 512; k++)
+        {
+            perm[k] = order[k & 255];
+        }
+    }
+
+    double noise(noise_basis basis, const point3& p) const
+    {
+        // In about [-1, 1].
+        double x = p.x(), y = p.y(), z = p.z(), out;
+        evaluate(basis, 1, &x, &y, &z, &out);
+        return out;
+    }
+
+    double fractal(noise_basis basis, bool turbulent, int octaves, const point3& p) const
+    {
+        double x = p.x(), y = p.y(), z = p.z(), out;
+        fractal_batch(basis, turbulent, octaves, 1, &x, &y, &z, &out);
+        return out;
+    }
+
+    void evaluate(noise_basis basis, int count, const double* x, const double* y, const double* z, double* out) const
+    {
+        // out[k] = noise at (x[k], y[k], z[k]).
+        for (int start = 0; start < count; start += block)
+        {
+            int n = std::min(block, count - start);
+            if (basis == perlin_basis)
+            {
+                perlin_block(n, x + start, y + start, z + start, out + start);
+            }
+            else
+            {
+                simplex_block(n, x + start, y + start, z + start, out + start);
+            }
+        }
+    }
+
+    void fractal_batch(noise_basis basis, bool turbulent, int octaves, int count,
+                       const double* x, const double* y, const double* z, double* out) const
+    {
+        // Octaves at doubling frequency and halving amplitude: signed for fBm, absolute values
+        // for turbulence.
+        double xs[block], ys[block], zs[block], octave[block];
+        for (int start = 0; start < count; start += block)
+        {
+            int n = std::min(block, count - start);
+            double* sum = out + start;
+            for (int k = 0; k < n; k++)
+            {
+                xs[k] = x[start + k];
+                ys[k] = y[start + k];
+                zs[k] = z[start + k];
+                sum[k] = 0;
+            }
+            double weight = 1;
+            for (int o = 0; o < octaves; o++)
+            {
+                if (basis == perlin_basis)
+                {
+                    perlin_block(n, xs, ys, zs, octave);
+                }
+                else
+                {
+                    simplex_block(n, xs, ys, zs, octave);
+                }
+                for (int k = 0; k < n; k++)
+                {
+                    sum[k] += weight * (turbulent ? std::fabs(octave[k]) : octave[k]);
+                    xs[k] *= 2;
+                    ys[k] *= 2;
+                    zs[k] *= 2;
+                }
+                weight *= 0.5;
+            }
+        }
+    }
+
+private:
+    int perm[512];
+
+    // Cube edge directions, indexed by a hash & 15; the last four repeat to fill 16.
+    static constexpr double gradient_x[16] = {1, -1, 1, -1, 1, -1, 1, -1, 0, 0, 0, 0, 1, 0, -1, 0};
+    static constexpr double gradient_y[16] = {1, 1, -1, -1, 0, 0, 0, 0, 1, -1, 1, -1, 1, -1, 1, -1};
+    static constexpr double gradient_z[16] = {0, 0, 0, 0, 1, 1, -1, -1, 1, 1, -1, -1, 0, 1, 0, -1};
+
+    static double gradient_dot(int hash, double x, double y, double z)
+    {
+        int h = hash & 15;
+        return gradient_x[h] * x + gradient_y[h] * y + gradient_z[h] * z;
+    }
+
+    static int lattice_floor(double x)
+    {
+        // std::floor to int without the libm call; fine for |x| < 2^31.
+        int truncated = int(x);
+        return truncated - (x < truncated);
+    }
+
+    void perlin_block(int n, const double* x, const double* y, const double* z, double* out) const
+    {
+        // Per point: the lattice cell, its eight corner hashes and their gradients' dot
+        // products with the offset. Then, vectorized, fade weights and trilinear blending.
+        double fx[block], fy[block], fz[block];
+        double corner[8][block]; // corner (dx, dy, dz) at index dx + 2 dy + 4 dz
+        for (int k = 0; k < n; k++)
+        {
+            int i = lattice_floor(x[k]), j = lattice_floor(y[k]), l = lattice_floor(z[k]);
+            double x0 = x[k] - i, y0 = y[k] - j, z0 = z[k] - l;
+            double x1 = x0 - 1, y1 = y0 - 1, z1 = z0 - 1;
+            i &= 255;
+            j &= 255;
+            l &= 255;
+            int a = perm[i] + j, b = perm[i + 1] + j;
+            int aa = perm[a] + l, ab = perm[a + 1] + l;
+            int ba = perm[b] + l, bb = perm[b + 1] + l;
+            corner[0][k] = gradient_dot(perm[aa], x0, y0, z0);
+            corner[1][k] = gradient_dot(perm[ba], x1, y0, z0);
+            corner[2][k] = gradient_dot(perm[ab], x0, y1, z0);
+            corner[3][k] = gradient_dot(perm[bb], x1, y1, z0);
+            corner[4][k] = gradient_dot(perm[aa + 1], x0, y0, z1);
+            corner[5][k] = gradient_dot(perm[ba + 1], x1, y0, z1);
+            corner[6][k] = gradient_dot(perm[ab + 1], x0, y1, z1);
+            corner[7][k] = gradient_dot(perm[bb + 1], x1, y1, z1);
+            fx[k] = x0;
+            fy[k] = y0;
+            fz[k] = z0;
+        }
+
+        auto fade = [](double t) { return t * t * t * (t * (t * 6 - 15) + 10); };
+        auto mix = [](double a, double b, double t) { return a + t * (b - a); };
+        for (int k = 0; k < n; k++)
+        {
+            double u = fade(fx[k]), v = fade(fy[k]), w = fade(fz[k]);
+            double near = mix(mix(corner[0][k], corner[1][k], u), mix(corner[2][k], corner[3][k], u), v);
+            double far = mix(mix(corner[4][k], corner[5][k], u), mix(corner[6][k], corner[7][k], u), v);
+            out[k] = mix(near, far, w);
+        }
+    }
+
+    void simplex_block(int n, const double* x, const double* y, const double* z, double* out) const
+    {
+        // Per point: skew to the simplex lattice, pick the tetrahedron by ranking the offsets
+        // and look up its four corners' gradients. Then, vectorized, sum the corners' radially
+        // falling off contributions.
+        const double skew = 1.0 / 3, unskew = 1.0 / 6;
+        double cx[4][block], cy[4][block], cz[4][block]; // offsets from each corner
+        double gx[4][block], gy[4][block], gz[4][block];
+        for (int k = 0; k < n; k++)
+        {
+            double s = (x[k] + y[k] + z[k]) * skew;
+            int i = lattice_floor(x[k] + s), j = lattice_floor(y[k] + s), l = lattice_floor(z[k] + s);
+            double t = (i + j + l) * unskew;
+            double x0 = x[k] - (i - t), y0 = y[k] - (j - t), z0 = z[k] - (l - t);
+            // Lattice steps to the second and third corners: along the largest offset, then
+            // along the two largest.
+            int i1 = (x0 >= y0) & (x0 >= z0), j1 = (y0 > x0) & (y0 >= z0), k1 = (z0 > x0) & (z0 > y0);
+            int i2 = (x0 >= y0) | (x0 >= z0), j2 = (y0 > x0) | (y0 >= z0), k2 = (z0 > x0) | (z0 > y0);
+            i &= 255;
+            j &= 255;
+            l &= 255;
+            int hash[4] = {perm[i + perm[j + perm[l]]], perm[i + i1 + perm[j + j1 + perm[l + k1]]],
+                           perm[i + i2 + perm[j + j2 + perm[l + k2]]], perm[i + 1 + perm[j + 1 + perm[l + 1]]]};
+            int steps[4][3] = {{0, 0, 0}, {i1, j1, k1}, {i2, j2, k2}, {1, 1, 1}};
+            for (int c = 0; c < 4; c++)
+            {
+                cx[c][k] = x0 - steps[c][0] + c * unskew;
+                cy[c][k] = y0 - steps[c][1] + c * unskew;
+                cz[c][k] = z0 - steps[c][2] + c * unskew;
+                int h = hash[c] & 15;
+                gx[c][k] = gradient_x[h];
+                gy[c][k] = gradient_y[h];
+                gz[c][k] = gradient_z[h];
+            }
+        }
+
+        for (int k = 0; k < n; k++)
+        {
+            out[k] = 0;
+        }
+        for (int c = 0; c < 4; c++)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                double falloff = 0.6 - cx[c][k] * cx[c][k] - cy[c][k] * cy[c][k] - cz[c][k] * cz[c][k];
+                falloff = 0.5 * (falloff + std::fabs(falloff)); // max(falloff, 0), branch free
+                falloff *= falloff;
+                out[k] += 32 * falloff * falloff * (gx[c][k] * cx[c][k] + gy[c][k] * cy[c][k] + gz[c][k] * cz[c][k]);
+            }
+        }
+    }
+};
+
+enum noise_pattern
+{
+    noise_fbm,        // fBm mapped from [-1, 1] to [0, 1]
+    noise_turbulence, // turbulence clamped to [0, 1]
+    noise_marble      // sine bands along z, displaced by turbulence (Perlin's marble)
+};
+
+class noise_texture : public texture
+{
+    // Blends two colors by a noise pattern of p. scale is the base frequency, or for marble
+    // the frequency of the bands.
+public:
+    noise_texture(noise_basis basis, noise_pattern pattern, double scale, int octaves,
+                  const color& low, const color& high, uint64_t seed = 0)
+        : generator(seed), basis(basis), pattern(pattern), scale(scale), octaves(std::max(1, octaves)), low(low), high(high) {}
+
+    color value(double u, double v, const point3& p) const override
+    {
+        color out;
+        value_batch(1, &u, &v, &p, &out);
+        return out;
+    }
+
+    void value_batch(int count, const double*, const double*, const point3* p, color* out) const override
+    {
+        double xs[noise_generator::block], ys[noise_generator::block], zs[noise_generator::block];
+        double amount[noise_generator::block];
+        for (int start = 0; start < count; start += noise_generator::block)
+        {
+            int n = std::min(noise_generator::block, count - start);
+            // Marble keeps the turbulence at unit frequency and scales the bands instead.
+            double frequency = (pattern == noise_marble) ? 1 : scale;
+            for (int k = 0; k < n; k++)
+            {
+                xs[k] = frequency * p[start + k].x();
+                ys[k] = frequency * p[start + k].y();
+                zs[k] = frequency * p[start + k].z();
+            }
+            generator.fractal_batch(basis, pattern != noise_fbm, octaves, n, xs, ys, zs, amount);
+            for (int k = 0; k < n; k++)
+            {
+                double t = amount[k];
+                if (pattern == noise_fbm)             t = 0.5 * (1 + t);
+                else if (pattern == noise_marble)     t = 0.5 * (1 + std::sin(scale * p[start + k].z() + 10 * t));
+                out[start + k] = lerp(low, high, std::clamp(t, 0.0, 1.0));
+            }
+        }
+    }
+
+private:
+    noise_generator generator;
+    noise_basis basis;
+    noise_pattern pattern;
+    double scale;
+    int octaves;
+    color low, high;
+};
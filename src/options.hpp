@@ -0,0 +1,401 @@
+#pragma once
+
+#include "aov.hpp"
+#include "camera.hpp"
+#include "image_texture.hpp"
+#include "image_io.hpp"
+#include "trace.hpp"
+
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+class render_options
+{
+public:
+    // Zero or empty values keep whatever the scene sets up.
+    std::string scene = "cornell";
+    int image_width = 0;
+    int image_height = 0;
+    int samples_per_pixel = 0;
+    int max_bounces = -1;
+    int thread_count = 0;
+    int tile_size = 0;
+    bool move_lookfrom = false, move_lookat = false, move_up = false; // whether the next three replace the scene's
+    point3 lookfrom, lookat;
+    vec3 up;
+    double vfov = 0;
+    double defocus_angle = -1;
+    uint64_t seed = 0;
+    double time_budget = 0;
+    double deadline = 0;
+    bool refine_noisy_tiles = false;
+    std::array<double, 4> crop{}; // x0, y0, x1, y1; all zero renders the whole frame
+    bool crop_normalized = false;
+    bool crop_keep_frame = false;
+    std::string coordinator_address;
+    std::string worker_address;
+    int shard_samples = 0;
+    double worker_timeout = 0;
+    int shard_index = 0;
+    int shard_count = 0;
+    std::string serve_address;
+    std::string submit_address;
+    std::string interactive_segment;
+    bool cache_primary_hits = false;
+    int texture_cache_megabytes = 0;
+    bool point_sample_textures = false;
+    std::string output_path;
+    std::string output_format;
+    bool print_stats = false;
+    bool write_heatmaps = false;
+    bool count_hardware_events = false;
+    bool out_of_core = false;
+    std::array<bool, aov_kinds> write_aovs{};
+    bool denoise = false;
+    std::string checkpoint_path;
+    bool resume = false;
+    int samples_per_pass = 0;
+    double checkpoint_interval = 0;
+    std::string stats_json_path;
+    std::string trace_path;
+    bool show_help = false;
+
+    bool distributed() const
+    {
+        return !coordinator_address.empty() || !worker_address.empty() || shard_count > 0
+            || !serve_address.empty() || !submit_address.empty() || !interactive_segment.empty();
+    }
+
+    void apply(camera& cam) const
+    {
+        if (image_width > 0)
+        {
+            if (image_height > 0)
+            {
+                cam.aspect_ratio = double(image_width) / image_height;
+            }
+            cam.image_width = image_width;
+        }
+        else if (image_height > 0)
+        {
+            cam.image_width = int(image_height * cam.aspect_ratio + 0.5);
+        }
+        if (move_lookfrom)         cam.lookfrom = lookfrom;
+        if (move_lookat)           cam.lookat = lookat;
+        if (move_up)               cam.up = up;
+        if (vfov > 0)              cam.vfov = vfov;
+        if (defocus_angle >= 0)    cam.defocus_angle = defocus_angle;
+        if (samples_per_pixel > 0) cam.samples_per_pixel = samples_per_pixel;
+        if (max_bounces >= 0)      cam.max_bounces = max_bounces;
+        if (tile_size > 0)         cam.tile_size = tile_size;
+        if (!output_path.empty())  cam.output_path = output_path;
+        if (!output_format.empty()) cam.output_format = output_format;
+        cam.thread_count = thread_count;
+        cam.seed = seed;
+        cam.time_budget = time_budget;
+        cam.deadline = deadline;
+        cam.refine_noisy_tiles = refine_noisy_tiles;
+        if (point_sample_textures) cam.texture_filtering = false;
+        cam.crop_x0 = crop[0];
+        cam.crop_y0 = crop[1];
+        cam.crop_x1 = crop[2];
+        cam.crop_y1 = crop[3];
+        cam.crop_normalized = crop_normalized;
+        cam.crop_keep_frame = crop_keep_frame;
+        cam.coordinator_address = coordinator_address;
+        cam.worker_address = worker_address;
+        cam.shard_samples = shard_samples;
+        if (worker_timeout > 0) cam.worker_timeout = worker_timeout;
+        cam.shard_index = shard_index;
+        cam.shard_count = shard_count;
+        cam.write_heatmaps = write_heatmaps;
+        cam.count_hardware_events = count_hardware_events;
+        cam.out_of_core = out_of_core;
+        cam.write_aovs = write_aovs;
+        cam.denoise = denoise;
+        cam.checkpoint_path = checkpoint_path;
+        cam.resume = resume;
+        if (samples_per_pass > 0)    cam.samples_per_pass = samples_per_pass;
+        if (checkpoint_interval > 0) cam.checkpoint_interval = checkpoint_interval;
+        if (texture_cache_megabytes > 0)
+        {
+            // Process wide, image textures share one tile cache.
+            texture_tile_cache::instance().set_capacity(size_t(texture_cache_megabytes) << 20);
+        }
+    }
+};
+
+void print_usage(const char* program)
+{
+    std::clog
+        << "Usage: " << program << " [options]\n"
+        << "  -s, --scene NAME|FILE     built-in scene (cornell, spheres, mesh) or scene file (default cornell)\n"
+        << "  -W, --width N             image width in pixels\n"
+        << "  -H, --height N            image height in pixels\n"
+        << "  -r, --resolution WxH      image width and height\n"
+        << "  -n, --spp N               samples per pixel\n"
+        << "  -b, --bounces N           maximum path depth\n"
+        << "  -t, --threads N           worker threads (default: all hardware threads)\n"
+        << "      --lookfrom X,Y,Z      camera position\n"
+        << "      --lookat X,Y,Z        point the camera looks at, and in focus\n"
+        << "      --up X,Y,Z            camera up direction\n"
+        << "      --vfov DEG            vertical field of view\n"
+        << "      --defocus DEG         lens blur, as the angle the rays through a pixel spread over (0 is a pinhole)\n"
+        << "      --tile-size N         tile edge in pixels (default 32)\n"
+        << "      --texture-cache MB    memory for decoded image texture tiles, shared by all textures (default 256)\n"
+        << "      --no-texture-filtering  sample image textures at full resolution, not the mip level of each pixel\n"
+        << "      --crop X0,Y0,X1,Y1    trace only this region of the frame, in pixels or, with decimals, fractions\n"
+        << "                            of the frame (0.25,0.25,0.75,0.75); the output is the region alone\n"
+        << "      --crop-full           with --crop, write the full-size image with only the region filled\n"
+        << "      --seed N              random seed (default 0)\n"
+        << "  -o, --output PATH         output image (default output/test.png)\n"
+        << "  -f, --format FMT          png, ppm, pfm, exr, qoi, bmp, tga or jpg (default: from extension);\n"
+        << "                            pfm and exr keep linear HDR values, all but png and the stb formats\n"
+        << "                            are written tile by tile while rendering\n"
+        << "      --aov LIST            also write albedo, normal, depth, material_id, emission or all\n"
+        << "                            (comma separated) as NAME_albedo.pfm, or .exr for exr output\n"
+        << "      --out-of-core         stream bands of tiles to disk without holding the full image (png, ppm, pfm, qoi)\n"
+        << "      --denoise             filter the image guided by albedo, normal and depth, for low spp\n"
+        << "      --checkpoint PATH     render in progressive passes and save the accumulated samples to PATH\n"
+        << "      --resume              continue from the --checkpoint file if it exists, up to --spp\n"
+        << "      --pass-spp N          samples per progressive pass (default 16)\n"
+        << "      --checkpoint-interval SEC  seconds between checkpoints (default 60, always saved at the end)\n"
+        << "      --time-budget SEC     lower samples per pixel to finish within SEC seconds\n"
+        << "      --deadline SEC        render progressive passes until the next would miss SEC seconds, up to --spp;\n"
+        << "                            samples reached and the noise estimate go to NAME_render.json and PNG text\n"
+        << "      --refine-noisy        with --deadline, spend the time after the last full pass on the noisiest tiles\n"
+        << "      --coordinator ADDR    hand the frame to --worker processes connecting to ADDR (HOST:PORT, PORT or unix:PATH)\n"
+        << "      --worker ADDR         render work units for the coordinator at ADDR, with the same scene options\n"
+        << "      --shard-spp N         samples per distributed work unit (default: whole tiles)\n"
+        << "      --worker-timeout SEC  give a unit to another worker when one holds it longer (default 600)\n"
+        << "      --shard K/N           render only the K-th of every N work units into --checkpoint, for merge\n"
+        << "      --serve ADDR          keep scenes loaded and render jobs from --submit clients, previewing every pass\n"
+        << "      --submit ADDR         send this render to the server at ADDR instead of rendering here\n"
+        << "      --primary-cache       with --submit, keep the camera rays' first hits on the server and shade from\n"
+        << "                            them while only the scene file's materials and textures change\n"
+        << "      --interactive NAME    refine previews into the shared memory framebuffer NAME (/rt_view) for\n"
+        << "                            the view tool, restarting whenever it moves the camera\n"
+        << "      --stats               print render statistics when done\n"
+        << "      --heatmaps            also write per-pixel time, ray and traversal step images (NAME_time.png, ...)\n"
+        << "      --stats-json PATH     write render statistics as JSON\n"
+        << "      --perf-counters       count cycles, instructions, cache and branch misses per phase and thread (Linux)\n"
+        << "      --trace PATH          write a Chrome trace event timeline (Perfetto, chrome://tracing)\n"
+        << "  -h, --help                show this message\n";
+}
+
+bool parse_args(int argc, char** argv, render_options& options)
+{
+    auto parse_int = [](const char* text, int& out)
+    {
+        char* end;
+        errno = 0;
+        long value = std::strtol(text, &end, 10);
+        if (*end != '\0' || end == text || errno == ERANGE || value < INT_MIN || value > INT_MAX)
+            return false;
+        out = int(value);
+        return true;
+    };
+
+    auto parse_vec3 = [](const char* text, vec3& out)
+    {
+        double x, y, z;
+        char end;
+        if (std::sscanf(text, "%lf,%lf,%lf%c", &x, &y, &z, &end) != 3)
+        {
+            return false;
+        }
+        out = vec3(x, y, z);
+        return true;
+    };
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help")
+        {
+            options.show_help = true;
+            continue;
+        }
+        if (arg == "--stats")
+        {
+            options.print_stats = true;
+            continue;
+        }
+        if (arg == "--heatmaps")
+        {
+            options.write_heatmaps = true;
+            continue;
+        }
+        if (arg == "--perf-counters")
+        {
+            options.count_hardware_events = true;
+            continue;
+        }
+        if (arg == "--out-of-core")
+        {
+            options.out_of_core = true;
+            continue;
+        }
+        if (arg == "--denoise")
+        {
+            options.denoise = true;
+            continue;
+        }
+        if (arg == "--resume")
+        {
+            options.resume = true;
+            continue;
+        }
+        if (arg == "--refine-noisy")
+        {
+            options.refine_noisy_tiles = true;
+            continue;
+        }
+        if (arg == "--primary-cache")
+        {
+            options.cache_primary_hits = true;
+            continue;
+        }
+        if (arg == "--no-texture-filtering")
+        {
+            options.point_sample_textures = true;
+            continue;
+        }
+        if (arg == "--crop-full")
+        {
+            options.crop_keep_frame = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << arg << " (or unknown option)\n";
+            return false;
+        }
+        const char* value = argv[++i];
+        bool ok = true;
+
+        if (arg == "-s" || arg == "--scene")            options.scene = value;
+        else if (arg == "-W" || arg == "--width")       ok = parse_int(value, options.image_width) && options.image_width > 0;
+        else if (arg == "-H" || arg == "--height")      ok = parse_int(value, options.image_height) && options.image_height > 0;
+        else if (arg == "-r" || arg == "--resolution")
+        {
+            ok = std::sscanf(value, "%dx%d", &options.image_width, &options.image_height) == 2
+                && options.image_width > 0 && options.image_height > 0;
+        }
+        else if (arg == "-n" || arg == "--spp")         ok = parse_int(value, options.samples_per_pixel) && options.samples_per_pixel > 0;
+        else if (arg == "-b" || arg == "--bounces")     ok = parse_int(value, options.max_bounces) && options.max_bounces >= 0;
+        else if (arg == "-t" || arg == "--threads")     ok = parse_int(value, options.thread_count) && options.thread_count > 0;
+        else if (arg == "--tile-size")                  ok = parse_int(value, options.tile_size) && options.tile_size > 0;
+        else if (arg == "--lookfrom")                   ok = options.move_lookfrom = parse_vec3(value, options.lookfrom);
+        else if (arg == "--lookat")                     ok = options.move_lookat = parse_vec3(value, options.lookat);
+        else if (arg == "--up")                         ok = options.move_up = parse_vec3(value, options.up) && options.up.length_squared() > 0;
+        else if (arg == "--vfov")
+        {
+            char* end;
+            options.vfov = std::strtod(value, &end);
+            ok = *end == '\0' && options.vfov > 0 && options.vfov < 180;
+        }
+        else if (arg == "--defocus")
+        {
+            char* end;
+            options.defocus_angle = std::strtod(value, &end);
+            ok = *end == '\0' && options.defocus_angle >= 0 && options.defocus_angle < 180;
+        }
+        else if (arg == "--seed")
+        {
+            // strtoull would accept "-1" and wrap it, so require a digit up front
+            char* end;
+            errno = 0;
+            options.seed = std::strtoull(value, &end, 10);
+            ok = std::isdigit((unsigned char)value[0]) && *end == '\0' && errno != ERANGE;
+        }
+        else if (arg == "-o" || arg == "--output")      options.output_path = value;
+        else if (arg == "--stats-json")                 options.stats_json_path = value;
+        else if (arg == "--trace")                      options.trace_path = value;
+        else if (arg == "--aov")                        ok = parse_aov_list(value, options.write_aovs);
+        else if (arg == "--checkpoint")                 options.checkpoint_path = value;
+        else if (arg == "--coordinator")                options.coordinator_address = value;
+        else if (arg == "--worker")                     options.worker_address = value;
+        else if (arg == "--serve")                      options.serve_address = value;
+        else if (arg == "--submit")                     options.submit_address = value;
+        else if (arg == "--interactive")                options.interactive_segment = value;
+        else if (arg == "--shard-spp")                  ok = parse_int(value, options.shard_samples) && options.shard_samples > 0;
+        else if (arg == "--shard")
+        {
+            ok = std::sscanf(value, "%d/%d", &options.shard_index, &options.shard_count) == 2
+                && options.shard_index >= 0 && options.shard_index < options.shard_count;
+        }
+        else if (arg == "--texture-cache")              ok = parse_int(value, options.texture_cache_megabytes) && options.texture_cache_megabytes > 0;
+        else if (arg == "--crop")
+        {
+            // Pixel coordinates unless written with decimals, which are fractions of the frame.
+            auto& c = options.crop;
+            ok = std::sscanf(value, "%lf,%lf,%lf,%lf", &c[0], &c[1], &c[2], &c[3]) == 4
+                && c[0] >= 0 && c[1] >= 0 && c[2] > c[0] && c[3] > c[1];
+            options.crop_normalized = std::strchr(value, '.') != nullptr;
+            ok = ok && (!options.crop_normalized || (c[2] <= 1 && c[3] <= 1));
+        }
+        else if (arg == "--pass-spp")                   ok = parse_int(value, options.samples_per_pass) && options.samples_per_pass > 0;
+        else if (arg == "--worker-timeout")
+        {
+            char* end;
+            options.worker_timeout = std::strtod(value, &end);
+            ok = *end == '\0' && options.worker_timeout > 0;
+        }
+        else if (arg == "--checkpoint-interval")
+        {
+            char* end;
+            options.checkpoint_interval = std::strtod(value, &end);
+            ok = *end == '\0' && options.checkpoint_interval > 0;
+        }
+        else if (arg == "-f" || arg == "--format")
+        {
+            options.output_format = value;
+            ok = is_supported_image_format(options.output_format);
+        }
+        else if (arg == "--time-budget")
+        {
+            char* end;
+            options.time_budget = std::strtod(value, &end);
+            ok = *end == '\0' && options.time_budget > 0;
+        }
+        else if (arg == "--deadline")
+        {
+            char* end;
+            options.deadline = std::strtod(value, &end);
+            ok = *end == '\0' && options.deadline > 0;
+        }
+        else
+        {
+            std::cerr << "Unknown option " << arg << '\n';
+            return false;
+        }
+
+        if (!ok)
+        {
+            std::cerr << "Invalid value '" << value << "' for " << arg << '\n';
+            return false;
+        }
+    }
+    return true;
+}
+
+void write_reports(const render_options& options, const render_stats& stats)
+{
+    // The --stats-json and --trace files of a finished render.
+    if (!options.stats_json_path.empty() && ensure_parent_directory(options.stats_json_path))
+    {
+        std::ofstream(options.stats_json_path) << stats.to_json();
+    }
+    if (!options.trace_path.empty() && ensure_parent_directory(options.trace_path))
+    {
+        tracer::instance().write_json(options.trace_path);
+    }
+}
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters through Linux perf_event_open. A perf_counter_group
+// counts user-space events of the thread that opened it. When the kernel refuses
+// (perf_event_paranoid, containers, other platforms) the group reports itself
+// unavailable and every reading stays invalid, so callers never need to special case it.
+// Phases that spread over helper threads (denoise, encode) sum a group per thread in a
+// perf_phase_totals, as the render phase does with its workers.
+
+enum perf_counter_kind
+{
+    perf_cycles, perf_instructions, perf_cache_references, perf_cache_misses,
+    perf_branches, perf_branch_misses, perf_counter_kinds
+};
+
+const char* const perf_counter_names[] = {
+    "cycles", "instructions", "cache_references", "cache_misses", "branches", "branch_misses"
+};
+
+class perf_counter_values
+{
+public:
+    std::array<long long, perf_counter_kinds> counts{};
+    std::array<bool, perf_counter_kinds> present{}; // counters the CPU or kernel refused stay absent
+    bool valid = false;
+
+    void merge(const perf_counter_values& other)
+    {
+        if (!other.valid)
+        {
+            return;
+        }
+        for (int k = 0; k < perf_counter_kinds; k++)
+        {
+            counts[k] += other.counts[k];
+            present[k] = present[k] || other.present[k];
+        }
+        valid = true;
+    }
+
+    double ratio(perf_counter_kind numerator, perf_counter_kind denominator) const
+    {
+        if (!present[numerator] || !present[denominator] || counts[denominator] == 0)
+        {
+            return 0;
+        }
+        return double(counts[numerator]) / counts[denominator];
+    }
+
+    void print(std::ostream& out) const
+    {
+        if (!valid)
+        {
+            out << "unavailable";
+            return;
+        }
+        for (int k = 0; k < perf_counter_kinds; k++)
+        {
+            if (present[k])
+            {
+                out << perf_counter_names[k] << ' ' << counts[k] << "  ";
+            }
+        }
+        out << "IPC " << std::setprecision(3) << ratio(perf_instructions, perf_cycles)
+            << "  cache miss rate " << ratio(perf_cache_misses, perf_cache_references)
+            << "  branch miss rate " << ratio(perf_branch_misses, perf_branches) << std::setprecision(6);
+    }
+
+    std::string to_json() const
+    {
+        if (!valid)
+        {
+            return "null";
+        }
+        std::ostringstream out;
+        out << '{';
+        for (int k = 0; k < perf_counter_kinds; k++)
+        {
+            if (present[k])
+            {
+                out << '"' << perf_counter_names[k] << "\": " << counts[k] << ", ";
+            }
+        }
+        out << "\"ipc\": " << ratio(perf_instructions, perf_cycles) << '}';
+        return out.str();
+    }
+};
+
+class perf_counter_group
+{
+public:
+    perf_counter_group() { fds.fill(-1); }
+    ~perf_counter_group() { close(); }
+
+    perf_counter_group(const perf_counter_group&) = delete;
+    perf_counter_group& operator=(const perf_counter_group&) = delete;
+
+    bool open()
+    {
+#ifdef __linux__
+        static const unsigned long long configs[perf_counter_kinds] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_REFERENCES,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES
+        };
+        for (int k = 0; k < perf_counter_kinds; k++)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[k];
+            attr.disabled = (k == 0);   // the leader starts the whole group
+            attr.exclude_kernel = 1;    // user space only, allowed at perf_event_paranoid 2
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+
+            int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, (k == 0) ? -1 : fds[0], 0));
+            if (fd < 0 && k == 0)
+            {
+                report_unavailable(errno);
+                return false;
+            }
+            fds[k] = fd;
+            if (fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_ID, &ids[k]);
+            }
+        }
+        return true;
+#else
+        report_unavailable(0);
+        return false;
+#endif
+    }
+
+    bool is_open() const { return fds[0] >= 0; }
+
+    void start()
+    {
+#ifdef __linux__
+        if (is_open())
+        {
+            ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    perf_counter_values read() const
+    {
+        // Counts since the last start(); the group keeps running.
+        perf_counter_values values;
+#ifdef __linux__
+        if (!is_open())
+        {
+            return values;
+        }
+        struct { unsigned long long nr; struct { unsigned long long value, id; } entries[perf_counter_kinds]; } data;
+        if (::read(fds[0], &data, sizeof(data)) <= 0)
+        {
+            return values;
+        }
+        for (unsigned long long e = 0; e < data.nr && e < perf_counter_kinds; e++)
+        {
+            for (int k = 0; k < perf_counter_kinds; k++)
+            {
+                if (fds[k] >= 0 && ids[k] == data.entries[e].id)
+                {
+                    values.counts[k] = (long long)data.entries[e].value;
+                    values.present[k] = true;
+                }
+            }
+        }
+        values.valid = true;
+#endif
+        return values;
+    }
+
+    void close()
+    {
+#ifdef __linux__
+        for (auto& fd : fds)
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+#endif
+    }
+
+private:
+    std::array<int, perf_counter_kinds> fds;
+    std::array<unsigned long long, perf_counter_kinds> ids{};
+
+    static void report_unavailable(int error)
+    {
+        // Said once per process, threads that fail afterwards stay quiet.
+        static std::atomic<bool> reported{false};
+        if (!reported.exchange(true))
+        {
+            std::clog << "Hardware counters unavailable"
+                      << (error ? std::string(": ") + std::strerror(error) : std::string(" on this platform")) << '\n';
+        }
+    }
+};
+
+class perf_phase_totals
+{
+    // One phase's counters summed over every thread that works on it, added to target when
+    // the phase ends. Each thread counts itself with a perf_phase_scope on this, declared
+    // after it so that the scope adds its group in first.
+public:
+    perf_phase_totals(bool enabled, perf_counter_values& target) : enabled(enabled), target(target) {}
+    ~perf_phase_totals() { target.merge(totals); }
+
+    const bool enabled;
+
+    void add(const perf_counter_values& values)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        totals.merge(values);
+    }
+
+private:
+    std::mutex mutex;
+    perf_counter_values totals;
+    perf_counter_values& target;
+};
+
+class perf_phase_scope
+{
+    // Counts the calling thread's events over a scope and adds them to target, or to
+    // shared totals that the phase's other threads add to as well (null counts nothing).
+public:
+    perf_phase_scope(bool enabled, perf_counter_values& target) : target(&target)
+    {
+        if (enabled && group.open())
+        {
+            group.start();
+        }
+    }
+
+    explicit perf_phase_scope(perf_phase_totals* shared) : shared(shared)
+    {
+        if (shared && shared->enabled && group.open())
+        {
+            group.start();
+        }
+    }
+
+    ~perf_phase_scope()
+    {
+        if (shared)
+        {
+            shared->add(group.read());
+        }
+        else
+        {
+            target->merge(group.read());
+        }
+    }
+
+private:
+    perf_counter_group group;
+    perf_counter_values* target = nullptr;
+    perf_phase_totals* shared = nullptr;
+};
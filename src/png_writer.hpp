@@ -0,0 +1,249 @@
+#pragma once
+
+#include "deflate.hpp"
+#include "perf_counters.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using png_text = std::vector<std::pair<std::string, std::string>>; // tEXt keyword and value pairs
+
+class png_band
+{
+    // One run of rows, filtered and compressed independently of the others.
+public:
+    std::vector<unsigned char> compressed;
+    uint32_t adler = 1;
+    size_t filtered_size = 0;
+};
+
+class png_file
+{
+    // Writes PNG chunks as compressed bands arrive, in order. Lets a caller stream an image
+    // band by band without ever holding all of it.
+public:
+    bool open(const std::string& path, int width, int height)
+    {
+        file = std::fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            return false;
+        }
+        static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        std::fwrite(signature, 1, sizeof(signature), file);
+
+        unsigned char header[13];
+        put_u32(header, uint32_t(width));
+        put_u32(header + 4, uint32_t(height));
+        header[8] = 8;  // bit depth
+        header[9] = 2;  // truecolor RGB
+        header[10] = 0; // deflate
+        header[11] = 0; // adaptive filtering
+        header[12] = 0; // no interlace
+        write_chunk("IHDR", header, sizeof(header));
+        return true;
+    }
+
+    void write_band(const png_band& band)
+    {
+        std::vector<unsigned char> data;
+        if (first_band)
+        {
+            data = {0x78, 0x01}; // zlib header: deflate, 32K window, no preset dictionary
+            first_band = false;
+            adler = band.adler;
+        }
+        else
+        {
+            adler = adler32_combine(adler, band.adler, band.filtered_size);
+        }
+        data.insert(data.end(), band.compressed.begin(), band.compressed.end());
+        write_chunk("IDAT", data.data(), data.size());
+    }
+
+    void write_text(const std::string& keyword, const std::string& text)
+    {
+        // tEXt chunk, must come before the first IDAT.
+        std::vector<unsigned char> data(keyword.begin(), keyword.end());
+        data.push_back(0);
+        data.insert(data.end(), text.begin(), text.end());
+        write_chunk("tEXt", data.data(), data.size());
+    }
+
+    bool close()
+    {
+        unsigned char trailer[4];
+        put_u32(trailer, adler);
+        write_chunk("IDAT", trailer, 4);
+        write_chunk("IEND", nullptr, 0);
+        bool ok = !std::ferror(file);
+        ok = (std::fclose(file) == 0) && ok;
+        file = nullptr;
+        return ok;
+    }
+
+    ~png_file()
+    {
+        if (file)
+        {
+            std::fclose(file);
+        }
+    }
+
+private:
+    FILE* file = nullptr;
+    bool first_band = true;
+    uint32_t adler = 1;
+
+    static void put_u32(unsigned char* out, uint32_t value)
+    {
+        out[0] = (unsigned char)(value >> 24);
+        out[1] = (unsigned char)(value >> 16);
+        out[2] = (unsigned char)(value >> 8);
+        out[3] = (unsigned char)value;
+    }
+
+    void write_chunk(const char* type, const unsigned char* data, size_t size)
+    {
+        unsigned char length[4];
+        put_u32(length, uint32_t(size));
+        std::fwrite(length, 1, 4, file);
+        std::fwrite(type, 1, 4, file);
+        uint32_t crc = crc32((const unsigned char*)type, 4);
+        if (size > 0)
+        {
+            std::fwrite(data, 1, size, file);
+            crc = crc32(data, size, crc);
+        }
+        unsigned char crc_bytes[4];
+        put_u32(crc_bytes, crc);
+        std::fwrite(crc_bytes, 1, 4, file);
+    }
+};
+
+class png_encoder
+{
+    // RGB8 PNG encoder that splits the image into row bands and compresses them on
+    // several threads. The bands' deflate pieces concatenate into one zlib stream and
+    // their adler32 checksums are combined, so the output is a single ordinary PNG.
+public:
+    int band_rows = 64;
+
+    static void filter_row(const unsigned char* row, const unsigned char* above, int width, std::vector<unsigned char>& out)
+    {
+        // Tries every PNG filter and keeps the one with the smallest sum of absolute
+        // values, the usual heuristic (and the one stb_image_write uses).
+        const int stride = width * 3;
+        long best_score = -1;
+        size_t start = out.size();
+        std::vector<unsigned char> candidate(stride + 1);
+
+        for (int type = 0; type < 5; type++)
+        {
+            candidate[0] = (unsigned char)type;
+            long score = 0;
+            for (int k = 0; k < stride; k++)
+            {
+                int a = (k >= 3) ? row[k - 3] : 0;
+                int b = above ? above[k] : 0;
+                int c = (above && k >= 3) ? above[k - 3] : 0;
+                int predictor = 0;
+                switch (type)
+                {
+                    case 1: predictor = a; break;
+                    case 2: predictor = b; break;
+                    case 3: predictor = (a + b) / 2; break;
+                    case 4:
+                    {
+                        int p = a + b - c;
+                        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                        predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+                        break;
+                    }
+                }
+                unsigned char value = (unsigned char)(row[k] - predictor);
+                candidate[k + 1] = value;
+                score += (value < 128) ? value : 256 - value;
+            }
+            if (best_score < 0 || score < best_score)
+            {
+                best_score = score;
+                out.resize(start);
+                out.insert(out.end(), candidate.begin(), candidate.end());
+            }
+        }
+    }
+
+    png_band encode_band(const unsigned char* pixels, const unsigned char* above, int width, int rows, bool final) const
+    {
+        // pixels holds the band's rows, above is the row before the band (null for the first).
+        png_band band;
+        std::vector<unsigned char> filtered;
+        filtered.reserve(size_t(rows) * (width * 3 + 1));
+        const size_t stride = size_t(width) * 3;
+        for (int j = 0; j < rows; j++)
+        {
+            filter_row(pixels + j * stride, above, width, filtered);
+            above = pixels + j * stride;
+        }
+        band.filtered_size = filtered.size();
+        band.adler = adler32(filtered.data(), filtered.size());
+        deflate_encoder().compress(filtered.data(), filtered.size(), final, band.compressed);
+        return band;
+    }
+
+    bool write(const std::string& path, int width, int height, const unsigned char* pixels, int thread_count,
+               const png_text& text = {}, perf_phase_totals* events = nullptr) const
+    {
+        // events, if given, gets the hardware counters of the helper threads; the calling
+        // thread's are left to the caller's own scope.
+        int band_count = (height + band_rows - 1) / band_rows;
+        std::vector<png_band> bands(band_count);
+
+        std::atomic<int> next_band{0};
+        auto worker = [&]()
+        {
+            for (int b = next_band++; b < band_count; b = next_band++)
+            {
+                const unsigned char* band_pixels = pixels + size_t(b) * band_rows * width * 3;
+                const unsigned char* above = (b > 0) ? band_pixels - size_t(width) * 3 : nullptr;
+                bands[b] = encode_band(band_pixels, above, width, std::min(band_rows, height - b * band_rows), b == band_count - 1);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int t = 1; t < std::min(thread_count, band_count); t++)
+        {
+            threads.emplace_back([&]()
+            {
+                perf_phase_scope counters(events); // the calling thread is its caller's to count
+                worker();
+            });
+        }
+        worker();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        png_file file;
+        if (!file.open(path, width, height))
+        {
+            return false;
+        }
+        for (const auto& entry : text)
+        {
+            file.write_text(entry.first, entry.second);
+        }
+        for (const auto& band : bands)
+        {
+            file.write_band(band);
+        }
+        return file.close();
+    }
+};
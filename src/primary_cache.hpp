@@ -0,0 +1,170 @@
+#pragma once
+
+#include "hittable.hpp"
+#include "material.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// First hits of the camera rays, one per pixel sample, so a render whose materials or
+// lights changed can shade from them instead of tracing the camera rays again. The
+// render server keeps one for `--primary-cache` jobs (render_server.hpp).
+//
+// A render records into it, and a later render with the same key shades from it. The
+// key covers the camera settings and the scene's geometry_key, which hashes the scene
+// file without its texture and material definitions, so edits to those keep the cache
+// valid. Materials are stored as their index among the scene file's declarations and
+// looked up again in the scene being rendered.
+//
+// Each entry also holds the random state right after its camera ray was traced, so
+// shading from the cache with unchanged materials gives exactly the recorded image.
+
+enum primary_hit_kind : uint8_t
+{
+    primary_miss,
+    primary_surface,
+    primary_retrace // hit something without a declared material (a medium); traced in full again
+};
+
+class primary_hit
+{
+public:
+    point3 p;
+    vec3 normal;
+    vec3 direction; // of the camera ray
+    double u = 0, v = 0, t = 0;
+    vec3 dpdx, dpdy, dndx, dndy; // from hit_record::set_differentials, for the rays it scatters
+    double uv_footprint = 0;
+    uint64_t rng_state = 0; // after the camera ray; before it for primary_retrace
+    int32_t material = -1;
+    bool front_face = false;
+    primary_hit_kind kind = primary_miss;
+};
+
+class primary_hit_cache
+{
+public:
+    static constexpr size_t max_bytes = size_t(2) << 30;
+
+    bool replaying = false; // whether the last render shaded from the cache rather than recording it
+    bool too_large = false; // whether the last render had more samples than max_bytes holds
+
+    void bind(const std::vector<const material*>& scene_materials, const std::string& scene_geometry_key)
+    {
+        // The scene about to be rendered.
+        replaying = false;
+        too_large = false;
+        materials = scene_materials;
+        geometry_key = scene_geometry_key;
+        material_indices.clear();
+        for (size_t k = 0; k < materials.size(); k++)
+        {
+            material_indices[materials[k]] = int32_t(k);
+        }
+    }
+
+    void unbind()
+    {
+        // Forgets the scene's materials once the job holding the scene is done, as the scene
+        // cache may drop it (and its arena) after that. The recording refers to materials by
+        // declaration index and stays.
+        materials.clear();
+        material_indices.clear();
+        geometry_key.clear();
+    }
+
+    bool usable() const { return !geometry_key.empty(); } // built-in scenes have no key
+
+    bool prepare(const std::string& camera_key, int width, int height, int samples_per_pixel)
+    {
+        // Replays if everything matches a complete recording, otherwise starts a new one.
+        // False if a recording would take more than max_bytes.
+        auto full_key = camera_key + " spp " + std::to_string(samples_per_pixel) + " geometry " + geometry_key;
+        replaying = complete && full_key == key;
+        if (replaying)
+        {
+            return true;
+        }
+        size_t count = size_t(width) * height * samples_per_pixel;
+        hits.clear();
+        complete = false;
+        too_large = count * sizeof(primary_hit) > max_bytes;
+        if (too_large)
+        {
+            return false;
+        }
+        key = full_key;
+        row_width = width;
+        samples = samples_per_pixel;
+        hits.assign(count, primary_hit());
+        return true;
+    }
+
+    void finish() { complete = true; }
+
+    primary_hit& at(int i, int j, int sample) { return hits[(size_t(j) * row_width + i) * samples + sample]; }
+
+    void store(primary_hit& slot, const ray& r, bool hit, const hit_record& rec, uint64_t rng_state) const
+    {
+        // Leaves slot as primary_retrace, with the state from before the camera ray, when
+        // the material isn't one of the scene's declarations.
+        int32_t index = -1;
+        if (hit)
+        {
+            auto found = material_indices.find(rec.mat);
+            if (found == material_indices.end())
+            {
+                slot.kind = primary_retrace;
+                return;
+            }
+            index = found->second;
+        }
+        slot.kind = hit ? primary_surface : primary_miss;
+        slot.direction = r.direction();
+        slot.rng_state = rng_state;
+        if (hit)
+        {
+            slot.p = rec.p;
+            slot.normal = rec.normal;
+            slot.u = rec.u;
+            slot.v = rec.v;
+            slot.t = rec.t;
+            slot.dpdx = rec.dpdx;
+            slot.dpdy = rec.dpdy;
+            slot.dndx = rec.dndx;
+            slot.dndy = rec.dndy;
+            slot.uv_footprint = rec.uv_footprint;
+            slot.material = index;
+            slot.front_face = rec.front_face;
+        }
+    }
+
+    void load(const primary_hit& slot, hit_record& rec) const
+    {
+        rec.p = slot.p;
+        rec.normal = slot.normal;
+        rec.u = slot.u;
+        rec.v = slot.v;
+        rec.t = slot.t;
+        rec.dpdx = slot.dpdx;
+        rec.dpdy = slot.dpdy;
+        rec.dndx = slot.dndx;
+        rec.dndy = slot.dndy;
+        rec.uv_footprint = slot.uv_footprint;
+        rec.front_face = slot.front_face;
+        rec.mat = (slot.kind == primary_surface) ? materials[slot.material] : nullptr;
+    }
+
+private:
+    std::vector<const material*> materials;
+    std::unordered_map<const material*, int32_t> material_indices;
+    std::string geometry_key;
+    std::string key;
+    int row_width = 0;
+    int samples = 0;
+    std::vector<primary_hit> hits;
+    bool complete = false;
+};
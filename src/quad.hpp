@@ -9,21 +9,38 @@ private:
     point3 Q;
     vec3 u, v;
     vec3 w;
-    std::shared_ptr<material> mat;
+    const material* mat;
     vec3 normal;
     double D;
 
+protected:
+    aabb bbox;
+    stat_primitive_kind stat_kind = stat_quad;
+
 public:
-    quad(const point3& Q, const vec3& u, const vec3& v, std::shared_ptr<material> mat) : Q(Q), u(u), v(v), mat(mat)
+    quad(const point3& Q, const vec3& u, const vec3& v, const material* mat) : Q(Q), u(u), v(v), mat(mat)
     {
         auto n = cross(u,v);
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n, n);
+
+        set_bounding_box();
+    }
+
+    virtual void set_bounding_box()
+    {
+        // Compute the bounding box of all four vertices.
+        auto bbox_diagonal1 = aabb(Q, Q + u + v);
+        auto bbox_diagonal2 = aabb(Q + u, Q + v);
+        bbox = aabb(bbox_diagonal1, bbox_diagonal2);
     }
 
+    aabb bounding_box() const override { return bbox; }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override
     {
+        STAT_INC(intersection_tests[stat_kind]);
         auto denom = dot(normal, r.direction());
 
         // No hit if ray parallel to plane
@@ -53,6 +70,9 @@ public:
         rec.p = intersection;
         rec.mat = mat;
         rec.set_face_normal(r, normal); 
+        rec.dpdu = u;
+        rec.dpdv = v;
+        rec.dndu = rec.dndv = vec3();
         
         return true;
     }
@@ -8,6 +8,12 @@ private:
     point3 orig;
     vec3 dir;
 public:
+    // How origin and direction change towards the next pixel in x and y (ray differentials,
+    // Igehy 1999). Camera rays carry them so hits can tell how much texture a pixel covers.
+    bool has_differentials = false;
+    vec3 dodx, dody;
+    vec3 dddx, dddy;
+
     ray() {}
     ray(const point3& origin, const vec3& direction) : orig(origin) , dir(direction) {}
 
@@ -18,4 +24,13 @@ public:
     {
         return orig + t * dir;
     }
+
+    void set_differentials(const vec3& origin_dx, const vec3& origin_dy, const vec3& direction_dx, const vec3& direction_dy)
+    {
+        has_differentials = true;
+        dodx = origin_dx;
+        dody = origin_dy;
+        dddx = direction_dx;
+        dddy = direction_dy;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,370 @@
+#pragma once
+
+#include "distributed.hpp"
+#include "options.hpp"
+#include "primary_cache.hpp"
+#include "scene.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Persistent render server. `--serve ADDR` loads scenes once, with their BVH, and renders
+// jobs sent by `--submit ADDR` clients one at a time, so repeated jobs on a scene skip
+// the setup. A job carries the client's working directory and its command line options.
+// The render runs in progressive passes: after each one the image so far is sent to the
+// client, which writes it to NAME_preview.EXT, and the final image goes to the output as
+// usual. Camera options (--lookfrom, --vfov, ...) apply to the cached scene's camera, so
+// moving the view does not rebuild anything.
+// `--primary-cache` jobs keep the first hits of their camera rays, and the next such job
+// on the same geometry and camera shades from them (primary_cache.hpp).
+
+class scene_cache
+{
+    // Built scenes by name and fingerprint, the least recently used dropped past max_scenes.
+public:
+    static const size_t max_scenes = 4;
+
+    std::shared_ptr<scene> get(const std::string& name, bool& cached)
+    {
+        auto key = name + '#' + fingerprint(name);
+        cached = false;
+        auto found = scenes.find(key);
+        if (found != scenes.end())
+        {
+            cached = true;
+            found->second.last_used = ++uses;
+            return found->second.built;
+        }
+
+        auto built = std::make_shared<scene>();
+        if (!build_scene(name, *built))
+        {
+            return nullptr;
+        }
+        built->build_bvh();
+        if (scenes.size() >= max_scenes)
+        {
+            auto oldest = std::min_element(scenes.begin(), scenes.end(),
+                [](const auto& a, const auto& b) { return a.second.last_used < b.second.last_used; });
+            scenes.erase(oldest);
+        }
+        // Keyed by the fingerprint of the files it was actually built from.
+        scenes[name + '#' + fingerprint(name, &built->source_files)] = {built, ++uses};
+        sources[name] = built->source_files;
+        return built;
+    }
+
+private:
+    class entry
+    {
+    public:
+        std::shared_ptr<scene> built;
+        long long last_used = 0;
+    };
+    std::map<std::string, entry> scenes;
+    std::map<std::string, std::vector<std::string>> sources; // files each scene name was last built from
+    long long uses = 0;
+
+    std::string fingerprint(const std::string& name, const std::vector<std::string>* files = nullptr) const
+    {
+        // FNV-1a over path, size and modification time of every source file, so an edited
+        // scene or mesh is rebuilt. Built-in scenes have no files.
+        if (!files)
+        {
+            auto known = sources.find(name);
+            if (known == sources.end())
+            {
+                return "";
+            }
+            files = &known->second;
+        }
+        if (files->empty())
+        {
+            return "";
+        }
+        uint64_t hash = 0xcbf29ce484222325ull;
+        auto mix = [&](const std::string& text)
+        {
+            for (unsigned char c : text)
+            {
+                hash = (hash ^ c) * 0x100000001b3ull;
+            }
+        };
+        for (const auto& file : *files)
+        {
+            std::error_code error;
+            auto size = std::filesystem::file_size(file, error);
+            auto time = std::filesystem::last_write_time(file, error).time_since_epoch().count();
+            mix(file + '\n' + std::to_string(size) + '\n' + std::to_string(time) + '\n');
+        }
+        std::ostringstream text;
+        text << std::hex << hash;
+        return text.str();
+    }
+};
+
+void send_preview(socket_channel& client, const camera& cam)
+{
+    auto path = cam.preview_path();
+    auto format = cam.output_format.empty() ? image_format_from_path(cam.output_path) : cam.output_format;
+    int32_t size[2] = {cam.held_width(), cam.held_height()};
+    std::vector<char> payload(path.begin(), path.end());
+    payload.push_back('\0');
+    payload.insert(payload.end(), format.begin(), format.end());
+    payload.push_back('\0');
+    payload.insert(payload.end(), reinterpret_cast<char*>(size), reinterpret_cast<char*>(size + 2));
+    std::vector<float> pixels;
+    pixels.reserve(size_t(size[0]) * size[1] * 3);
+    for (int j = 0; j < size[1]; j++)
+    {
+        for (int i = 0; i < size[0]; i++)
+        {
+            auto pixel = cam.held_pixel(i, j);
+            pixels.insert(pixels.end(), {float(pixel.x()), float(pixel.y()), float(pixel.z())});
+        }
+    }
+    auto bytes = reinterpret_cast<const char*>(pixels.data());
+    payload.insert(payload.end(), bytes, bytes + pixels.size() * sizeof(float));
+    client.send(message_preview, work_unit(), payload.data(), payload.size());
+}
+
+bool write_preview_message(const std::vector<char>& payload)
+{
+    // Client side of send_preview.
+    auto path_end = std::find(payload.begin(), payload.end(), '\0');
+    auto format_end = std::find(path_end + (path_end != payload.end()), payload.end(), '\0');
+    int32_t size[2];
+    size_t header = size_t(format_end - payload.begin()) + 1 + sizeof(size);
+    if (format_end == payload.end() || payload.size() < header)
+    {
+        return false;
+    }
+    std::memcpy(size, &*(format_end + 1), sizeof(size));
+    size_t count = size_t(size[0]) * size[1];
+    if (size[0] <= 0 || size[1] <= 0 || payload.size() != header + count * 3 * sizeof(float))
+    {
+        return false;
+    }
+    std::string path(payload.begin(), path_end), format(path_end + 1, format_end);
+    std::vector<float> values(count * 3);
+    std::memcpy(values.data(), payload.data() + header, values.size() * sizeof(float));
+    std::vector<color> pixels(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        pixels[k] = color(values[3 * k], values[3 * k + 1], values[3 * k + 2]);
+    }
+    if (is_float_format(format))
+    {
+        return write_float_image(path, format, size[0], size[1], pixels.data());
+    }
+    std::vector<unsigned char> rgb(count * 3);
+    for (size_t k = 0; k < count; k++)
+    {
+        write_color(&rgb[3 * k], pixels[k]);
+    }
+    return write_image(path, format, size[0], size[1], rgb.data());
+}
+
+bool run_render_job(socket_channel& client, const std::vector<std::string>& job, scene_cache& cache,
+                    primary_hit_cache& primary_hits)
+{
+    auto job_start = std::chrono::steady_clock::now();
+    auto milliseconds = [&]()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job_start).count();
+    };
+    auto report = [&](const std::string& line) { client.send(message_status, work_unit(), line.data(), line.size()); };
+    auto fail = [&](const std::string& reason)
+    {
+        client.send(message_done, work_unit(), reason.data(), reason.size());
+        return false;
+    };
+
+    std::error_code error;
+    std::filesystem::current_path(job.empty() ? std::string() : job[0], error);
+    if (error)
+    {
+        return fail("Cannot work in the client's directory: " + error.message());
+    }
+
+    // Errors printed while parsing the options and building the scene go back to the client.
+    std::ostringstream errors;
+    auto* server_errors = std::cerr.rdbuf(errors.rdbuf());
+    render_options options;
+    std::vector<char*> argv{const_cast<char*>("raytracer")};
+    for (size_t k = 1; k < job.size(); k++)
+    {
+        argv.push_back(const_cast<char*>(job[k].c_str()));
+    }
+    bool ok = parse_args(int(argv.size()), argv.data(), options);
+    bool cached = false;
+    std::shared_ptr<scene> loaded;
+    if (ok && options.distributed())
+    {
+        std::cerr << "Jobs can't serve, submit or distribute themselves\n";
+        ok = false;
+    }
+    if (ok)
+    {
+        loaded = cache.get(options.scene, cached);
+        ok = (loaded != nullptr);
+    }
+    std::cerr.rdbuf(server_errors);
+    if (!ok)
+    {
+        return fail(errors.str());
+    }
+
+    std::ostringstream line;
+    line << "Scene " << options.scene << (cached ? " cached, " : " built, ") << milliseconds() << " ms";
+    report(line.str());
+
+    camera cam = loaded->cam;
+    options.apply(cam);
+    cam.write_previews = true;
+    cam.preview_files = false;
+    if (options.cache_primary_hits)
+    {
+        primary_hits.bind(loaded->materials, loaded->geometry_key);
+        cam.primary_hits = &primary_hits;
+    }
+    cam.on_pass = [&](int samples_done)
+    {
+        std::ostringstream pass;
+        pass << "Pass " << samples_done << '/' << cam.samples_per_pixel << " spp at " << milliseconds() << " ms";
+        if (!cam.output_path.empty())
+        {
+            pass << ", preview " << cam.preview_path();
+            send_preview(client, cam);
+        }
+        report(pass.str());
+    };
+    if (!options.trace_path.empty())
+    {
+        tracer::instance().enable();
+    }
+    bool rendered = cam.render(loaded->world);
+    primary_hits.unbind();
+    write_reports(options, cam.stats);
+    tracer::instance().disable();
+    if (options.print_stats)
+    {
+        std::ostringstream summary;
+        cam.stats.print_summary(summary);
+        report(summary.str());
+    }
+    if (!rendered)
+    {
+        return fail("Render failed, see the server log");
+    }
+    line.str("");
+    line << "Done in " << milliseconds() << " ms";
+    if (cam.primary_hits && primary_hits.replaying)
+    {
+        line << ", shaded from cached primary hits";
+    }
+    else if (cam.primary_hits && primary_hits.too_large)
+    {
+        line << ", primary hits not cached: " << cam.samples_per_pixel << " spp at this size need more than "
+             << (primary_hit_cache::max_bytes >> 20) << " MB";
+    }
+    report(line.str());
+    client.send(message_done, work_unit());
+    return true;
+}
+
+int serve_renders(const std::string& address)
+{
+    int listener = open_socket(address, true);
+    if (listener < 0)
+    {
+        return 1;
+    }
+    auto server_directory = std::filesystem::current_path();
+    scene_cache cache;
+    primary_hit_cache primary_hits;
+    std::clog << "Render server listening on " << address << '\n';
+    while (true)
+    {
+        int fd = ::accept(listener, nullptr, nullptr);
+        if (fd < 0)
+        {
+            continue;
+        }
+        // A client that connects and sends nothing, or stops reading, must not hold up
+        // the jobs behind it.
+        set_socket_timeout(fd, 30);
+        socket_channel client(fd);
+        message_header header;
+        std::vector<char> payload;
+        if (!client.receive(header, payload) || header.kind != message_job)
+        {
+            continue;
+        }
+        // '\0' separated: the working directory, then the options.
+        std::vector<std::string> job;
+        for (size_t start = 0; start < payload.size();)
+        {
+            auto end = std::find(payload.begin() + start, payload.end(), '\0') - payload.begin();
+            job.emplace_back(payload.begin() + start, payload.begin() + end);
+            start = end + 1;
+        }
+        run_render_job(client, job, cache, primary_hits);
+        std::filesystem::current_path(server_directory);
+    }
+}
+
+int submit_render(const std::string& address, const std::vector<std::string>& args)
+{
+    // Client side: sends the job and prints what the server reports until it is done.
+    int fd = open_socket(address, false);
+    if (fd < 0)
+    {
+        return 1;
+    }
+    socket_channel server(fd);
+    std::string job = std::filesystem::current_path().string();
+    for (const auto& arg : args)
+    {
+        job += '\0' + arg;
+    }
+    if (!server.send(message_job, work_unit(), job.data(), job.size()))
+    {
+        std::cerr << "Cannot send the job to " << address << '\n';
+        return 1;
+    }
+    message_header header;
+    std::vector<char> payload;
+    while (server.receive(header, payload))
+    {
+        std::string text(payload.begin(), payload.end());
+        if (header.kind == message_status)
+        {
+            std::clog << text << '\n';
+        }
+        else if (header.kind == message_preview)
+        {
+            if (!write_preview_message(payload))
+            {
+                std::cerr << "Cannot write the preview\n";
+            }
+        }
+        else if (header.kind == message_done)
+        {
+            if (!text.empty())
+            {
+                std::cerr << text << (text.back() == '\n' ? "" : "\n");
+            }
+            return text.empty() ? 0 : 1;
+        }
+    }
+    std::cerr << "Lost the render server\n";
+    return 1;
+}
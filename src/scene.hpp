@@ -0,0 +1,662 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "constant_medium.hpp"
+#include "grid_medium.hpp"
+#include "hittable_list.hpp"
+#include "image_texture.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "noise.hpp"
+#include "quad.hpp"
+#include "scene_arena.hpp"
+#include "sparse_volume.hpp"
+#include "sphere.hpp"
+#include "texture.hpp"
+#include "triangle.hpp"
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class scene
+{
+public:
+    scene_arena arena; // owns the objects below, so it is declared first and destroyed last
+    hittable_list world;
+    camera cam;
+    std::vector<std::string> source_files; // scene file and meshes it was built from
+    std::vector<const material*> materials; // declared by the scene, in order
+    std::string geometry_key; // hash of the scene file without its textures and materials, see primary_cache.hpp
+
+    template <typename T, typename... Args>
+    T* add_material(Args&&... args)
+    {
+        // Materials and media are numbered in the order the scene declares them.
+        T* mat = arena.make<T>(std::forward<Args>(args)...);
+        mat->id = material_ids++;
+        materials.push_back(mat);
+        return mat;
+    }
+
+    template <typename T, typename... Args>
+    T* add_medium(Args&&... args)
+    {
+        T* medium = arena.make<T>(std::forward<Args>(args)...);
+        medium->set_material_id(material_ids++);
+        return medium;
+    }
+
+    void build_bvh()
+    {
+        world = hittable_list(arena.make<bvh_node>(world, arena));
+    }
+
+private:
+    int material_ids = 0;
+};
+
+void cornell_box(scene& s)
+{
+    auto& world = s.world;
+    auto& arena = s.arena;
+
+    auto red   = s.add_material<lambertian>(color(.65, .05, .05));
+    auto white = s.add_material<lambertian>(color(.73, .73, .73));
+    auto green = s.add_material<lambertian>(color(.12, .45, .15));
+    auto light = s.add_material<diffuse_light>(color(15, 15, 15));
+    auto see_thru = s.add_material<one_sided_material>(white);
+    auto sphere1_mat = s.add_material<metal>(color(0.5,0.5,0.5));
+    auto sphere2_mat = s.add_material<dielectric>(1.5);
+
+    world.add(arena.make<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(arena.make<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(arena.make<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light));
+    world.add(arena.make<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(arena.make<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(arena.make<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    world.add(arena.make<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,555,0), see_thru));
+
+    world.add(arena.make<sphere>(point3(450,75, 300),75,sphere1_mat));
+    world.add(arena.make<sphere>(point3(100,75, 300),75,sphere2_mat));
+    auto boundary = arena.make<sphere>(point3(275,75, 250),75,sphere2_mat);
+    world.add(boundary);
+    world.add(s.add_medium<constant_medium>(boundary,0.5,color(0.15,0.65,0.9)));
+
+    auto& cam = s.cam;
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 800;
+    cam.samples_per_pixel = 1000;
+    cam.max_bounces       = 25;
+    cam.lookfrom = point3(278, 278, -1000);
+    cam.lookat   = point3(278, 278, 0);
+    cam.up     = vec3(0,1,0);
+}
+
+void random_spheres(scene& s)
+{
+    auto& world = s.world;
+    auto& arena = s.arena;
+
+    // Scene layout is fixed by its own stream so it doesn't change with the render seed.
+    thread_rng().reseed(mix_seed(0, 0x5be5e));
+
+    auto checker = arena.make<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9), arena);
+    world.add(arena.make<sphere>(point3(0,-1000,0), 1000, s.add_material<lambertian>(checker)));
+
+    for (int a = -11; a < 11; a++)
+    {
+        for (int b = -11; b < 11; b++)
+        {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() <= 0.9)
+            {
+                continue;
+            }
+
+            const material* sphere_material;
+            if (choose_mat < 0.8)
+            {
+                sphere_material = s.add_material<lambertian>(color::random() * color::random());
+            }
+            else if (choose_mat < 0.95)
+            {
+                sphere_material = s.add_material<metal>(color::random(0.5, 1), random_double(0, 0.5));
+            }
+            else
+            {
+                sphere_material = s.add_material<dielectric>(1.5);
+            }
+            world.add(arena.make<sphere>(center, 0.2, sphere_material));
+        }
+    }
+
+    world.add(arena.make<sphere>(point3(0, 1, 0), 1.0, s.add_material<dielectric>(1.5)));
+    world.add(arena.make<sphere>(point3(-4, 1, 0), 1.0, s.add_material<lambertian>(color(0.4, 0.2, 0.1))));
+    world.add(arena.make<sphere>(point3(4, 1, 0), 1.0, s.add_material<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    auto& cam = s.cam;
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 1200;
+    cam.samples_per_pixel = 500;
+    cam.max_bounces       = 50;
+    cam.vfov     = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat   = point3(0, 0, 0);
+    cam.up       = vec3(0, 1, 0);
+    cam.use_environment_light = true;
+}
+
+void torus_mesh(scene& s)
+{
+    // A large triangle mesh (100k triangles) on a checkered floor under a sky.
+    auto& world = s.world;
+    auto& arena = s.arena;
+
+    auto checker = arena.make<checker_texture>(0.5, color(.2, .3, .1), color(.9, .9, .9), arena);
+    world.add(arena.make<quad>(point3(-20, 0, -20), vec3(40, 0, 0), vec3(0, 0, 40), s.add_material<lambertian>(checker)));
+
+    auto torus_mat = s.add_material<metal>(color(0.8, 0.6, 0.4), 0.2);
+    tessellated_torus(point3(0, 1, 0), 2.0, 0.8, 250, 200, torus_mat, world, arena);
+    world.add(arena.make<sphere>(point3(0, 1, 0), 0.9, s.add_material<dielectric>(1.5)));
+
+    auto& cam = s.cam;
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 800;
+    cam.samples_per_pixel = 100;
+    cam.max_bounces       = 20;
+    cam.vfov     = 35;
+    cam.lookfrom = point3(0, 6, 9);
+    cam.lookat   = point3(0, 0.8, 0);
+    cam.up       = vec3(0, 1, 0);
+    cam.use_environment_light = true;
+}
+
+class scene_parser
+{
+    // Reads the line based scene description format, see scenes/cornell_box.scene.
+private:
+    std::map<std::string, const texture*> textures;
+    std::map<std::string, const material*> materials;
+    scene_arena* arena = nullptr; // the scene's, for everything the file declares
+    std::string path;
+    int line_number = 0;
+
+    bool fail(const std::string& message) const
+    {
+        std::cerr << path << ':' << line_number << ": " << message << '\n';
+        return false;
+    }
+
+    static bool read_vec3(std::istream& in, vec3& out)
+    {
+        double x, y, z;
+        if (!(in >> x >> y >> z))
+        {
+            return false;
+        }
+        out = vec3(x, y, z);
+        return true;
+    }
+
+    bool read_texture(std::istream& in, const texture*& out) const
+    {
+        // Either three color components or the name of a texture declared earlier.
+        std::string token;
+        if (!(in >> token))
+        {
+            return false;
+        }
+        auto found = textures.find(token);
+        if (found != textures.end())
+        {
+            out = found->second;
+            return true;
+        }
+        std::istringstream rest(token);
+        double r, g, b;
+        if (!(rest >> r) || !(in >> g >> b))
+        {
+            return false;
+        }
+        out = arena->make<solid_color>(r, g, b);
+        return true;
+    }
+
+    bool read_material(std::istream& in, const material*& out) const
+    {
+        std::string name;
+        if (!(in >> name))
+        {
+            return false;
+        }
+        auto found = materials.find(name);
+        if (found == materials.end())
+        {
+            return false;
+        }
+        out = found->second;
+        return true;
+    }
+
+    bool parse_camera(std::istream& in, camera& cam)
+    {
+        std::string key;
+        while (in >> key)
+        {
+            bool ok = true;
+            if (key == "lookfrom")      ok = read_vec3(in, cam.lookfrom);
+            else if (key == "lookat")   ok = read_vec3(in, cam.lookat);
+            else if (key == "up")       ok = read_vec3(in, cam.up);
+            else if (key == "vfov")     ok = bool(in >> cam.vfov);
+            else if (key == "defocus")  ok = bool(in >> cam.defocus_angle);
+            else if (key == "aspect")   ok = bool(in >> cam.aspect_ratio);
+            else if (key == "width")    ok = bool(in >> cam.image_width);
+            else if (key == "spp")      ok = bool(in >> cam.samples_per_pixel);
+            else if (key == "bounces")  ok = bool(in >> cam.max_bounces);
+            else if (key == "environment") ok = bool(in >> cam.use_environment_light);
+            else return fail("unknown camera setting '" + key + "'");
+
+            if (!ok)
+            {
+                return fail("bad value for camera setting '" + key + "'");
+            }
+        }
+        return true;
+    }
+
+    bool parse_texture(std::istream& in, scene& s)
+    {
+        std::string name, type;
+        in >> name >> type;
+        const texture* tex;
+        if (type == "solid")
+        {
+            color albedo;
+            if (!read_vec3(in, albedo)) return fail("solid texture expects a color");
+            tex = arena->make<solid_color>(albedo);
+        }
+        else if (type == "checker")
+        {
+            double scale;
+            const texture* even;
+            const texture* odd;
+            if (!(in >> scale) || !read_texture(in, even) || !read_texture(in, odd))
+            {
+                return fail("checker texture expects a scale and two colors");
+            }
+            tex = arena->make<checker_texture>(scale, even, odd);
+        }
+        else if (type == "noise")
+        {
+            std::string basis_name, pattern_name;
+            double scale;
+            int octaves;
+            color low, high;
+            if (!(in >> basis_name >> pattern_name >> scale >> octaves) || !read_vec3(in, low) || !read_vec3(in, high))
+            {
+                return fail("noise texture expects a basis, a pattern, a scale, an octave count and two colors");
+            }
+            noise_basis basis = simplex_basis;
+            if (basis_name == "perlin")          basis = perlin_basis;
+            else if (basis_name != "simplex")    return fail("unknown noise basis '" + basis_name + "' (perlin or simplex)");
+            noise_pattern pattern = noise_marble;
+            if (pattern_name == "fbm")               pattern = noise_fbm;
+            else if (pattern_name == "turbulence")   pattern = noise_turbulence;
+            else if (pattern_name != "marble")       return fail("unknown noise pattern '" + pattern_name + "' (fbm, turbulence or marble)");
+            tex = arena->make<noise_texture>(basis, pattern, scale, octaves, low, high);
+        }
+        else if (type == "image")
+        {
+            // Relative paths are resolved against the scene file's directory, like meshes.
+            std::string file_name;
+            if (!(in >> file_name)) return fail("image texture expects a PPM, PFM or .rtx file");
+            auto image_path = (std::filesystem::path(path).parent_path() / file_name).string();
+            auto image = arena->make<image_texture>();
+            if (!image->load(image_path)) return fail("cannot load image texture '" + file_name + "'");
+            s.source_files.push_back(image_path);
+            tex = image;
+        }
+        else
+        {
+            return fail("unknown texture type '" + type + "'");
+        }
+        textures[name] = tex;
+        return true;
+    }
+
+    bool parse_material(std::istream& in, scene& s)
+    {
+        std::string name, type;
+        in >> name >> type;
+        const material* mat;
+        const texture* tex;
+        if (type == "lambertian")
+        {
+            if (!read_texture(in, tex)) return fail("lambertian expects a color or texture");
+            mat = s.add_material<lambertian>(tex);
+        }
+        else if (type == "metal")
+        {
+            double fuzz = 0;
+            if (!read_texture(in, tex)) return fail("metal expects a color or texture");
+            in >> fuzz;
+            mat = s.add_material<metal>(tex, fuzz);
+        }
+        else if (type == "dielectric")
+        {
+            double refraction_index;
+            if (!(in >> refraction_index)) return fail("dielectric expects a refraction index");
+            mat = s.add_material<dielectric>(refraction_index);
+        }
+        else if (type == "diffuse_light")
+        {
+            double strength = 1.0;
+            if (!read_texture(in, tex)) return fail("diffuse_light expects a color or texture");
+            in >> strength;
+            mat = s.add_material<diffuse_light>(tex, strength);
+        }
+        else if (type == "one_sided")
+        {
+            const material* inner;
+            if (!read_material(in, inner)) return fail("one_sided expects a declared material");
+            mat = s.add_material<one_sided_material>(inner);
+        }
+        else if (type == "isotropic")
+        {
+            if (!read_texture(in, tex)) return fail("isotropic expects a color or texture");
+            mat = s.add_material<isotropic>(tex);
+        }
+        else
+        {
+            return fail("unknown material type '" + type + "'");
+        }
+        materials[name] = mat;
+        return true;
+    }
+
+    bool parse_sphere(std::istream& in, const material* mat_required, const hittable*& out)
+    {
+        point3 center;
+        double radius;
+        if (!read_vec3(in, center) || !(in >> radius))
+        {
+            return fail("sphere expects a center and a radius");
+        }
+        const material* mat = mat_required;
+        if (!mat && !read_material(in, mat))
+        {
+            return fail("sphere expects a declared material");
+        }
+        out = arena->make<sphere>(center, radius, mat);
+        return true;
+    }
+
+public:
+    bool parse(const std::string& file_path, scene& s)
+    {
+        path = file_path;
+        arena = &s.arena;
+        s.source_files.push_back(path);
+        std::ifstream file(path);
+        if (!file)
+        {
+            std::cerr << "Cannot open scene file " << path << '\n';
+            return false;
+        }
+
+        // Every line but the texture and material definitions, whose names are kept so the
+        // declarations still line up, goes into the geometry key.
+        std::string geometry;
+        auto geometry_file = [&](const std::string& file_name)
+        {
+            // Relative paths are resolved against the scene file's directory. The file's size
+            // and time stamp go into the geometry key.
+            auto file_path = std::filesystem::path(path).parent_path() / file_name;
+            s.source_files.push_back(file_path.string());
+            std::error_code error;
+            geometry += std::to_string(std::filesystem::file_size(file_path, error)) + ' '
+                      + std::to_string(std::filesystem::last_write_time(file_path, error).time_since_epoch().count()) + '\n';
+            return file_path.string();
+        };
+        std::string line;
+        while (std::getline(file, line))
+        {
+            line_number++;
+            auto comment = line.find('#');
+            if (comment != std::string::npos)
+            {
+                line.erase(comment);
+            }
+            std::istringstream in(line);
+            std::string keyword;
+            if (!(in >> keyword))
+            {
+                continue;
+            }
+
+            if (keyword == "material")
+            {
+                std::istringstream name(line);
+                std::string skipped, declared;
+                name >> skipped >> declared;
+                geometry += "material " + declared + '\n';
+            }
+            else if (keyword != "texture")
+            {
+                geometry += line + '\n';
+            }
+
+            bool ok = true;
+            if (keyword == "camera")
+            {
+                ok = parse_camera(in, s.cam);
+            }
+            else if (keyword == "texture")
+            {
+                ok = parse_texture(in, s);
+            }
+            else if (keyword == "material")
+            {
+                ok = parse_material(in, s);
+            }
+            else if (keyword == "sphere")
+            {
+                const hittable* object;
+                ok = parse_sphere(in, nullptr, object);
+                if (ok) s.world.add(object);
+            }
+            else if (keyword == "quad")
+            {
+                point3 Q;
+                vec3 u, v;
+                const material* mat;
+                if (!read_vec3(in, Q) || !read_vec3(in, u) || !read_vec3(in, v) || !read_material(in, mat))
+                {
+                    ok = fail("quad expects a corner, two edges and a declared material");
+                }
+                else
+                {
+                    s.world.add(s.arena.make<quad>(Q, u, v, mat));
+                }
+            }
+            else if (keyword == "triangle")
+            {
+                point3 a, b, c;
+                const material* mat;
+                if (!read_vec3(in, a) || !read_vec3(in, b) || !read_vec3(in, c) || !read_material(in, mat))
+                {
+                    ok = fail("triangle expects three vertices and a declared material");
+                }
+                else
+                {
+                    s.world.add(triangle::from_vertices(s.arena, a, b, c, mat));
+                }
+            }
+            else if (keyword == "mesh")
+            {
+                // mesh <file.obj> <material> [scale] [offset]
+                std::string file_name;
+                const material* mat;
+                double scale = 1.0;
+                vec3 offset;
+                if (!(in >> file_name) || !read_material(in, mat))
+                {
+                    ok = fail("mesh expects an OBJ file and a declared material");
+                }
+                else
+                {
+                    if (in >> scale)
+                    {
+                        read_vec3(in, offset);
+                    }
+                    ok = load_obj(geometry_file(file_name), mat, s.world, s.arena, scale, offset);
+                }
+            }
+            else if (keyword == "medium")
+            {
+                // medium sphere <center> <radius> <density> <albedo>
+                //      | mesh <file.obj> <density> <albedo> [scale] [offset]
+                //      | cloud <center> <radius> <resolution> <density> <albedo>
+                //      | volume <file.raw> <nx> <ny> <nz> <min corner> <max corner> <density> <albedo>
+                std::string shape;
+                double density;
+                const texture* albedo;
+                in >> shape;
+                if (shape == "sphere")
+                {
+                    const hittable* boundary;
+                    if (!parse_sphere(in, s.arena.make<material>(), boundary))
+                    {
+                        ok = false;
+                    }
+                    else if (!(in >> density) || !read_texture(in, albedo))
+                    {
+                        ok = fail("medium expects a density and a color or texture");
+                    }
+                    else
+                    {
+                        s.world.add(s.add_medium<constant_medium>(boundary, density, albedo));
+                    }
+                }
+                else if (shape == "cloud")
+                {
+                    point3 center;
+                    double radius;
+                    int resolution;
+                    if (!read_vec3(in, center) || !(in >> radius >> resolution >> density) || !read_texture(in, albedo)
+                        || radius <= 0 || resolution < 2)
+                    {
+                        ok = fail("cloud medium expects a center, a radius, a grid resolution, a density and a color or texture");
+                    }
+                    else
+                    {
+                        s.world.add(s.add_medium<grid_medium>(cloud_density(s.arena, center, radius, resolution), density, albedo));
+                    }
+                }
+                else if (shape == "mesh")
+                {
+                    // Any closed mesh with outward facing normals, concave ones included.
+                    std::string file_name;
+                    double scale = 1.0;
+                    vec3 offset;
+                    if (!(in >> file_name >> density) || !read_texture(in, albedo))
+                    {
+                        ok = fail("mesh medium expects an OBJ file, a density and a color or texture");
+                    }
+                    else
+                    {
+                        if (in >> scale)
+                        {
+                            read_vec3(in, offset);
+                        }
+                        hittable_list triangles;
+                        bool convex = false;
+                        ok = load_obj(geometry_file(file_name), s.arena.make<material>(), triangles, s.arena, scale, offset, &convex);
+                        if (ok && triangles.objects.empty())
+                        {
+                            ok = fail("mesh medium '" + file_name + "' has no faces");
+                        }
+                        if (ok)
+                        {
+                            auto boundary = s.arena.make<bvh_node>(triangles, s.arena, convex);
+                            s.world.add(s.add_medium<constant_medium>(boundary, density, albedo));
+                        }
+                    }
+                }
+                else if (shape == "volume")
+                {
+                    std::string file_name;
+                    int nx, ny, nz;
+                    point3 low, high;
+                    if (!(in >> file_name >> nx >> ny >> nz) || !read_vec3(in, low) || !read_vec3(in, high)
+                        || !(in >> density) || !read_texture(in, albedo) || nx < 2 || ny < 2 || nz < 2)
+                    {
+                        ok = fail("volume medium expects a raw file, its dimensions, two corners, a density and a color or texture");
+                    }
+                    else
+                    {
+                        auto volume = s.arena.make<sparse_density_grid>(aabb(low, high), nx, ny, nz);
+                        ok = volume->load_raw(geometry_file(file_name));
+                        if (ok)
+                        {
+                            std::clog << "Volume " << file_name << ": " << volume->occupied_bricks() << " occupied bricks, "
+                                      << volume->memory_bytes() / (1 << 20) << " MB\n";
+                            s.world.add(s.add_medium<grid_medium>(volume, density, albedo));
+                        }
+                    }
+                }
+                else
+                {
+                    ok = fail("medium boundary must be a sphere, a mesh, a cloud or a volume");
+                }
+            }
+            else
+            {
+                ok = fail("unknown keyword '" + keyword + "'");
+            }
+
+            if (!ok)
+            {
+                return false;
+            }
+        }
+
+        uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+        for (unsigned char c : geometry)
+        {
+            hash = (hash ^ c) * 0x100000001b3ull;
+        }
+        std::ostringstream key;
+        key << std::hex << hash;
+        s.geometry_key = key.str();
+        return true;
+    }
+};
+
+bool build_scene(const std::string& name, scene& s)
+{
+    // name is either a built-in scene or the path of a scene file.
+    if (name == "cornell")
+    {
+        cornell_box(s);
+        return true;
+    }
+    if (name == "spheres")
+    {
+        random_spheres(s);
+        return true;
+    }
+    if (name == "mesh")
+    {
+        torus_mesh(s);
+        return true;
+    }
+    scene_parser parser;
+    return parser.parse(name, s);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Monotonic storage for a scene's objects: shapes, BVH nodes, materials and textures.
+// Objects are placed one after another in large blocks, so primitives sit in memory in
+// the order they were made (a mesh's triangles in file order, BVH nodes depth first)
+// instead of wherever the heap put each one, and none of them is freed on its own.
+// Everything goes away at once when the arena is released or destroyed.
+//
+// make() hands out plain pointers, and scene objects refer to each other through plain
+// pointers: none of them owns another. They must not outlive the arena, which is why
+// scene declares it first.
+
+class scene_arena
+{
+public:
+    static constexpr size_t block_size = size_t(1) << 20;
+
+    scene_arena() {}
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+    ~scene_arena() { release(); }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible_v<T>)
+        {
+            destructors.push_back({object, [](void* p) { static_cast<T*>(p)->~T(); }});
+        }
+        object_count++;
+        return object;
+    }
+
+    void release()
+    {
+        // Destroys the objects in reverse order of construction, then frees the blocks.
+        for (auto k = destructors.rbegin(); k != destructors.rend(); ++k)
+        {
+            k->destroy(k->object);
+        }
+        destructors.clear();
+        blocks.clear();
+        next = end = nullptr;
+        bytes = 0;
+        object_count = 0;
+    }
+
+    size_t bytes_used() const { return bytes; }
+    size_t objects() const { return object_count; }
+
+private:
+    class destructor
+    {
+    public:
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<destructor> destructors;
+    char* next = nullptr;
+    char* end = nullptr;
+    size_t bytes = 0;
+    size_t object_count = 0;
+
+    void* allocate(size_t size, size_t alignment)
+    {
+        auto aligned = [&]() { return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(next) + alignment - 1) & ~(alignment - 1)); };
+        if (!next || aligned() + size > end)
+        {
+            // A new block; objects bigger than a block get one of their own.
+            size_t capacity = std::max(block_size, size + alignment);
+            blocks.emplace_back(new char[capacity]);
+            next = blocks.back().get();
+            end = next + capacity;
+        }
+        char* object = aligned();
+        next = object + size;
+        bytes += size;
+        return object;
+    }
+};
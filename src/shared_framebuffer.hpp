@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A POSIX shared memory framebuffer between an interactive render (`--interactive NAME`)
+// and viewer processes. The segment is a header followed by width * height linear RGB
+// floats at full resolution; coarse previews are written upscaled, so a viewer always
+// shows the whole frame.
+//
+// The renderer bumps `frame` to an odd value before writing pixels and to the next even
+// one after, so a viewer that reads the same even value before and after copying got a
+// whole image. A viewer moves the camera by writing the `view` fields and then bumping
+// `view_version`; the renderer polls it and restarts within a millisecond or so.
+// Both sides must share an architecture, the atomics are used across processes.
+
+class shared_view
+{
+    // The camera parameters a viewer may change.
+public:
+    double lookfrom[3] = {0, 0, 0};
+    double lookat[3] = {0, 0, -1};
+    double up[3] = {0, 1, 0};
+    double vfov = 60;
+};
+
+class shared_frame_header
+{
+public:
+    static constexpr char magic_text[8] = "RTVIEW1";
+
+    char magic[8];
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::atomic<uint64_t> frame{0};         // odd while the pixels are being written
+    uint32_t scale = 0;                     // frame pixels per traced pixel of the current image
+    uint32_t samples = 0;                   // samples per pixel of the current image
+    uint32_t target_samples = 0;            // samples per pixel the render refines up to
+    std::atomic<uint64_t> shown_version{0}; // view_version the current image was rendered with
+    std::atomic<uint64_t> view_version{0};  // bumped by a viewer after it changes view
+    std::atomic<uint32_t> quit{0};          // set by a viewer to end the interactive render
+    shared_view view;
+};
+
+class shared_framebuffer
+{
+public:
+    shared_frame_header* header = nullptr;
+    float* pixels = nullptr;
+
+    shared_framebuffer() = default;
+    shared_framebuffer(const shared_framebuffer&) = delete;
+    shared_framebuffer& operator=(const shared_framebuffer&) = delete;
+    ~shared_framebuffer()
+    {
+        if (header)
+        {
+            ::munmap(header, mapped_size);
+        }
+        if (owner)
+        {
+            ::shm_unlink(name.c_str());
+        }
+    }
+
+    bool create(const std::string& segment, int width, int height)
+    {
+        // A new segment named segment ("/rt_view"), removed again when this is destroyed.
+        name = segment;
+        ::shm_unlink(name.c_str()); // left over from an interactive render that was killed
+        int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        size_t size = sizeof(shared_frame_header) + size_t(width) * height * 3 * sizeof(float);
+        if (fd < 0 || ::ftruncate(fd, off_t(size)) != 0 || !map(fd, size))
+        {
+            std::cerr << "Cannot create shared memory " << name << ": " << std::strerror(errno) << '\n';
+            if (fd >= 0)
+            {
+                ::close(fd);
+                ::shm_unlink(name.c_str());
+            }
+            return false;
+        }
+        ::close(fd);
+        owner = true;
+        new (header) shared_frame_header();
+        header->width = uint32_t(width);
+        header->height = uint32_t(height);
+        std::memcpy(header->magic, shared_frame_header::magic_text, sizeof(header->magic));
+        return true;
+    }
+
+    bool open(const std::string& segment)
+    {
+        // An existing segment, as a viewer.
+        name = segment;
+        int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        struct stat info;
+        if (fd < 0 || ::fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(shared_frame_header)
+            || !map(fd, size_t(info.st_size)))
+        {
+            std::cerr << "Cannot open shared memory " << name << ": " << std::strerror(errno) << '\n';
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        ::close(fd);
+        size_t expected = sizeof(shared_frame_header) + size_t(header->width) * header->height * 3 * sizeof(float);
+        if (std::memcmp(header->magic, shared_frame_header::magic_text, sizeof(header->magic)) != 0 || mapped_size < expected)
+        {
+            std::cerr << name << " is not an interactive render framebuffer\n";
+            return false;
+        }
+        return true;
+    }
+
+    template <typename function>
+    void write_frame(uint32_t scale, uint32_t samples, uint64_t version, const function& pixel)
+    {
+        // Renderer side: fills every pixel from pixel(x, y), which returns an RGB color.
+        uint64_t frame = header->frame.load(std::memory_order_relaxed);
+        header->frame.store(frame + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (uint32_t y = 0; y < header->height; y++)
+        {
+            for (uint32_t x = 0; x < header->width; x++)
+            {
+                auto value = pixel(int(x), int(y));
+                float* out = pixels + 3 * (size_t(y) * header->width + x);
+                out[0] = float(value[0]);
+                out[1] = float(value[1]);
+                out[2] = float(value[2]);
+            }
+        }
+        header->scale = scale;
+        header->samples = samples;
+        header->shown_version.store(version, std::memory_order_relaxed);
+        header->frame.store(frame + 2, std::memory_order_release);
+    }
+
+    bool read_frame(std::vector<float>& out, uint32_t& scale, uint32_t& samples, uint64_t& version) const
+    {
+        // Viewer side: copies a whole image, retrying while the renderer writes one. Returns
+        // false if it kept changing for a second.
+        out.resize(size_t(header->width) * header->height * 3);
+        for (int attempt = 0; attempt < 1000; attempt++)
+        {
+            uint64_t before = header->frame.load(std::memory_order_acquire);
+            if (before % 2 == 0)
+            {
+                std::memcpy(out.data(), pixels, out.size() * sizeof(float));
+                scale = header->scale;
+                samples = header->samples;
+                version = header->shown_version.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (header->frame.load(std::memory_order_relaxed) == before)
+                {
+                    return true;
+                }
+            }
+            ::usleep(1000);
+        }
+        return false;
+    }
+
+private:
+    std::string name;
+    size_t mapped_size = 0;
+    bool owner = false;
+
+    bool map(int fd, size_t size)
+    {
+        void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        mapped_size = size;
+        header = static_cast<shared_frame_header*>(memory);
+        pixels = reinterpret_cast<float*>(static_cast<char*>(memory) + sizeof(shared_frame_header));
+        return true;
+    }
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "grid_medium.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Sparse density storage for large volumes, after OpenVDB's layout cut down to two levels:
+// a dense table with one entry per brick of 8^3 lattice nodes, and a pool holding only the
+// bricks with any density in them. An empty brick costs its four byte table entry, so
+// memory follows the occupied voxels: a 1024^3 grid needs an 8 MB table plus 2 KB per
+// occupied brick, where dense floats would take 4 GB.
+//
+// grid_medium's majorant cells line up with the bricks, so its tracking skips empty
+// bricks one at a time and empty runs of 8^3 bricks in a single coarse step.
+
+class sparse_density_grid : public density_field
+{
+public:
+    static constexpr int brick = 8; // nodes per brick along each axis
+    static constexpr int brick_volume = brick * brick * brick;
+    static constexpr int32_t empty_brick = -1;
+
+    sparse_density_grid(const aabb& bounds, int nx, int ny, int nz)
+        : density_field(bounds, nx, ny, nz),
+          bricks_x((this->nx + brick - 1) / brick), bricks_y((this->ny + brick - 1) / brick), bricks_z((this->nz + brick - 1) / brick),
+          table(size_t(bricks_x) * bricks_y * bricks_z, empty_brick) {}
+
+    static sparse_density_grid* from_dense(scene_arena& arena, const density_grid& dense)
+    {
+        auto sparse = arena.make<sparse_density_grid>(dense.bounds, dense.nx, dense.ny, dense.nz);
+        size_t slice = size_t(dense.nx) * dense.ny;
+        for (int k0 = 0; k0 < dense.nz; k0 += brick)
+        {
+            sparse->add_bricks(&dense.values[k0 * slice], k0, std::min(brick, dense.nz - k0));
+        }
+        return sparse;
+    }
+
+    bool load_raw(const std::string& path)
+    {
+        // A headerless file of nx*ny*nz values, x fastest: 8 bit (mapped to [0, 1]) or 32 bit
+        // float, told apart by the file size. Read a layer of bricks at a time, so loading
+        // never holds more than 8 slices of the dense grid.
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+        {
+            std::cerr << "Cannot open volume " << path << '\n';
+            return false;
+        }
+        size_t slice = size_t(nx) * ny, count = slice * nz;
+        auto size = size_t(file.tellg());
+        bool bytes = size == count;
+        if (!bytes && size != count * sizeof(float))
+        {
+            std::cerr << path << ": " << size << " bytes is neither " << nx << 'x' << ny << 'x' << nz
+                      << " bytes nor floats\n";
+            return false;
+        }
+        file.seekg(0);
+        std::vector<float> layer(slice * brick);
+        std::vector<unsigned char> raw(bytes ? layer.size() : 0);
+        for (int k0 = 0; k0 < nz; k0 += brick)
+        {
+            int depth = std::min(brick, nz - k0);
+            size_t values = slice * depth;
+            if (bytes)
+            {
+                file.read(reinterpret_cast<char*>(raw.data()), std::streamsize(values));
+                for (size_t n = 0; n < values; n++)
+                {
+                    layer[n] = raw[n] * (1.0f / 255);
+                }
+            }
+            else
+            {
+                file.read(reinterpret_cast<char*>(layer.data()), std::streamsize(values * sizeof(float)));
+            }
+            if (!file)
+            {
+                std::cerr << path << ": unexpected end of file\n";
+                return false;
+            }
+            add_bricks(layer.data(), k0, depth);
+        }
+        return true;
+    }
+
+    float value(int i, int j, int k) const
+    {
+        int32_t index = table[(size_t(k / brick) * bricks_y + j / brick) * bricks_x + i / brick];
+        if (index == empty_brick)
+        {
+            return 0;
+        }
+        return pool[size_t(index) * brick_volume + ((k % brick) * brick + j % brick) * brick + i % brick];
+    }
+
+    double lookup(const point3& p) const override
+    {
+        int i, j, k;
+        double fx, fy, fz;
+        if (!lattice_coordinates(p, i, j, k, fx, fy, fz))
+        {
+            return 0;
+        }
+        int li = i % brick, lj = j % brick, lk = k % brick;
+        if (li < brick - 1 && lj < brick - 1 && lk < brick - 1)
+        {
+            // All eight nodes in one brick.
+            int32_t index = table[(size_t(k / brick) * bricks_y + j / brick) * bricks_x + i / brick];
+            if (index == empty_brick)
+            {
+                return 0;
+            }
+            const float* c = &pool[size_t(index) * brick_volume + (lk * brick + lj) * brick + li];
+            const int row = brick, slice = brick * brick;
+            double corners[8] = {c[0], c[1], c[row], c[row + 1], c[slice], c[slice + 1], c[slice + row], c[slice + row + 1]};
+            return trilinear(corners, fx, fy, fz);
+        }
+        double corners[8];
+        for (int n = 0; n < 8; n++)
+        {
+            corners[n] = value(i + (n & 1), j + ((n >> 1) & 1), k + (n >> 2));
+        }
+        return trilinear(corners, fx, fy, fz);
+    }
+
+    float max_over(int i0, int j0, int k0, int i1, int j1, int k1) const override
+    {
+        // Bricks wholly inside the range answer with their stored maximum.
+        i0 = std::max(i0, 0), j0 = std::max(j0, 0), k0 = std::max(k0, 0);
+        i1 = std::min(i1, nx - 1), j1 = std::min(j1, ny - 1), k1 = std::min(k1, nz - 1);
+        float largest = 0;
+        for (int bk = k0 / brick; bk <= k1 / brick; bk++)
+        {
+            for (int bj = j0 / brick; bj <= j1 / brick; bj++)
+            {
+                for (int bi = i0 / brick; bi <= i1 / brick; bi++)
+                {
+                    int32_t index = table[(size_t(bk) * bricks_y + bj) * bricks_x + bi];
+                    if (index == empty_brick || brick_max[index] <= largest)
+                    {
+                        continue;
+                    }
+                    int lo[3] = {std::max(i0, bi * brick), std::max(j0, bj * brick), std::max(k0, bk * brick)};
+                    int hi[3] = {std::min(i1, bi * brick + brick - 1), std::min(j1, bj * brick + brick - 1),
+                                 std::min(k1, bk * brick + brick - 1)};
+                    if (hi[0] - lo[0] == brick - 1 && hi[1] - lo[1] == brick - 1 && hi[2] - lo[2] == brick - 1)
+                    {
+                        largest = brick_max[index];
+                        continue;
+                    }
+                    for (int k = lo[2]; k <= hi[2]; k++)
+                    {
+                        for (int j = lo[1]; j <= hi[1]; j++)
+                        {
+                            for (int i = lo[0]; i <= hi[0]; i++)
+                            {
+                                largest = std::max(largest, value(i, j, k));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return largest;
+    }
+
+    size_t occupied_bricks() const { return brick_max.size(); }
+
+    size_t memory_bytes() const override
+    {
+        return table.size() * sizeof(int32_t) + pool.size() * sizeof(float) + brick_max.size() * sizeof(float);
+    }
+
+private:
+    int bricks_x, bricks_y, bricks_z;
+    std::vector<int32_t> table;  // brick index into pool, or empty_brick; x fastest
+    std::vector<float> pool;     // brick_volume values per occupied brick, x fastest within it
+    std::vector<float> brick_max; // per occupied brick
+
+    void add_bricks(const float* layer, int k0, int depth)
+    {
+        // Stores the bricks of the depth slices from k0 on (k0 a multiple of brick), which
+        // layer holds densely; nodes past the lattice's end are padded with zeros and
+        // negative densities clamped to zero.
+        size_t slice = size_t(nx) * ny;
+        float values[brick_volume];
+        for (int bj = 0; bj < bricks_y; bj++)
+        {
+            for (int bi = 0; bi < bricks_x; bi++)
+            {
+                float largest = 0;
+                for (int lk = 0; lk < brick; lk++)
+                {
+                    for (int lj = 0; lj < brick; lj++)
+                    {
+                        for (int li = 0; li < brick; li++)
+                        {
+                            int i = bi * brick + li, j = bj * brick + lj;
+                            float v = (i < nx && j < ny && lk < depth) ? std::max(0.0f, layer[lk * slice + size_t(j) * nx + i]) : 0.0f;
+                            values[(lk * brick + lj) * brick + li] = v;
+                            largest = std::max(largest, v);
+                        }
+                    }
+                }
+                if (largest > 0)
+                {
+                    table[(size_t(k0 / brick) * bricks_y + bj) * bricks_x + bi] = int32_t(brick_max.size());
+                    pool.insert(pool.end(), values, values + brick_volume);
+                    brick_max.push_back(largest);
+                }
+            }
+        }
+    }
+};
@@ -7,13 +7,21 @@ class sphere : public hittable
 private:
     point3 center;
     double radius;
-    std::shared_ptr<material> mat;
+    const material* mat;
+    aabb bbox;
 public:
-    sphere(const point3& center, double radius, std::shared_ptr<material> mat) 
-        : center(center), radius(std::fmax(0, radius)), mat(mat) {}
+    sphere(const point3& center, double radius, const material* mat) 
+        : center(center), radius(std::fmax(0, radius)), mat(mat)
+    {
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center - rvec, center + rvec);
+    }
+
+    aabb bounding_box() const override { return bbox; }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override
     {
+        STAT_INC(intersection_tests[stat_sphere]);
         auto oc = center - r.origin();
         auto a = r.direction().length_squared();
         auto h = dot(r.direction(), oc);
@@ -41,8 +49,57 @@ public:
         rec.p = r.at(rec.t);
         auto outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        get_sphere_derivatives(outward_normal, rec);
         rec.mat = mat;
 
         return true;
     }
+
+    bool convex() const override { return true; }
+
+    int inside_spans(const ray& r, interval ray_t, interval* spans, int max_count) const override
+    {
+        // Both roots of one quadratic.
+        STAT_INC(intersection_tests[stat_sphere]);
+        auto oc = center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - (radius*radius);
+
+        auto discriminant = h*h - a*c;
+        if (discriminant < 0 || max_count < 1)
+        {
+            return 0;
+        }
+        auto sqrtd = std::sqrt(discriminant);
+        auto span = interval(std::fmax((h - sqrtd) / a, ray_t.min), std::fmin((h + sqrtd) / a, ray_t.max));
+        if (span.min >= span.max)
+        {
+            return 0;
+        }
+        spans[0] = span;
+        return 1;
+    }
+
+private:
+    static void get_sphere_uv(const point3& p, double& u, double& v)
+    {
+        // p: a point on the unit sphere. u: angle around the Y axis from X=-1, v: angle
+        // from Y=-1 to Y=+1, both mapped to [0,1].
+        auto theta = std::acos(std::clamp(-p.y(), -1.0, 1.0));
+        auto phi = std::atan2(-p.z(), p.x()) + pi;
+        u = phi / (2*pi);
+        v = theta / pi;
+    }
+
+    void get_sphere_derivatives(const vec3& n, hit_record& rec) const
+    {
+        // Of get_sphere_uv's mapping, p = center + radius * n; dpdu vanishes at the poles.
+        auto sin_theta = std::sqrt(std::fmax(1e-12, n.x() * n.x() + n.z() * n.z()));
+        rec.dpdu = 2 * pi * radius * vec3(n.z(), 0, -n.x());
+        rec.dpdv = pi * radius * vec3(-n.x() * n.y() / sin_theta, sin_theta, -n.y() * n.z() / sin_theta);
+        rec.dndu = rec.dpdu / radius;
+        rec.dndv = rec.dpdv / radius;
+    }
 };
\ No newline at end of file
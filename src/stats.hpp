@@ -0,0 +1,228 @@
+#pragma once
+
+#include "perf_counters.hpp"
+
+#include <array>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Render statistics. Every thread counts into its own render_stats (see thread_stats()),
+// and the camera merges them once a worker finishes, so counting needs no atomics.
+// Ray counts are always kept since the benchmarks report rays per second; the finer
+// grained counters compile to nothing when RT_NO_STATS is defined.
+
+enum stat_ray_kind { stat_camera_ray, stat_bounce_ray, stat_ray_kinds };
+enum stat_primitive_kind { stat_sphere, stat_quad, stat_triangle, stat_medium, stat_primitive_kinds };
+enum stat_material_kind
+{
+    stat_lambertian, stat_metal, stat_dielectric, stat_diffuse_light, stat_one_sided, stat_isotropic, stat_material_kinds
+};
+enum stat_texture_kind { stat_texel_fetches, stat_shared_tile_lookups, stat_tile_loads, stat_texture_kinds };
+enum stat_medium_kind { stat_majorant_cells, stat_density_lookups, stat_medium_kinds };
+enum stat_phase
+{
+    stat_phase_scene_build, stat_phase_bvh_build, stat_phase_render, stat_phase_denoise, stat_phase_encode, stat_phases
+};
+
+const char* const stat_ray_names[] = {"camera", "bounce"};
+const char* const stat_primitive_names[] = {"sphere", "quad", "triangle", "medium"};
+const char* const stat_material_names[] = {"lambertian", "metal", "dielectric", "diffuse_light", "one_sided", "isotropic"};
+const char* const stat_texture_names[] = {"bilinear_fetches", "shared_cache_lookups", "tile_loads"};
+const char* const stat_medium_names[] = {"majorant_cells", "density_lookups"};
+const char* const stat_phase_names[] = {"scene_build", "bvh_build", "render", "denoise", "encode"};
+
+class render_stats
+{
+public:
+    static const int max_path_length = 64; // longer paths share the last histogram bucket
+
+    std::array<long long, stat_ray_kinds> rays{};
+    std::array<long long, stat_primitive_kinds> intersection_tests{};
+    long long bvh_nodes_visited = 0;
+    std::array<long long, max_path_length + 1> path_length{};
+    std::array<long long, stat_material_kinds> scatter_events{};
+    std::array<long long, stat_texture_kinds> texture_tiles{}; // image texture tile cache, see image_texture.hpp
+    std::array<long long, stat_medium_kinds> medium_tracking{}; // heterogeneous media, see grid_medium.hpp
+    std::array<double, stat_phases> phase_seconds{};
+
+    // Hardware counters, only filled in when requested (camera::count_hardware_events).
+    std::array<perf_counter_values, stat_phases> perf_by_phase{};
+    std::vector<perf_counter_values> perf_by_thread; // render phase, one entry per worker
+
+    bool has_perf_counters() const
+    {
+        for (const auto& values : perf_by_phase)
+        {
+            if (values.valid) return true;
+        }
+        return false;
+    }
+
+    long long total_rays() const
+    {
+        return rays[stat_camera_ray] + rays[stat_bounce_ray];
+    }
+
+    long long traversal_steps() const
+    {
+        long long steps = bvh_nodes_visited;
+        for (auto tests : intersection_tests)
+        {
+            steps += tests;
+        }
+        return steps;
+    }
+
+    void merge(const render_stats& other)
+    {
+        for (int k = 0; k < stat_ray_kinds; k++) rays[k] += other.rays[k];
+        for (int k = 0; k < stat_primitive_kinds; k++) intersection_tests[k] += other.intersection_tests[k];
+        bvh_nodes_visited += other.bvh_nodes_visited;
+        for (int k = 0; k <= max_path_length; k++) path_length[k] += other.path_length[k];
+        for (int k = 0; k < stat_material_kinds; k++) scatter_events[k] += other.scatter_events[k];
+        for (int k = 0; k < stat_texture_kinds; k++) texture_tiles[k] += other.texture_tiles[k];
+        for (int k = 0; k < stat_medium_kinds; k++) medium_tracking[k] += other.medium_tracking[k];
+        for (int k = 0; k < stat_phases; k++) phase_seconds[k] += other.phase_seconds[k];
+        for (int k = 0; k < stat_phases; k++) perf_by_phase[k].merge(other.perf_by_phase[k]);
+        perf_by_thread.insert(perf_by_thread.end(), other.perf_by_thread.begin(), other.perf_by_thread.end());
+    }
+
+    void print_summary(std::ostream& out) const
+    {
+        out << "Render statistics\n";
+        out << "  rays\n";
+        for (int k = 0; k < stat_ray_kinds; k++)
+        {
+            out << "    " << std::left << std::setw(22) << stat_ray_names[k] << rays[k] << '\n';
+        }
+#ifndef RT_NO_STATS
+        out << "  intersection tests\n";
+        for (int k = 0; k < stat_primitive_kinds; k++)
+        {
+            out << "    " << std::left << std::setw(22) << stat_primitive_names[k] << intersection_tests[k] << '\n';
+        }
+        out << "    " << std::left << std::setw(22) << "bvh nodes visited" << bvh_nodes_visited << '\n';
+        out << "  scatter events\n";
+        for (int k = 0; k < stat_material_kinds; k++)
+        {
+            out << "    " << std::left << std::setw(22) << stat_material_names[k] << scatter_events[k] << '\n';
+        }
+        if (texture_tiles[stat_texel_fetches] > 0)
+        {
+            out << "  image texture tiles\n";
+            for (int k = 0; k < stat_texture_kinds; k++)
+            {
+                out << "    " << std::left << std::setw(22) << stat_texture_names[k] << texture_tiles[k] << '\n';
+            }
+        }
+        if (medium_tracking[stat_majorant_cells] > 0)
+        {
+            out << "  medium tracking\n";
+            for (int k = 0; k < stat_medium_kinds; k++)
+            {
+                out << "    " << std::left << std::setw(22) << stat_medium_names[k] << medium_tracking[k] << '\n';
+            }
+        }
+        out << "  path length (bounces: paths)\n    ";
+        int last = max_path_length;
+        while (last > 0 && path_length[last] == 0)
+        {
+            last--;
+        }
+        for (int k = 0; k <= last; k++)
+        {
+            out << k << (k == max_path_length ? "+" : "") << ": " << path_length[k] << (k < last ? ", " : "\n");
+        }
+#endif
+        out << "  phases (seconds)\n";
+        for (int k = 0; k < stat_phases; k++)
+        {
+            out << "    " << std::left << std::setw(22) << stat_phase_names[k] << phase_seconds[k] << '\n';
+        }
+        if (has_perf_counters())
+        {
+            out << "  hardware counters\n";
+            for (int k = 0; k < stat_phases; k++)
+            {
+                out << "    " << std::left << std::setw(22) << stat_phase_names[k];
+                perf_by_phase[k].print(out);
+                out << '\n';
+            }
+            for (size_t t = 0; t < perf_by_thread.size(); t++)
+            {
+                out << "    " << std::left << std::setw(22) << ("render thread " + std::to_string(t));
+                perf_by_thread[t].print(out);
+                out << '\n';
+            }
+        }
+        out << std::right;
+    }
+
+    std::string to_json() const
+    {
+        std::ostringstream out;
+        auto object = [&](const char* const* names, const auto& values, int count)
+        {
+            out << '{';
+            for (int k = 0; k < count; k++)
+            {
+                out << '"' << names[k] << "\": " << values[k] << (k + 1 < count ? ", " : "");
+            }
+            out << '}';
+        };
+
+        out << "{\n  \"rays\": ";
+        object(stat_ray_names, rays, stat_ray_kinds);
+#ifndef RT_NO_STATS
+        out << ",\n  \"intersection_tests\": ";
+        object(stat_primitive_names, intersection_tests, stat_primitive_kinds);
+        out << ",\n  \"bvh_nodes_visited\": " << bvh_nodes_visited;
+        out << ",\n  \"scatter_events\": ";
+        object(stat_material_names, scatter_events, stat_material_kinds);
+        out << ",\n  \"texture_tiles\": ";
+        object(stat_texture_names, texture_tiles, stat_texture_kinds);
+        out << ",\n  \"medium_tracking\": ";
+        object(stat_medium_names, medium_tracking, stat_medium_kinds);
+        out << ",\n  \"path_length_histogram\": [";
+        for (int k = 0; k <= max_path_length; k++)
+        {
+            out << path_length[k] << (k < max_path_length ? ", " : "");
+        }
+        out << ']';
+#endif
+        out << ",\n  \"phase_seconds\": ";
+        object(stat_phase_names, phase_seconds, stat_phases);
+        if (has_perf_counters())
+        {
+            out << ",\n  \"perf_counters\": {";
+            for (int k = 0; k < stat_phases; k++)
+            {
+                out << '"' << stat_phase_names[k] << "\": " << perf_by_phase[k].to_json() << ", ";
+            }
+            out << "\"render_threads\": [";
+            for (size_t t = 0; t < perf_by_thread.size(); t++)
+            {
+                out << perf_by_thread[t].to_json() << (t + 1 < perf_by_thread.size() ? ", " : "");
+            }
+            out << "]}";
+        }
+        out << "\n}\n";
+        return out.str();
+    }
+};
+
+render_stats& thread_stats()
+{
+    thread_local render_stats stats;
+    return stats;
+}
+
+#define STAT_RAY(kind) (thread_stats().rays[kind]++)
+
+#ifndef RT_NO_STATS
+#define STAT_INC(counter) (thread_stats().counter++)
+#else
+#define STAT_INC(counter) ((void)0)
+#endif
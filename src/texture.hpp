@@ -1,9 +1,111 @@
 #pragma once
 
+#include "scene_arena.hpp"
+
+#include <vector>
+
+class texture;
+class flat_texture;
+
+enum texture_node_kind : uint8_t
+{
+    texture_constant,
+    texture_checker,
+    texture_external // evaluated through the texture's virtual functions
+};
+
+class texture_node
+{
+    // One texture of a flat_texture, by value.
+public:
+    texture_node_kind kind = texture_constant;
+    int32_t even = 0, odd = 0; // checker: the sides' nodes in flat_texture::children
+    double inv_scale = 0;      // checker
+    color value;               // constant
+    const texture* external = nullptr;
+};
+
+bool checker_is_even(double inv_scale, const point3& p)
+{
+    auto xInt = int(std::floor(inv_scale * p.x()));
+    auto yInt = int(std::floor(inv_scale * p.y()));
+    auto zInt = int(std::floor(inv_scale * p.z()));
+    return (xInt + yInt + zInt) % 2 == 0;
+}
+
 class texture
 {
 public:
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    virtual texture_node flatten(flat_texture& /*into*/) const
+    {
+        // This texture as a node of the flat texture it goes into, adding any it refers to
+        // there as children. Textures evaluated on their own are a single external node.
+        texture_node node;
+        node.kind = texture_external;
+        node.external = this;
+        return node;
+    }
+
+    virtual color filtered_value(double u, double v, const point3& p, double /*footprint*/) const
+    {
+        // Averaged over about the footprint in u and v (hit_record::uv_footprint); textures
+        // without prefiltered versions point sample and ignore it.
+        return value(u, v, p);
+    }
+
+    virtual void value_batch(int count, const double* u, const double* v, const point3* p, color* out) const
+    {
+        // out[k] = value(u[k], v[k], p[k]), for shading many points per call; textures that
+        // evaluate faster in groups override it.
+        for (int k = 0; k < count; k++)
+        {
+            out[k] = value(u[k], v[k], p[k]);
+        }
+    }
+};
+
+class flat_texture
+{
+    // A material's texture flattened when the material is built: the root node held by
+    // value, so a constant color is read straight from the material, and checker sides in
+    // one contiguous array instead of behind pointers and virtual calls. Other textures
+    // stay external nodes.
+public:
+    flat_texture(const color& albedo)
+    {
+        root.value = albedo;
+    }
+
+    flat_texture(const texture* tex)
+    {
+        root = tex->flatten(*this);
+    }
+
+    color value(double u, double v, const point3& p, double footprint = 0) const
+    {
+        const texture_node* node = &root;
+        while (node->kind == texture_checker)
+        {
+            node = &children[checker_is_even(node->inv_scale, p) ? node->even : node->odd];
+        }
+        if (node->kind == texture_constant)
+        {
+            return node->value;
+        }
+        return node->external->filtered_value(u, v, p, footprint);
+    }
+
+    int32_t add(const texture_node& node)
+    {
+        children.push_back(node);
+        return int32_t(children.size() - 1);
+    }
+
+private:
+    texture_node root;
+    std::vector<texture_node> children;
 };
 
 class solid_color : public texture
@@ -16,6 +118,13 @@ public:
     {
         return albedo;
     }
+
+    texture_node flatten(flat_texture&) const override
+    {
+        texture_node node;
+        node.value = albedo;
+        return node;
+    }
 private:
     color albedo;
 };
@@ -24,24 +133,33 @@ class checker_texture : public texture
 {
 private:
     double inv_scale;
-    std::shared_ptr<texture> even;
-    std::shared_ptr<texture> odd;
+    const texture* even;
+    const texture* odd;
 
 public:
-    checker_texture(double scale, std::shared_ptr<texture> even, std::shared_ptr<texture> odd)
+    checker_texture(double scale, const texture* even, const texture* odd)
         : inv_scale(1.0/scale), even(even), odd(odd) {}
 
-    checker_texture(double scale, const color& even, const color& odd)
-        : checker_texture(scale,std::make_shared<solid_color>(even),std::make_shared<solid_color>(odd)) {}
+    checker_texture(double scale, const color& even, const color& odd, scene_arena& arena)
+        : checker_texture(scale, arena.make<solid_color>(even), arena.make<solid_color>(odd)) {}
 
     color value(double u, double v, const point3& p) const override
     {
-        auto xInt = int(std::floor(inv_scale * p.x()));
-        auto yInt = int(std::floor(inv_scale * p.y()));
-        auto zInt = int(std::floor(inv_scale * p.z()));
+        return checker_is_even(inv_scale, p) ? even->value(u,v,p) : odd->value(u,v,p);
+    }
 
-        bool is_even = (xInt + yInt + zInt) % 2 == 0;
+    color filtered_value(double u, double v, const point3& p, double footprint) const override
+    {
+        return checker_is_even(inv_scale, p) ? even->filtered_value(u,v,p,footprint) : odd->filtered_value(u,v,p,footprint);
+    }
 
-        return is_even ? even->value(u,v,p) : odd->value(u,v,p);
+    texture_node flatten(flat_texture& into) const override
+    {
+        texture_node node;
+        node.kind = texture_checker;
+        node.inv_scale = inv_scale;
+        node.even = into.add(even->flatten(into));
+        node.odd = into.add(odd->flatten(into));
+        return node;
     }
 };
\ No newline at end of file
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline tracing in the Chrome trace event format (open in Perfetto or chrome://tracing).
+// Each thread appends to its own buffer without locking; the registry lock is only taken
+// the first time a thread records an event and when it exits. A finished thread hands its
+// buffer back, so the workers of later passes continue the same "worker N" tracks instead
+// of adding new ones. While tracing is disabled a scope costs one relaxed load, and
+// defining RT_NO_TRACE removes the scopes entirely.
+
+class trace_event
+{
+public:
+    const char* name;     // string literal, never freed
+    long long arg;        // shown in the event's args, -1 for none
+    double begin_us;
+    double end_us;
+};
+
+class trace_buffer
+{
+public:
+    int thread_id;
+    std::string thread_name;
+    std::vector<trace_event> events;
+};
+
+class tracer
+{
+public:
+    static tracer& instance()
+    {
+        static tracer global;
+        return global;
+    }
+
+    bool enabled() const { return is_enabled.load(std::memory_order_relaxed); }
+
+    void enable()
+    {
+        epoch = std::chrono::steady_clock::now();
+        thread_buffer(); // the enabling thread is listed as "main"
+        is_enabled.store(true, std::memory_order_relaxed);
+    }
+
+    void disable()
+    {
+        // Stops recording and drops what was not written, so a long-running process only
+        // traces the jobs that ask for it. Call once all traced threads have finished.
+        is_enabled.store(false, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (const auto& buffer : buffers)
+        {
+            buffer->events.clear();
+        }
+    }
+
+    double now_us() const
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    trace_buffer& thread_buffer()
+    {
+        thread_local buffer_lease lease;
+        if (!lease.buffer)
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            if (!idle.empty())
+            {
+                // The lowest free slot, so a pass's workers line up with the previous pass's.
+                auto lowest = std::min_element(idle.begin(), idle.end(),
+                                               [](const trace_buffer* a, const trace_buffer* b) { return a->thread_id < b->thread_id; });
+                lease.buffer = *lowest;
+                idle.erase(lowest);
+            }
+            else
+            {
+                buffers.push_back(std::make_unique<trace_buffer>());
+                lease.buffer = buffers.back().get();
+                lease.buffer->thread_id = int(buffers.size());
+                lease.buffer->thread_name = (lease.buffer->thread_id == 1) ? "main" : "worker " + std::to_string(lease.buffer->thread_id - 1);
+                lease.buffer->events.reserve(4096);
+            }
+        }
+        return *lease.buffer;
+    }
+
+    bool write_json(const std::string& path)
+    {
+        // Call once all traced threads have finished.
+        std::ofstream out(path);
+        if (!out)
+        {
+            std::cerr << "Cannot write trace " << path << '\n';
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        out.precision(3);
+        out << std::fixed << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        for (const auto& buffer : buffers)
+        {
+            out << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": "
+                << buffer->thread_id << ", \"args\": {\"name\": \"" << buffer->thread_name << "\"}}";
+            first = false;
+            for (const auto& event : buffer->events)
+            {
+                out << ",\n{\"ph\": \"X\", \"name\": \"" << event.name << "\", \"pid\": 1, \"tid\": " << buffer->thread_id
+                    << ", \"ts\": " << event.begin_us << ", \"dur\": " << event.end_us - event.begin_us;
+                if (event.arg >= 0)
+                {
+                    out << ", \"args\": {\"index\": " << event.arg << '}';
+                }
+                out << '}';
+            }
+        }
+        out << "\n]}\n";
+        for (const auto& buffer : buffers)
+        {
+            // A server writes one trace per job; the next starts from empty tracks.
+            buffer->events.clear();
+        }
+        return bool(out);
+    }
+
+private:
+    class buffer_lease
+    {
+        // Returns the thread's buffer to the idle list when the thread exits.
+    public:
+        trace_buffer* buffer = nullptr;
+
+        ~buffer_lease()
+        {
+            if (buffer)
+            {
+                tracer& owner = tracer::instance();
+                std::lock_guard<std::mutex> lock(owner.registry_mutex);
+                owner.idle.push_back(buffer);
+            }
+        }
+    };
+
+    std::atomic<bool> is_enabled{false};
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex registry_mutex;
+    std::vector<std::unique_ptr<trace_buffer>> buffers;
+    std::vector<trace_buffer*> idle; // buffers of exited threads
+};
+
+class trace_scope
+{
+    // Records one complete event spanning the scope's lifetime.
+public:
+    trace_scope(const char* name, long long arg = -1)
+    {
+        if (tracer::instance().enabled())
+        {
+            event.name = name;
+            event.arg = arg;
+            event.begin_us = tracer::instance().now_us();
+            active = true;
+        }
+    }
+
+    ~trace_scope()
+    {
+        if (active)
+        {
+            event.end_us = tracer::instance().now_us();
+            tracer::instance().thread_buffer().events.push_back(event);
+        }
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+private:
+    trace_event event;
+    bool active = false;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifndef RT_NO_TRACE
+#define TRACE_SCOPE(...) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+#else
+#define TRACE_SCOPE(...) ((void)0)
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "quad.hpp"
+#include "scene_arena.hpp"
+
+class triangle : public quad
+{
+    // The triangle (Q, Q+u, Q+v); shares the plane intersection with quad and only
+    // tightens the interior test and the bounding box.
+public:
+    triangle(const point3& Q, const vec3& u, const vec3& v, const material* mat) : quad(Q, u, v, mat)
+    {
+        bbox = aabb(aabb(Q, Q + u), aabb(Q, Q + v));
+        stat_kind = stat_triangle;
+    }
+
+    static triangle* from_vertices(scene_arena& arena, const point3& a, const point3& b, const point3& c,
+                                                   const material* mat)
+    {
+        return arena.make<triangle>(a, b - a, c - a, mat);
+    }
+
+    bool is_interior(double a, double b, hit_record& rec) const override
+    {
+        if (a < 0 || b < 0 || a + b > 1)
+        {
+            return false;
+        }
+        rec.u = a;
+        rec.v = b;
+        return true;
+    }
+};
@@ -142,6 +142,18 @@ vec3 random_unit_vector()
     }
 }
 
+vec3 random_in_unit_disk()
+{
+    while (true)
+    {
+        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
+        if (p.length_squared() < 1)
+        {
+            return p;
+        }
+    }
+}
+
 vec3 random_vec_on_hemisphere(const vec3& normal)
 {
     vec3 on_unit_sphere = random_unit_vector();
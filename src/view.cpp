@@ -0,0 +1,131 @@
+// Viewer side of an interactive render (raytracer --interactive NAME).
+//
+//   g++ -std=c++17 -O3 -pthread src/view.cpp -o view -lrt
+//   ./view NAME [--lookfrom X,Y,Z] [--lookat X,Y,Z] [--up X,Y,Z] [--vfov DEG]
+//               [--wait] [--snapshot PATH] [--quit]
+//
+// Camera options are written to the shared framebuffer, which makes the renderer drop
+// its work and start over with them. --wait blocks until the image shows that view at
+// full resolution and sample count, --snapshot writes the current image (png, pfm, ...)
+// and --quit ends the interactive render. With none of these it prints the state.
+
+#include "common.hpp"
+#include "image_io.hpp"
+#include "shared_framebuffer.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+bool write_snapshot(const std::vector<float>& pixels, int width, int height, const std::string& path)
+{
+    auto format = image_format_from_path(path);
+    std::vector<color> colors(size_t(width) * height);
+    for (size_t k = 0; k < colors.size(); k++)
+    {
+        colors[k] = color(pixels[3*k], pixels[3*k + 1], pixels[3*k + 2]);
+    }
+    if (!ensure_parent_directory(path))
+    {
+        return false;
+    }
+    if (is_float_format(format))
+    {
+        return write_float_image(path, format, width, height, colors.data());
+    }
+    std::vector<unsigned char> rgb(colors.size() * 3);
+    for (size_t k = 0; k < colors.size(); k++)
+    {
+        write_color(&rgb[3 * k], colors[k]);
+    }
+    return write_image(path, format, width, height, rgb.data(), int(std::thread::hardware_concurrency()));
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argv[1][0] == '-')
+    {
+        std::cerr << "Usage: " << argv[0] << " NAME [--lookfrom X,Y,Z] [--lookat X,Y,Z] [--up X,Y,Z] [--vfov DEG]"
+                  << " [--wait] [--snapshot PATH] [--quit]\n";
+        return 2;
+    }
+    shared_framebuffer framebuffer;
+    if (!framebuffer.open(argv[1]))
+    {
+        return 1;
+    }
+    auto& header = *framebuffer.header;
+
+    shared_view view = header.view;
+    bool view_changed = false, wait = false, quit = false;
+    std::string snapshot_path;
+    for (int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        bool ok = true;
+        auto parse_vector = [&](double* out)
+        {
+            view_changed = true;
+            return std::sscanf(argv[++i], "%lf,%lf,%lf", &out[0], &out[1], &out[2]) == 3;
+        };
+        if (arg == "--lookfrom" && has_value)       ok = parse_vector(view.lookfrom);
+        else if (arg == "--lookat" && has_value)    ok = parse_vector(view.lookat);
+        else if (arg == "--up" && has_value)        ok = parse_vector(view.up);
+        else if (arg == "--vfov" && has_value)
+        {
+            view_changed = true;
+            ok = std::sscanf(argv[++i], "%lf", &view.vfov) == 1 && view.vfov > 0 && view.vfov < 180;
+        }
+        else if (arg == "--snapshot" && has_value)  snapshot_path = argv[++i];
+        else if (arg == "--wait")                   wait = true;
+        else if (arg == "--quit")                   quit = true;
+        else
+        {
+            std::cerr << "Unknown option " << arg << '\n';
+            return 2;
+        }
+        if (!ok)
+        {
+            std::cerr << "Invalid value '" << argv[i] << "' for " << arg << '\n';
+            return 2;
+        }
+    }
+
+    if (view_changed)
+    {
+        header.view = view;
+        header.view_version.fetch_add(1, std::memory_order_release);
+    }
+
+    std::vector<float> pixels;
+    uint32_t scale = 0, samples = 0;
+    uint64_t shown = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (true)
+    {
+        if (!framebuffer.read_frame(pixels, scale, samples, shown))
+        {
+            std::cerr << "The framebuffer kept changing while reading it\n";
+            return 1;
+        }
+        bool complete = shown == header.view_version.load() && scale == 1 && samples >= header.target_samples;
+        if (!wait || complete)
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - start;
+    std::clog << "View " << shown << ": " << header.width << 'x' << header.height << " at 1/" << scale << " resolution, "
+              << samples << '/' << header.target_samples << " spp" << (wait ? ", waited " + std::to_string(int(waited.count())) + " ms" : "") << '\n';
+
+    bool written = snapshot_path.empty() || write_snapshot(pixels, int(header.width), int(header.height), snapshot_path);
+    if (quit)
+    {
+        header.quit = 1;
+    }
+    return written ? 0 : 1;
+}